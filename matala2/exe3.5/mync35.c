@@ -7,6 +7,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <pthread.h>
+#include <errno.h>
 
 void process_mode4(int port, const char *client_host, int client_port, int mode);
 void process_mode123(int port, int mode);
@@ -162,12 +163,7 @@ void process_mode123(int port, int mode)
         }
         else
         {
-            char buffer[1024];
-            int bytes_read;
-            while ((bytes_read = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0)
-            {
-                write(new_socket, buffer, bytes_read);
-            }
+            relay_input(STDIN_FILENO, new_socket);
         }
     }
     else if (mode == 1)
@@ -283,6 +279,8 @@ void process_mode4(int port, const char *client_host, int client_port, int mode)
     close(server_fd);
 }
 
+// method to copy everything from source to destination. short writes are continued so no data is lost,
+// and since the writes block a slow destination also stops the reading from the source
 void relay_input(int source, int destination)
 {
     char buffer[1024];
@@ -291,6 +289,20 @@ void relay_input(int source, int destination)
     fflush(stdout);
     while ((bytes_read = read(source, buffer, sizeof(buffer))) > 0)
     {
-        write(destination, buffer, bytes_read);
+        char *data = buffer;
+        while (bytes_read > 0)
+        {
+            int written = write(destination, data, bytes_read);
+            if (written == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (written == -1)
+            {
+                return;
+            }
+            data += written;
+            bytes_read -= written;
+        }
     }
 }
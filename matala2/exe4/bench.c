@@ -0,0 +1,600 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// seconds measured per case and message sizes when not given on the command line
+#define DEFAULT_SECONDS 2.0
+#define DEFAULT_SIZES "64,1024,16384"
+// first port used by the cases, every case takes the next two ports so that no case waits for TIME_WAIT sockets
+#define DEFAULT_BASE_PORT 7400
+// the generator keeps at most WINDOW_BYTES (but at least WINDOW_MESSAGES messages) sent and not yet received, so a
+// UDP case measures what mync forwards instead of how fast the socket buffers overflow. a datagram takes about
+// DATAGRAM_OVERHEAD bytes of a socket buffer more than its payload
+#define WINDOW_BYTES (128 * 1024)
+#define WINDOW_MESSAGES 4
+#define DATAGRAM_OVERHEAD 1024
+// a full window that does not move for this long is counted as lost and the generator goes on
+#define STALL_NS (100 * 1000000ULL)
+// time for mync to start listening and connect to the sink, and for the sink to drain after the window
+#define START_TIMEOUT_MS 5000
+#define DRAIN_NS (300 * 1000000ULL)
+// latency histogram: buckets of 100 ns up to 10 ms, slower messages go to the last bucket
+#define LATENCY_BUCKET_NS 100
+#define LATENCY_BUCKETS 100000
+#define MESSAGE_MAGIC 0x6d796e63
+#define MIN_MESSAGE_SIZE 16
+#define MAX_MESSAGE_SIZE 65000
+#define SINK_BUFFER_SIZE (256 * 1024)
+// receive buffer asked for the UDP sink (the kernel caps it at net.core.rmem_max)
+#define SINK_RCVBUF (4 << 20)
+
+// kinds of the generator and sink ends of a case: ECHO means the data comes back on the generator's own socket
+enum end_kind
+{
+    END_TCP,
+    END_UDP,
+    END_UDS,
+    END_ECHO
+};
+
+// one invocation of mync: the arguments are a format with the input port (or socket number) and the output port
+struct bench_case
+{
+    const char *name;
+    const char *args;
+    enum end_kind input;
+    enum end_kind output;
+};
+
+// the invocation shapes of the README, every mode of the relay helpers and of run_program is covered
+struct bench_case cases[] = {
+    {"tcp-tcp", "-i TCPS%d -o TCPClocalhost,%d", END_TCP, END_TCP},
+    {"udp-udp", "-i UDPS%d -o UDPClocalhost,%d", END_UDP, END_UDP},
+    {"tcp-udp", "-i TCPS%d -o UDPClocalhost,%d", END_TCP, END_UDP},
+    {"udp-tcp", "-i UDPS%d -o TCPClocalhost,%d", END_UDP, END_TCP},
+    {"uds-uds", "-i UDSSS/tmp/mync-bench-%d.sock -o UDSCS/tmp/mync-bench-%d.sock", END_UDS, END_UDS},
+    {"tcp-echo", "-b TCPS%d", END_TCP, END_ECHO},
+    {"exec-tcp-tcp", "-e cat -i TCPS%d -o TCPClocalhost,%d", END_TCP, END_TCP},
+    {"exec-udp-udp", "-e cat -i UDPS%d -o UDPClocalhost,%d", END_UDP, END_UDP},
+    {"exec-tcp-udp", "-e cat -i TCPS%d -o UDPClocalhost,%d", END_TCP, END_UDP},
+    {"exec-tcpmuxs-echo", "-e cat -b TCPMUXS%d", END_TCP, END_ECHO},
+};
+
+// header at the start of every message, the rest of the message is filler
+struct message_header
+{
+    uint32_t magic;
+    uint32_t size;
+    uint64_t sent_ns;
+};
+
+// state shared by the generator (main thread) and the sink thread of a case
+struct run
+{
+    size_t size;
+    int sink_fd;
+    int sink_listen_fd;
+    uint64_t window_start_ns;
+    uint64_t window_end_ns;
+    unsigned long received;
+    unsigned long window_received;
+    unsigned long misframed;
+    int stop;
+    unsigned long *latency;
+    // the generator sleeps on the condition while its window is full
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+};
+
+void printErrorAndExit(const char *message)
+{
+    perror(message);
+    exit(EXIT_FAILURE);
+}
+
+// method returning the time in nanoseconds, generator and sink share the clock so a message carries its send time
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void sleep_ns(uint64_t ns)
+{
+    struct timespec ts = {ns / 1000000000, ns % 1000000000};
+    nanosleep(&ts, NULL);
+}
+
+// method to fill an address of 127.0.0.1 or of a unix socket of the benchmark
+socklen_t bench_address(struct sockaddr_storage *address, enum end_kind kind, int port)
+{
+    memset(address, 0, sizeof(*address));
+    if (kind == END_UDS)
+    {
+        struct sockaddr_un *un = (struct sockaddr_un *)address;
+        un->sun_family = AF_UNIX;
+        snprintf(un->sun_path, sizeof(un->sun_path), "/tmp/mync-bench-%d.sock", port);
+        return sizeof(*un);
+    }
+    struct sockaddr_in *in = (struct sockaddr_in *)address;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return sizeof(*in);
+}
+
+// method to open the sink before mync starts: mync connects its output to it
+int open_sink(enum end_kind kind, int port)
+{
+    struct sockaddr_storage address;
+    socklen_t len = bench_address(&address, kind, port);
+    int one = 1;
+    int fd = socket(address.ss_family, kind == END_UDP ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        printErrorAndExit("socket");
+    }
+    if (kind == END_UDS)
+    {
+        unlink(((struct sockaddr_un *)&address)->sun_path);
+    }
+    else
+    {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if (bind(fd, (struct sockaddr *)&address, len) == -1)
+    {
+        printErrorAndExit("bind");
+    }
+    if (kind == END_UDP)
+    {
+        int rcvbuf = SINK_RCVBUF;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+    else if (listen(fd, 1) == -1)
+    {
+        printErrorAndExit("listen");
+    }
+    return fd;
+}
+
+// method to connect the generator to mync, retried until mync listens. a UDP socket is connected right away
+int open_generator(enum end_kind kind, int port)
+{
+    struct sockaddr_storage address;
+    socklen_t len = bench_address(&address, kind, port);
+    uint64_t deadline = now_ns() + START_TIMEOUT_MS * 1000000ULL;
+    while (1)
+    {
+        int fd = socket(address.ss_family, kind == END_UDP ? SOCK_DGRAM : SOCK_STREAM, 0);
+        if (fd == -1)
+        {
+            printErrorAndExit("socket");
+        }
+        if (connect(fd, (struct sockaddr *)&address, len) == 0)
+        {
+            return fd;
+        }
+        close(fd);
+        if (now_ns() > deadline)
+        {
+            return -1;
+        }
+        sleep_ns(10 * 1000000);
+    }
+}
+
+// method returning the offset of the next message header after a lost piece of data, or the offset from which
+// the data has to be kept because a header may start there
+size_t sink_resync(struct run *run, char *data, size_t from, size_t len)
+{
+    struct message_header header;
+    for (size_t offset = from + 1; offset + sizeof(header) <= len; ++offset)
+    {
+        memcpy(&header, data + offset, sizeof(header));
+        if (header.magic == MESSAGE_MAGIC && header.size == run->size)
+        {
+            return offset;
+        }
+    }
+    return len - sizeof(header) + 1 > from ? len - sizeof(header) + 1 : from + 1;
+}
+
+// method to count the complete messages at the start of data, returns the number of bytes consumed. a message
+// that does not start with the magic (data lost in the middle of a stream sent as datagrams) is skipped up to the
+// next header
+size_t sink_messages(struct run *run, char *data, size_t len)
+{
+    size_t used = 0;
+    while (len - used >= run->size)
+    {
+        struct message_header header;
+        memcpy(&header, data + used, sizeof(header));
+        if (header.magic != MESSAGE_MAGIC || header.size != run->size)
+        {
+            __atomic_add_fetch(&run->misframed, 1, __ATOMIC_RELAXED);
+            used = sink_resync(run, data, used, len);
+            continue;
+        }
+        uint64_t now = now_ns();
+        if (header.sent_ns >= __atomic_load_n(&run->window_start_ns, __ATOMIC_RELAXED) && header.sent_ns < __atomic_load_n(&run->window_end_ns, __ATOMIC_RELAXED))
+        {
+            uint64_t bucket = (now - header.sent_ns) / LATENCY_BUCKET_NS;
+            run->latency[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+            __atomic_add_fetch(&run->window_received, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_add_fetch(&run->received, 1, __ATOMIC_RELEASE);
+        used += run->size;
+    }
+    return used;
+}
+
+// sink thread: accepts mync's output connection and reassembles the messages of a stream or of datagrams
+void *sink_thread(void *arg)
+{
+    struct run *run = arg;
+    char *buffer = malloc(SINK_BUFFER_SIZE + MAX_MESSAGE_SIZE);
+    size_t len = 0;
+    if (buffer == NULL)
+    {
+        printErrorAndExit("malloc");
+    }
+    if (run->sink_listen_fd != -1)
+    {
+        struct pollfd pfd = {.fd = run->sink_listen_fd, .events = POLLIN};
+        if (poll(&pfd, 1, START_TIMEOUT_MS) <= 0 || (run->sink_fd = accept(run->sink_listen_fd, NULL, NULL)) == -1)
+        {
+            free(buffer);
+            return NULL;
+        }
+    }
+    while (!__atomic_load_n(&run->stop, __ATOMIC_ACQUIRE))
+    {
+        struct pollfd pfd = {.fd = run->sink_fd, .events = POLLIN};
+        if (poll(&pfd, 1, 50) <= 0)
+        {
+            continue;
+        }
+        ssize_t n = recv(run->sink_fd, buffer + len, SINK_BUFFER_SIZE, 0);
+        if (n <= 0)
+        {
+            break;
+        }
+        len += n;
+        unsigned long received = __atomic_load_n(&run->received, __ATOMIC_RELAXED);
+        size_t used = sink_messages(run, buffer, len);
+        memmove(buffer, buffer + used, len - used);
+        len -= used;
+        if (__atomic_load_n(&run->received, __ATOMIC_RELAXED) != received)
+        {
+            pthread_mutex_lock(&run->lock);
+            pthread_cond_signal(&run->progress);
+            pthread_mutex_unlock(&run->lock);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+// method to add up the CPU time in clock ticks of all processes of the session of mync, including the children
+// they already reaped (programs started with -e have their own process group but stay in the session)
+unsigned long session_cpu(pid_t sid, int kill_them)
+{
+    unsigned long ticks = 0;
+    DIR *proc = opendir("/proc");
+    struct dirent *entry;
+    if (proc == NULL)
+    {
+        return 0;
+    }
+    while ((entry = readdir(proc)) != NULL)
+    {
+        char path[64], line[1024];
+        pid_t pid = atoi(entry->d_name);
+        if (pid <= 0)
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+        FILE *file = fopen(path, "r");
+        if (file == NULL)
+        {
+            continue;
+        }
+        char *fields = fgets(line, sizeof(line), file) ? strrchr(line, ')') : NULL;
+        fclose(file);
+        int session;
+        unsigned long utime, stime;
+        long cutime, cstime;
+        // fields after the command: state ppid pgrp session tty tpgid flags minflt cminflt majflt cmajflt utime
+        // stime cutime cstime
+        if (fields == NULL || sscanf(fields, ") %*c %*d %*d %d %*d %*d %*u %*u %*u %*u %*u %lu %lu %ld %ld", &session, &utime, &stime, &cutime, &cstime) != 5 || session != sid)
+        {
+            continue;
+        }
+        ticks += utime + stime + cutime + cstime;
+        if (kill_them)
+        {
+            kill(pid, SIGKILL);
+        }
+    }
+    closedir(proc);
+    return ticks;
+}
+
+// method to start mync in its own session with the arguments of a case, its output goes to /dev/null
+pid_t start_mync(const char *mync, struct bench_case *bench_case, int input_port, int output_port)
+{
+    char line[512];
+    char *args[32] = {(char *)mync};
+    int argc = 1;
+    snprintf(line, sizeof(line), bench_case->args, input_port, output_port);
+    for (char *word = strtok(line, " "); word != NULL && argc < 31; word = strtok(NULL, " "))
+    {
+        args[argc++] = word;
+    }
+    args[argc] = NULL;
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        printErrorAndExit("fork");
+    }
+    else if (pid == 0)
+    {
+        int null_fd = open("/dev/null", O_RDWR);
+        setsid();
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        execv(mync, args);
+        _exit(127);
+    }
+    return pid;
+}
+
+// method returning the latency in microseconds below which the given fraction of the messages arrived
+double latency_percentile(unsigned long *latency, unsigned long count, double fraction)
+{
+    unsigned long seen = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS && count > 0; ++bucket)
+    {
+        seen += latency[bucket];
+        if (seen >= fraction * count)
+        {
+            return (bucket + 1) * LATENCY_BUCKET_NS / 1000.0;
+        }
+    }
+    return 0;
+}
+
+// method to run one case with one message size and print its result as a JSON object
+void run_case(const char *mync, struct bench_case *bench_case, size_t size, double seconds, int input_port, int output_port, int first)
+{
+    struct run run = {.size = size, .sink_fd = -1, .sink_listen_fd = -1, .window_start_ns = UINT64_MAX, .window_end_ns = UINT64_MAX};
+    run.latency = calloc(LATENCY_BUCKETS, sizeof(unsigned long));
+    char *message = malloc(size);
+    if (run.latency == NULL || message == NULL)
+    {
+        printErrorAndExit("malloc");
+    }
+    memset(message, 'x', size);
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.progress, NULL);
+
+    if (bench_case->output == END_UDP)
+    {
+        run.sink_fd = open_sink(END_UDP, output_port);
+    }
+    else if (bench_case->output != END_ECHO)
+    {
+        run.sink_listen_fd = open_sink(bench_case->output, output_port);
+    }
+    pid_t pid = start_mync(mync, bench_case, input_port, output_port);
+    int generator_fd = open_generator(bench_case->input, input_port);
+    if (bench_case->output == END_ECHO)
+    {
+        run.sink_fd = generator_fd;
+    }
+    pthread_t sink;
+    if (generator_fd == -1 || pthread_create(&sink, NULL, sink_thread, &run) != 0)
+    {
+        fprintf(stderr, "%s: mync did not start\n", bench_case->name);
+        exit(EXIT_FAILURE);
+    }
+
+    // until the first message went through (a UDP server only learns its client from a datagram) the generator
+    // sends one message every 20 ms, then the window is measured
+    size_t footprint = size + (bench_case->input == END_UDP || bench_case->output == END_UDP ? DATAGRAM_OVERHEAD : 0);
+    unsigned long window = WINDOW_BYTES / footprint > WINDOW_MESSAGES ? WINDOW_BYTES / footprint : WINDOW_MESSAGES;
+    unsigned long sent = 0, lost = 0, window_sent = 0;
+    uint64_t start = now_ns();
+    while (__atomic_load_n(&run.received, __ATOMIC_ACQUIRE) == 0 && now_ns() - start < START_TIMEOUT_MS * 1000000ULL)
+    {
+        struct message_header header = {MESSAGE_MAGIC, size, now_ns()};
+        memcpy(message, &header, sizeof(header));
+        if (send(generator_fd, message, size, MSG_NOSIGNAL) == (ssize_t)size)
+        {
+            sent++;
+        }
+        sleep_ns(20 * 1000000);
+    }
+    sleep_ns(50 * 1000000);
+    lost = sent - __atomic_load_n(&run.received, __ATOMIC_ACQUIRE);
+
+    unsigned long cpu_start = session_cpu(pid, 0);
+    uint64_t progress_ns = now_ns();
+    unsigned long progress = 0;
+    uint64_t window_start = now_ns();
+    __atomic_store_n(&run.window_end_ns, window_start + (uint64_t)(seconds * 1e9), __ATOMIC_RELAXED);
+    __atomic_store_n(&run.window_start_ns, window_start, __ATOMIC_RELAXED);
+    while (1)
+    {
+        uint64_t now = now_ns();
+        unsigned long received = __atomic_load_n(&run.received, __ATOMIC_ACQUIRE);
+        if (now >= window_start + (uint64_t)(seconds * 1e9))
+        {
+            break;
+        }
+        if (received != progress)
+        {
+            progress = received;
+            progress_ns = now;
+        }
+        // late probes can arrive after they were counted as lost, so the messages in flight are signed
+        if ((long)(sent - received) - (long)lost >= (long)window)
+        {
+            // a window that stopped moving was lost (datagrams dropped by a socket buffer)
+            if (now - progress_ns > STALL_NS)
+            {
+                lost = sent - received;
+                progress_ns = now;
+            }
+            else
+            {
+                // sleep instead of spinning, the generator shares the CPUs with mync and the sink
+                struct timespec until;
+                clock_gettime(CLOCK_REALTIME, &until);
+                until.tv_nsec += 10000000;
+                if (until.tv_nsec >= 1000000000)
+                {
+                    until.tv_sec++;
+                    until.tv_nsec -= 1000000000;
+                }
+                pthread_mutex_lock(&run.lock);
+                if (__atomic_load_n(&run.received, __ATOMIC_ACQUIRE) == received)
+                {
+                    pthread_cond_timedwait(&run.progress, &run.lock, &until);
+                }
+                pthread_mutex_unlock(&run.lock);
+            }
+            continue;
+        }
+        struct message_header header = {MESSAGE_MAGIC, size, now};
+        memcpy(message, &header, sizeof(header));
+        if (send(generator_fd, message, size, MSG_NOSIGNAL) != (ssize_t)size)
+        {
+            if (errno == EINTR || errno == ECONNREFUSED || errno == ENOBUFS)
+            {
+                continue;
+            }
+            break;
+        }
+        sent++;
+        window_sent++;
+    }
+    uint64_t window_ns = now_ns() - window_start;
+    unsigned long cpu_end = session_cpu(pid, 0);
+    // messages counted as lost may still arrive late, the sink gets DRAIN_NS for them
+    while (__atomic_load_n(&run.received, __ATOMIC_ACQUIRE) < sent && now_ns() - run.window_end_ns < DRAIN_NS)
+    {
+        sleep_ns(1000000);
+    }
+    __atomic_store_n(&run.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(sink, NULL);
+    session_cpu(pid, 1);
+    waitpid(pid, NULL, 0);
+
+    unsigned long messages = __atomic_load_n(&run.window_received, __ATOMIC_ACQUIRE);
+    double elapsed = window_ns / 1e9;
+    double bytes = (double)messages * size;
+    double cpu = (double)(cpu_end - cpu_start) / sysconf(_SC_CLK_TCK);
+    printf("%s  {\"mode\":\"%s\",\"args\":\"", first ? "" : ",\n", bench_case->name);
+    printf(bench_case->args, input_port, output_port);
+    printf("\",\"size\":%zu,\"seconds\":%.3f,\"messages\":%lu,\"lost\":%lu,\"misframed\":%lu,"
+           "\"mb_per_s\":%.2f,\"msgs_per_s\":%.0f,\"cpu_s\":%.3f,\"cpu_s_per_gb\":%.3f,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f}",
+           size, elapsed, messages, window_sent > messages ? window_sent - messages : 0, run.misframed,
+           bytes / elapsed / 1e6, messages / elapsed, cpu, bytes > 0 ? cpu / (bytes / 1e9) : 0,
+           latency_percentile(run.latency, messages, 0.5), latency_percentile(run.latency, messages, 0.99),
+           latency_percentile(run.latency, messages, 0.999));
+    fflush(stdout);
+
+    close(generator_fd);
+    if (run.sink_fd != generator_fd && run.sink_fd != -1)
+    {
+        close(run.sink_fd);
+    }
+    if (run.sink_listen_fd != -1)
+    {
+        close(run.sink_listen_fd);
+    }
+    if (bench_case->input == END_UDS || bench_case->output == END_UDS)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/tmp/mync-bench-%d.sock", input_port);
+        unlink(path);
+        snprintf(path, sizeof(path), "/tmp/mync-bench-%d.sock", output_port);
+        unlink(path);
+    }
+    pthread_mutex_destroy(&run.lock);
+    pthread_cond_destroy(&run.progress);
+    free(message);
+    free(run.latency);
+}
+
+// usage: ./bench [seconds] [sizes] [modes] [base port], sizes and modes are comma separated lists (modes match by
+// name prefix, "all" runs every mode). mync4 is taken from the current directory or from $MYNC
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : DEFAULT_SECONDS;
+    char sizes[256];
+    char *modes = argc > 3 ? argv[3] : "all";
+    int port = argc > 4 ? atoi(argv[4]) : DEFAULT_BASE_PORT;
+    const char *mync = getenv("MYNC") != NULL ? getenv("MYNC") : "./mync4";
+    snprintf(sizes, sizeof(sizes), "%s", argc > 2 ? argv[2] : DEFAULT_SIZES);
+    if (seconds <= 0 || port <= 0 || access(mync, X_OK) != 0)
+    {
+        fprintf(stderr, "usage: %s [seconds] [sizes] [modes] [base port] (needs %s)\n", argv[0], mync);
+        exit(EXIT_FAILURE);
+    }
+
+    int first = 1;
+    printf("[\n");
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c)
+    {
+        int selected = strcmp(modes, "all") == 0;
+        char list[256];
+        snprintf(list, sizeof(list), "%s", modes);
+        for (char *mode = strtok(list, ","); mode != NULL && !selected; mode = strtok(NULL, ","))
+        {
+            selected = strncmp(cases[c].name, mode, strlen(mode)) == 0;
+        }
+        if (!selected)
+        {
+            continue;
+        }
+        char size_list[256];
+        char *saveptr;
+        snprintf(size_list, sizeof(size_list), "%s", sizes);
+        for (char *item = strtok_r(size_list, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr))
+        {
+            size_t size = strtoul(item, NULL, 10);
+            if (size < MIN_MESSAGE_SIZE || size > MAX_MESSAGE_SIZE)
+            {
+                fprintf(stderr, "message size %s is not between %d and %d\n", item, MIN_MESSAGE_SIZE, MAX_MESSAGE_SIZE);
+                exit(EXIT_FAILURE);
+            }
+            run_case(mync, &cases[c], size, seconds, port, port + 1, first);
+            first = 0;
+            port += 2;
+        }
+    }
+    printf("\n]\n");
+    return 0;
+}
@@ -0,0 +1,567 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+// defaults of the options: largest number of concurrent sessions, sessions added per step, seconds every step is
+// held, pause between the moves of a session and the order in which the player picks free cells
+#define DEFAULT_SESSIONS 100
+#define DEFAULT_STEPS 5
+#define DEFAULT_HOLD_SECONDS 5.0
+#define DEFAULT_THINK_MS 100
+#define DEFAULT_MOVES "5,9,3,7,2,4,6,8,1"
+// a session that gets no answer for this long counts as an error and is replaced
+#define REPLY_TIMEOUT_MS 10000
+// epoll wakes up at least this often to start the moves of sessions whose think time is over
+#define TICK_MS 5
+#define LINE_SIZE 256
+#define BOARD_LINES 3
+#define EVENTS_MAX 256
+
+// states of a session: a TCP connect in progress, waiting for the board after the first computer move, waiting
+// between two moves and waiting for the answer to a move
+enum session_state
+{
+    SESSION_FREE,
+    SESSION_CONNECTING,
+    SESSION_FIRST_BOARD,
+    SESSION_THINKING,
+    SESSION_MOVE
+};
+
+// one simulated player: a connection to the server and the board as the player sees it
+struct session
+{
+    enum session_state state;
+    int fd;
+    uint64_t started_ns;
+    uint64_t deadline_ns;
+    char board[9];
+    int board_lines;
+    char line[LINE_SIZE];
+    size_t line_len;
+};
+
+// latency samples of a step in microseconds
+struct samples
+{
+    double *values;
+    size_t count;
+    size_t capacity;
+};
+
+// options and the state of the run
+struct sockaddr_storage server_address;
+socklen_t server_address_len;
+int udp = 0;
+int think_ms = DEFAULT_THINK_MS;
+int moves[9];
+int moves_count = 0;
+pid_t server_pid = 0;
+int epoll_fd;
+struct session *sessions;
+int sessions_max = DEFAULT_SESSIONS;
+int sessions_target = 0;
+int sessions_open = 0;
+// counters of the current step
+unsigned long games = 0;
+unsigned long errors = 0;
+struct samples connect_samples;
+struct samples first_board_samples;
+struct samples move_samples;
+
+void printErrorAndExit(const char *message)
+{
+    perror(message);
+    exit(EXIT_FAILURE);
+}
+
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void samples_add(struct samples *samples, uint64_t ns)
+{
+    if (samples->count == samples->capacity)
+    {
+        samples->capacity = samples->capacity ? 2 * samples->capacity : 1024;
+        samples->values = realloc(samples->values, samples->capacity * sizeof(double));
+        if (samples->values == NULL)
+        {
+            printErrorAndExit("realloc");
+        }
+    }
+    samples->values[samples->count++] = ns / 1000.0;
+}
+
+int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// method to print the count and percentiles of the samples of a step as a JSON object and start the next step
+void samples_print(const char *name, struct samples *samples)
+{
+    double p50 = 0, p99 = 0, p999 = 0;
+    if (samples->count > 0)
+    {
+        qsort(samples->values, samples->count, sizeof(double), compare_double);
+        p50 = samples->values[samples->count / 2];
+        p99 = samples->values[samples->count * 99 / 100];
+        p999 = samples->values[samples->count * 999 / 1000];
+    }
+    printf(",\"%s\":{\"count\":%zu,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f}", name, samples->count, p50, p99, p999);
+    samples->count = 0;
+}
+
+// method to add up the resident memory and count the processes of the server and all its descendants (the session
+// processes and their programs)
+void server_usage(unsigned long *rss_kb, int *processes)
+{
+    *rss_kb = 0;
+    *processes = 0;
+    if (server_pid <= 0)
+    {
+        return;
+    }
+    int pid_max = 4194304;
+    FILE *file = fopen("/proc/sys/kernel/pid_max", "r");
+    if (file != NULL)
+    {
+        if (fscanf(file, "%d", &pid_max) != 1)
+        {
+            pid_max = 4194304;
+        }
+        fclose(file);
+    }
+    pid_t *parents = calloc(pid_max + 1, sizeof(pid_t));
+    pid_t *pids = NULL;
+    size_t pids_count = 0, pids_capacity = 0;
+    DIR *proc = opendir("/proc");
+    struct dirent *entry;
+    if (parents == NULL || proc == NULL)
+    {
+        printErrorAndExit("/proc");
+    }
+    while ((entry = readdir(proc)) != NULL)
+    {
+        char path[64], line[512];
+        pid_t pid = atoi(entry->d_name);
+        if (pid <= 0 || pid > pid_max)
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+        file = fopen(path, "r");
+        if (file == NULL)
+        {
+            continue;
+        }
+        char *fields = fgets(line, sizeof(line), file) ? strrchr(line, ')') : NULL;
+        fclose(file);
+        if (fields == NULL || sscanf(fields, ") %*c %d", &parents[pid]) != 1)
+        {
+            parents[pid] = 0;
+            continue;
+        }
+        if (pids_count == pids_capacity)
+        {
+            pids_capacity = pids_capacity ? 2 * pids_capacity : 1024;
+            pids = realloc(pids, pids_capacity * sizeof(pid_t));
+            if (pids == NULL)
+            {
+                printErrorAndExit("realloc");
+            }
+        }
+        pids[pids_count++] = pid;
+    }
+    closedir(proc);
+    long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    for (size_t i = 0; i < pids_count; ++i)
+    {
+        // a process belongs to the server when the server is one of its ancestors
+        pid_t pid = pids[i];
+        pid_t ancestor = pid;
+        while (ancestor > 0 && ancestor != server_pid && parents[ancestor] != 0)
+        {
+            ancestor = parents[ancestor];
+        }
+        if (ancestor != server_pid)
+        {
+            continue;
+        }
+        char path[64];
+        unsigned long size, resident;
+        snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+        file = fopen(path, "r");
+        if (file == NULL)
+        {
+            continue;
+        }
+        if (fscanf(file, "%lu %lu", &size, &resident) == 2)
+        {
+            *rss_kb += resident * page_kb;
+            ++*processes;
+        }
+        fclose(file);
+    }
+    free(pids);
+    free(parents);
+}
+
+// method to start a new session: a non-blocking connect, or for UDP a datagram that makes the server learn the
+// client (mync drops the first datagram of a UDP server before the program starts). a session that cannot be
+// started (out of descriptors, connection refused) counts as an error of the step and returns -1
+int session_start(struct session *session)
+{
+    int fd = socket(server_address.ss_family, (udp ? SOCK_DGRAM : SOCK_STREAM) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        errors++;
+        return -1;
+    }
+    memset(session, 0, sizeof(*session));
+    memset(session->board, ' ', sizeof(session->board));
+    session->fd = fd;
+    session->started_ns = now_ns();
+    session->deadline_ns = session->started_ns + REPLY_TIMEOUT_MS * 1000000ULL;
+    session->state = SESSION_CONNECTING;
+    if (connect(fd, (struct sockaddr *)&server_address, server_address_len) == -1 && errno != EINPROGRESS)
+    {
+        close(fd);
+        session->state = SESSION_FREE;
+        errors++;
+        return -1;
+    }
+    struct epoll_event event = {.events = EPOLLIN | EPOLLOUT, .data.ptr = session};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+    {
+        printErrorAndExit("epoll_ctl");
+    }
+    if (udp && send(fd, "\n", 1, 0) == -1)
+    {
+        perror("send");
+    }
+    sessions_open++;
+    return 0;
+}
+
+// method to end a session, it is replaced right away while the step wants more sessions
+void session_end(struct session *session, int failed)
+{
+    close(session->fd);
+    session->state = SESSION_FREE;
+    sessions_open--;
+    if (failed)
+    {
+        errors++;
+    }
+    else
+    {
+        games++;
+    }
+}
+
+// method to send the next move of the script: the first cell of the script that is still free
+void session_move(struct session *session)
+{
+    for (int i = 0; i < moves_count; ++i)
+    {
+        if (session->board[moves[i] - 1] == ' ')
+        {
+            char move[8];
+            int len = snprintf(move, sizeof(move), "%d\n", moves[i]);
+            session->board[moves[i] - 1] = 'O';
+            session->started_ns = now_ns();
+            session->deadline_ns = session->started_ns + REPLY_TIMEOUT_MS * 1000000ULL;
+            session->state = SESSION_MOVE;
+            if (send(session->fd, move, len, MSG_NOSIGNAL) != len)
+            {
+                session_end(session, 1);
+            }
+            return;
+        }
+    }
+    // the script has no free cell left, the game cannot go on
+    session_end(session, 1);
+}
+
+// method to handle a line of the game: the board after a computer move completes the first board or the answer to
+// a move, the end of the game ends the session
+void session_line(struct session *session, const char *line)
+{
+    int cell;
+    if (sscanf(line, "computer move: %d", &cell) == 1 && cell >= 1 && cell <= 9)
+    {
+        session->board[cell - 1] = 'X';
+        session->board_lines = BOARD_LINES;
+    }
+    else if (strcmp(line, "I win") == 0 || strcmp(line, "I lost") == 0 || strcmp(line, "DRAW") == 0)
+    {
+        if (session->state == SESSION_MOVE)
+        {
+            samples_add(&move_samples, now_ns() - session->started_ns);
+        }
+        session_end(session, 0);
+    }
+    else if (strcmp(line, "Error") == 0)
+    {
+        session_end(session, 1);
+    }
+    else if (session->board_lines > 0 && --session->board_lines == 0)
+    {
+        uint64_t now = now_ns();
+        samples_add(session->state == SESSION_FIRST_BOARD ? &first_board_samples : &move_samples, now - session->started_ns);
+        session->state = SESSION_THINKING;
+        session->deadline_ns = now + think_ms * 1000000ULL;
+    }
+}
+
+// method to read the output of the game and split it into lines
+void session_read(struct session *session)
+{
+    char buffer[4096];
+    ssize_t n = recv(session->fd, buffer, sizeof(buffer), 0);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return;
+    }
+    if (n <= 0)
+    {
+        session_end(session, 1);
+        return;
+    }
+    for (ssize_t i = 0; i < n && session->state != SESSION_FREE; ++i)
+    {
+        if (buffer[i] == '\n')
+        {
+            session->line[session->line_len] = '\0';
+            session->line_len = 0;
+            session_line(session, session->line);
+        }
+        else if (session->line_len < LINE_SIZE - 1)
+        {
+            session->line[session->line_len++] = buffer[i];
+        }
+    }
+}
+
+// method to handle the events of a session
+void session_event(struct session *session, uint32_t events)
+{
+    if (session->state == SESSION_CONNECTING)
+    {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (!udp && (getsockopt(session->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0))
+        {
+            session_end(session, 1);
+            return;
+        }
+        uint64_t now = now_ns();
+        if (!udp)
+        {
+            samples_add(&connect_samples, now - session->started_ns);
+        }
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = session};
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session->fd, &event);
+        session->state = SESSION_FIRST_BOARD;
+    }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    {
+        session_read(session);
+    }
+}
+
+// method to keep the number of sessions at the target of the step, to start the moves of sessions whose think
+// time is over and to replace sessions that got no answer
+void sessions_tick()
+{
+    uint64_t now = now_ns();
+    int start_failed = 0;
+    for (int i = 0; i < sessions_max; ++i)
+    {
+        struct session *session = &sessions[i];
+        if (session->state == SESSION_FREE)
+        {
+            // after a failed start the next tick tries again
+            if (sessions_open < sessions_target && !start_failed)
+            {
+                start_failed = session_start(session) == -1;
+            }
+        }
+        else if (now >= session->deadline_ns)
+        {
+            if (session->state == SESSION_THINKING)
+            {
+                session_move(session);
+            }
+            else
+            {
+                session_end(session, 1);
+            }
+        }
+    }
+}
+
+// method to run the sessions for the given time
+void run_for(double seconds)
+{
+    struct epoll_event events[EVENTS_MAX];
+    uint64_t end = now_ns() + (uint64_t)(seconds * 1e9);
+    while (now_ns() < end)
+    {
+        sessions_tick();
+        int n = epoll_wait(epoll_fd, events, EVENTS_MAX, TICK_MS);
+        if (n == -1 && errno != EINTR)
+        {
+            printErrorAndExit("epoll_wait");
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            struct session *session = events[i].data.ptr;
+            if (session->state != SESSION_FREE)
+            {
+                session_event(session, events[i].events);
+            }
+        }
+    }
+}
+
+// method to parse the comma separated cells of the move script
+void parse_moves(const char *script)
+{
+    char list[64];
+    snprintf(list, sizeof(list), "%s", script);
+    moves_count = 0;
+    for (char *item = strtok(list, ","); item != NULL && moves_count < 9; item = strtok(NULL, ","))
+    {
+        int cell = atoi(item);
+        if (cell < 1 || cell > 9)
+        {
+            fprintf(stderr, "Error: invalid cell %s in the move script\n", item);
+            exit(EXIT_FAILURE);
+        }
+        moves[moves_count++] = cell;
+    }
+}
+
+// usage: ./loadgen [-u] [-n sessions] [-s steps] [-d seconds] [-t think ms] [-m moves] [-p server pid] host port
+// ramps up to -n concurrent sessions of ttt in -s equal steps, every step is held for -d seconds. prints a JSON
+// array with one object per step
+int main(int argc, char *argv[])
+{
+    int steps = DEFAULT_STEPS;
+    double hold = DEFAULT_HOLD_SECONDS;
+    char *host = NULL, *port = NULL;
+    parse_moves(DEFAULT_MOVES);
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-u") == 0)
+        {
+            udp = 1;
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            sessions_max = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+        {
+            steps = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+        {
+            hold = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+        {
+            think_ms = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+        {
+            parse_moves(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+        {
+            server_pid = atoi(argv[++i]);
+        }
+        else if (host == NULL)
+        {
+            host = argv[i];
+        }
+        else if (port == NULL)
+        {
+            port = argv[i];
+        }
+        else
+        {
+            host = NULL;
+            break;
+        }
+    }
+    if (host == NULL || port == NULL || sessions_max < 1 || steps < 1 || steps > sessions_max || hold <= 0 || think_ms < 0 || moves_count == 0)
+    {
+        fprintf(stderr, "usage: %s [-u] [-n sessions] [-s steps] [-d seconds] [-t think ms] [-m moves] [-p server pid] host port\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = udp ? SOCK_DGRAM : SOCK_STREAM}, *result;
+    int status = getaddrinfo(host, port, &hints, &result);
+    if (status != 0)
+    {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&server_address, result->ai_addr, result->ai_addrlen);
+    server_address_len = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    // every session takes a descriptor
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    sessions = calloc(sessions_max, sizeof(struct session));
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (sessions == NULL || epoll_fd == -1)
+    {
+        printErrorAndExit("setup");
+    }
+
+    printf("[\n");
+    for (int step = 1; step <= steps; ++step)
+    {
+        sessions_target = (int)((long)sessions_max * step / steps);
+        games = 0;
+        errors = 0;
+        run_for(hold);
+        unsigned long rss_kb;
+        int processes;
+        server_usage(&rss_kb, &processes);
+        printf("%s  {\"step\":%d,\"target\":%d,\"open\":%d,\"games\":%lu,\"errors\":%lu", step > 1 ? ",\n" : "", step, sessions_target, sessions_open, games, errors);
+        samples_print("connect", &connect_samples);
+        samples_print("first_board", &first_board_samples);
+        samples_print("move_rtt", &move_samples);
+        printf(",\"server_rss_kb\":%lu,\"server_processes\":%d}", rss_kb, processes);
+        fflush(stdout);
+        fprintf(stderr, "step %d: %d of %d sessions open, %lu games, %lu errors\n", step, sessions_open, sessions_target, games, errors);
+    }
+    printf("\n]\n");
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,21 +11,672 @@
 #include <netdb.h>
 #include <errno.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <netinet/udp.h>
+#include <netinet/tcp.h>
+#include <linux/io_uring.h>
+#include <linux/filter.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <dlfcn.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <ctype.h>
+#include "mync_plugin.h"
+#include "mynclog.h"
+
+// maximal amount of data moved by a single splice() call
+#define SPLICE_CHUNK 65536
+
+// size of the buffer of one chat direction, large enough for any datagram
+#define RELAY_BUFFER_SIZE 65536
+// largest number of datagrams received or sent by one recvmmsg/sendmmsg call
+#define UDP_BATCH_MAX 32
+// default number of datagrams per batch (--udp-batch=N)
+#define UDP_BATCH_DEFAULT 16
+// size of the datagrams made from stream data when --gso is not given
+#define STREAM_DGRAM_SIZE 1024
+// largest payload of a UDP datagram over IPv4
+#define UDP_MAX_PAYLOAD 65507
+// largest number of segments the kernel accepts in one UDP_SEGMENT send
+#define UDP_GSO_MAX_SEGMENTS 64
+// number of 64 KiB slots of a batch that receives coalesced (UDP_GRO) datagrams
+#define GRO_BATCH_MAX 4
+// ring buffers grow by a factor of 4 from RING_MIN_SIZE through RING_CLASSES size classes (4 KiB .. 256 KiB)
+#define RING_MIN_SIZE 4096
+#define RING_CLASSES 4
+// number of released chunks of every size class the pool keeps for reuse
+#define POOL_CACHE_PER_CLASS 8
+// default limits of buffered data of one session and of all sessions together
+#define SESSION_MEM_DEFAULT (4 << 20)
+// time to wait before retrying when a ring buffer could not get memory from the pool
+#define MEMORY_RETRY_MS 10
+#define POOL_MEM_DEFAULT (256 << 20)
+// largest number of prefork workers of a TCPMUXS server
+#define PREFORK_MAX 256
+// time the prefork pool must stay over-provisioned before one idle worker is retired (and again for the next one)
+#define PREFORK_SHRINK_MS 5000
+// largest number of SO_REUSEPORT listener sockets (and threads) of a TCPMUXS or UDPS server
+#define LISTENERS_MAX 64
+// largest number of clients taken from the accept queue of a TCPMUXS server on one wakeup
+#define ACCEPT_BATCH 64
+// timer wheel: 4 levels of 256 slots with a 1 ms tick reach 2^32 ms (49 days)
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+// metrics (-m): session slots in the shared state, buckets of the latency histograms (powers of two in us), the
+// time the endpoint waits for a request line before it answers with text, the clients it serves at once and the
+// time a client has to take its response before it is dropped
+#define METRICS_SESSIONS 256
+#define HISTOGRAM_BUCKETS 32
+#define METRICS_REQUEST_WAIT_MS 100
+#define METRICS_CLIENTS 8
+#define METRICS_SEND_WAIT_MS 1000
+// rate limits (--rate): slots of the shared source address buckets and the smallest default burst in bytes
+#define RATE_SOURCES 4096
+#define RATE_MIN_BURST_BYTES 65536
+// multiplexed upstream (--mux=N, --demux): frame header and largest payload, the credit of a new stream, the frames
+// a connection buffers before its streams wait, its input buffer, stream slots (a power of two, also the buckets
+// that find a stream by its id), connections, and events per wakeup with the epoll tag of the listener
+#define MUX_HEADER 8
+#define MUX_FRAME_MAX 16384
+#define MUX_WINDOW 65536
+#define MUX_OUT_DATA (4 * MUX_FRAME_MAX)
+#define MUX_IN_SIZE (4 * MUX_FRAME_MAX)
+#define MUX_STREAMS 4096
+#define MUX_CONNECTIONS_MAX 64
+#define MUX_EVENTS 256
+#define MUX_LISTEN_EVENT (MUX_STREAMS + MUX_CONNECTIONS_MAX)
+// maximal number of -e programs started ahead of their clients
+#define PREWARM_MAX 256
+// resolver: number of cached names, longest time an answer is cached, lifetime of a cached failure without a
+// SOA record, of an /etc/hosts entry and of a getaddrinfo_a answer (no TTL is known), and the query retries
+#define DNS_CACHE_SIZE 64
+#define DNS_TTL_MAX 3600
+#define DNS_NEGATIVE_TTL 30
+#define DNS_HOSTS_TTL 60
+#define DNS_FALLBACK_TTL 60
+#define DNS_ATTEMPTS 2
+#define DNS_TIMEOUT_MS 1000
+// maximal number of directions served by one chat
+#define MAX_RELAYS 2
+// epoll tags of the pidfd of the -e program and of the timerfd of the session timeouts in run_relays
+#define PROGRAM_EVENT (2 * MAX_RELAYS)
+#define TIMER_EVENT (2 * MAX_RELAYS + 1)
+// size of the pipes between the session process and the -e program
+#define PROGRAM_PIPE_SIZE (1 << 20)
+
+// a batch of datagram slots used with recvmmsg/sendmmsg together with statistics of how full the batches were
+struct udp_batch
+{
+    int size;
+    size_t slot_size;
+    char *data;
+    struct mmsghdr msgs[UDP_BATCH_MAX];
+    struct iovec iovs[UDP_BATCH_MAX];
+    struct sockaddr_storage addrs[UDP_BATCH_MAX];
+    char control[UDP_BATCH_MAX][CMSG_SPACE(sizeof(int))];
+    unsigned segments[UDP_BATCH_MAX];
+    int gro;
+    int pending;
+    int pending_count;
+    unsigned long held[UDP_BATCH_MAX + 1];
+    unsigned long truncated;
+    unsigned long dropped;
+};
+
+// counters of the UDP segmentation offload fast paths (--gso=SIZE)
+struct offload_stats
+{
+    unsigned long gso_sends;
+    unsigned long gso_segments;
+    unsigned long gso_fallbacks;
+    unsigned long gro_receives;
+    unsigned long gro_coalesced;
+    unsigned long gro_segments;
+};
+
+// a ring buffer holding data that was read but not yet written, its chunk is taken from the buffer pool
+struct ring_buf
+{
+    char *data;
+    size_t size;
+    size_t head;
+    size_t len;
+    int size_class;
+    int fixed;
+};
+
+// chunks for ring buffers of the current process, the memory used by all processes is counted in the shared state
+struct buffer_pool
+{
+    char *free_chunks[RING_CLASSES][POOL_CACHE_PER_CLASS];
+    int free_count[RING_CLASSES];
+    size_t session_used;
+};
+
+// state of a prefork worker as seen by the master
+struct prefork_slot
+{
+    pid_t pid;
+    int busy;
+    unsigned long sessions;
+};
+
+// a name in the resolver cache, negative entries remember names that have no address
+struct dns_entry
+{
+    char name[128];
+    struct in_addr addr;
+    int negative;
+    time_t expires;
+};
+
+// a getaddrinfo_a request with everything glibc's resolver thread may still use after the lookup gave up on it
+struct gai_request
+{
+    struct gaicb cb;
+    struct addrinfo hints;
+    char name[128];
+    int event_fd;
+    int references;
+};
+
+// a lookup that does not block: fd is the socket of the query to the name server or the eventfd of the
+// getaddrinfo_a fallback, -1 when the lookup is done and result holds 1 (address), 0 (no address) or -1 (failed)
+struct dns_lookup
+{
+    char name[128];
+    int fd;
+    int result;
+    struct in_addr addr;
+    unsigned char query[512];
+    int query_len;
+    struct sockaddr_in server;
+    int attempt;
+    uint64_t deadline_ms;
+    struct gai_request *gai;
+    struct timespec start;
+};
+
+// counters of the resolver, the latency is summed over the lookups that missed the cache
+struct dns_stats
+{
+    unsigned long hits;
+    unsigned long negative_hits;
+    unsigned long misses;
+    unsigned long hosts;
+    unsigned long queries;
+    unsigned long fallbacks;
+    unsigned long failures;
+    unsigned long latency_us;
+    unsigned long max_latency_us;
+};
+
+// counters of one direction of a chat: data received by the relays of that direction and datagrams dropped
+struct traffic_counters
+{
+    unsigned long bytes;
+    unsigned long messages;
+    unsigned long drops;
+};
+// latency histogram, bucket n counts the samples below 2^n microseconds
+struct histogram
+{
+    unsigned long buckets[HISTOGRAM_BUCKETS];
+    unsigned long count;
+    unsigned long sum_us;
+};
+// metrics of a listener: the only one, or a --listeners thread
+struct listener_metrics
+{
+    unsigned long accepted;
+    unsigned long sessions;
+    struct traffic_counters traffic[2];
+};
+// metrics of a live session, a slot with pid 0 is free
+struct session_metrics
+{
+    pid_t pid;
+    int listener;
+    uint64_t started_ms;
+    struct traffic_counters traffic[2];
+};
+struct metrics
+{
+    unsigned long sessions_started;
+    unsigned long sessions_untracked;
+    struct listener_metrics listeners[LISTENERS_MAX];
+    struct session_metrics sessions[METRICS_SESSIONS];
+    struct histogram spawn_latency;
+    struct histogram relay_latency;
+};
+// a client of the metrics endpoint, a slot with fd -1 is free. until its response is built the client is read,
+// then the response is sent as far as the socket takes it. deadline_ms ends the current phase
+struct metrics_client
+{
+    int fd;
+    uint64_t deadline_ms;
+    char request[512];
+    size_t request_len;
+    char *response;
+    size_t response_len;
+    size_t sent;
+};
+// scopes of the rate limits: the chat of a process or thread, the IP address of a peer, the listener of a session
+enum rate_scope
+{
+    RATE_SESSION,
+    RATE_SOURCE,
+    RATE_LISTENER,
+    RATE_SCOPES
+};
+// a rate limit of --rate: bytes and messages per second (0 for no limit), the burst each may exceed them by and
+// whether traffic over the limit is delayed (the source is not read for a while) or dropped
+struct rate_limit
+{
+    size_t bytes_per_s;
+    size_t msgs_per_s;
+    size_t burst_bytes;
+    size_t burst_msgs;
+    int delay;
+};
+// a token bucket kept as the theoretical arrival time (GCRA) in ns of the bytes and of the messages: taking tokens
+// moves it ahead, the time line of the clock earns them back, and it may run ahead of the clock by the burst
+struct token_bucket
+{
+    uint64_t bytes_tat;
+    uint64_t msgs_tat;
+};
+struct rate_source
+{
+    uint64_t key;
+    struct token_bucket bucket;
+};
+// counters of a scope: traffic that was delayed (and the time it was delayed for) and traffic that was dropped
+struct rate_counters
+{
+    unsigned long shaped_bytes;
+    unsigned long shaped_messages;
+    unsigned long delay_us;
+    unsigned long dropped_bytes;
+    unsigned long dropped_messages;
+};
+// buckets shared by the processes and threads of a server: one per listener and one per source address
+struct rate_state
+{
+    struct token_bucket listeners[LISTENERS_MAX];
+    struct rate_source sources[RATE_SOURCES];
+    struct rate_counters counters[RATE_SCOPES];
+};
+// state shared by all processes of mync (mapped before the first fork)
+struct shared_state
+{
+    size_t pool_used;
+    struct prefork_slot prefork_slots[PREFORK_MAX];
+    pthread_mutex_t dns_lock;
+    struct dns_entry dns_cache[DNS_CACHE_SIZE];
+    struct dns_stats dns_stats;
+    struct metrics metrics;
+    struct rate_state rate;
+};
+
+// one direction of a chat served by the event loop, data read from src_fd is written to dest_fd
+struct relay
+{
+    int src_fd;
+    int src_dgram;
+    struct sockaddr_storage *src_peer;
+    int dest_fd;
+    int dest_dgram;
+    struct sockaddr_storage *dest_addr;
+    int dest_unwatched;
+    int ending;
+    int done;
+    struct udp_batch *batch;
+    struct ring_buf ring;
+    pthread_mutex_t *peer_lock;
+    struct traffic_counters *traffic[2];
+    struct token_bucket *session_bucket;
+    struct token_bucket *source_bucket;
+    int source_resolved;
+    uint64_t throttled_until_ns;
+};
+
+// statistics of the TCPMUXS accept loop, printed with the listen queue counters on SIGUSR1
+struct accept_stats
+{
+    unsigned long wakeups;
+    unsigned long accepted;
+    int largest_burst;
+};
+
+// output of a plugin session: a stream, or a datagram socket with the address of the peer
+struct plugin_output
+{
+    int fd;
+    int dgram;
+    struct sockaddr_storage *addr;
+};
+
+// a listener thread of a SO_REUSEPORT group: a TCPMUXS thread passes every client it accepts to the session forker,
+// a UDPS thread forwards the datagrams of its socket with its own relay
+struct listener
+{
+    int index;
+    int fd;
+    pthread_t thread;
+    const char *program;
+    int mode;
+    int tcp_client_sock;
+    int forker_fd;
+    struct relay relay;
+};
+
+// a file descriptor watched by the event loop together with the relays reading from it and writing to it
+struct fd_watch
+{
+    int fd;
+    struct relay *reader;
+    struct relay *writer;
+    uint32_t events;
+    int registered;
+    int always_ready;
+};
+
+// frames of the mux protocol: OPEN starts a stream, DATA carries up to MUX_FRAME_MAX bytes of it, WINDOW_UPDATE
+// grants the sender more credit (a 4 byte count), CLOSE ends the sender's direction and RESET aborts the stream
+enum mux_frame_type
+{
+    MUX_OPEN = 1,
+    MUX_DATA,
+    MUX_WINDOW_UPDATE,
+    MUX_CLOSE,
+    MUX_RESET
+};
+
+// a logical stream of a mux connection and the socket it belongs to: the client on the mux side, the connection to
+// the -o target on the demux side. credit is what it may still send, consumed what it wrote and did not grant back
+struct mux_stream
+{
+    uint32_t id;
+    int fd;
+    struct mux_conn *conn;
+    int connecting;
+    int local_eof;
+    int remote_eof;
+    int write_shut;
+    size_t credit;
+    size_t consumed;
+    struct ring_buf ring;
+    int queued;
+    struct mux_stream *prev;
+    struct mux_stream *next;
+    int chain;
+    uint32_t events;
+    int registered;
+};
+
+// a connection carrying streams: framed output and input buffers and the queue of streams that have data to send
+struct mux_conn
+{
+    int fd;
+    int connecting;
+    char *out;
+    size_t out_size;
+    size_t out_start;
+    size_t out_len;
+    char *in;
+    size_t in_len;
+    int streams;
+    struct mux_stream *queue_head;
+    struct mux_stream *queue_tail;
+    uint32_t events;
+    int registered;
+};
+
+// state of the multiplexer process
+struct mux_state
+{
+    int demux;
+    int epoll_fd;
+    int listen_fd;
+    struct sockaddr_in target;
+    struct mux_conn conns[MUX_CONNECTIONS_MAX];
+    int conn_count;
+    struct mux_stream streams[MUX_STREAMS];
+    int buckets[MUX_STREAMS];
+    int free_slots;
+    uint32_t next_id;
+};
+
+// counters of the multiplexer, printed on SIGUSR1
+struct mux_stats
+{
+    unsigned long streams_opened;
+    unsigned long streams_reset;
+    unsigned long frames_sent;
+    unsigned long frames_received;
+    unsigned long bytes_sent;
+    unsigned long bytes_received;
+};
+
+// a minimal io_uring instance used by the uring engine, mapped without liburing
+struct uring
+{
+    int fd;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned queued;
+};
+
+// a timer of a timer wheel, callback is called once when it expires. arg is free for the owner of the timer
+struct timer
+{
+    struct timer *next;
+    struct timer **prev;
+    uint64_t expires;
+    void (*callback)(struct timer *timer);
+    void *arg;
+};
+
+// hierarchical timer wheel with a tick of one millisecond: level n holds the timers that expire within 256^(n+1)
+// ticks, starting and stopping a timer takes constant time however many are armed
+struct timer_wheel
+{
+    uint64_t now;
+    size_t armed;
+    int timer_fd;
+    struct timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+// idle and total timeout of a session served by run_relays
+struct session_timers
+{
+    struct timer_wheel wheel;
+    struct timer idle;
+    struct timer total;
+    uint64_t last_activity;
+    int expired;
+};
+
+// a -e program started ahead of its client, its stdin and stdout are the other end of the socket fd
+struct warm_program
+{
+    pid_t pid;
+    int fd;
+};
+
+// unix domain socket endpoints of a chat: stream and datagram servers (UDSSS, UDSSD) and clients (UDSCS, UDSCD).
+// a stream socket takes the place of a TCP socket and a datagram socket the place of a UDP socket
+struct unix_endpoints
+{
+    char *stream_server;
+    char *stream_client;
+    char *dgram_server;
+    char *dgram_client;
+};
+
+// engines that can serve the relays of a chat
+#define ENGINE_EPOLL 0
+#define ENGINE_URING 1
 
 // forward declarations
-void run_program(const char *program, int udp_server_sock, int udp_client_sock, struct sockaddr_in *udp_server_addr, int tcp_server_sock, int tcp_client_sock);
+void run_program(const char *program, int udp_server_sock, int udp_client_sock, struct sockaddr_storage *udp_server_addr, int tcp_server_sock, int tcp_client_sock);
 void read_and_write(int source, int destination);
-void run_chat(int udp_server_sock, int udp_client_sock, struct sockaddr_in *udp_server_addr, struct sockaddr_in *udp_client_addr, int tcp_server_sock, int tcp_client_sock, char *buffer, ssize_t buffer_size, ssize_t buffer_content);
-void process(int tcp_port, char *tcp_client_host, int tcp_client_port, int udp_port, char *udp_client_host, int udp_client_port, char *program, int mode, int tcpmuxs);
+void run_chat(int udp_server_sock, int udp_client_sock, struct sockaddr_storage *udp_server_addr, struct sockaddr_storage *udp_client_addr, int tcp_server_sock, int tcp_client_sock, char *buffer, ssize_t buffer_size, ssize_t buffer_content);
+void process(int tcp_port, char *tcp_client_host, int tcp_client_port, int udp_port, char *udp_client_host, int udp_client_port, char *program, int mode, int tcpmuxs, struct unix_endpoints *unix_endpoints);
+void run_prefork(int tcp_server_fd, const char *program, int mode, int tcp_client_sock);
+int next_client(int tcp_server_fd);
+void close_pending_clients();
+void reap_sessions();
+void open_reuseport_listeners(int type, int port, int count, int *fds);
+void run_tcp_listeners(int *fds, int count, const char *program, int mode, int tcp_client_sock);
+char **program_arguments(const char *program, int *argc);
+void plugin_load(const char *path);
+void run_plugin(int argc, char *argv[], int udp_server_sock, int udp_client_sock, struct sockaddr_storage *udp_server_addr, int tcp_server_sock, int tcp_client_sock);
+void prewarm_start();
+void supervise(pid_t pid_process, int metrics_fd);
+struct session_timers *session_timers_start();
+struct warm_program prewarm_take();
+void prewarm_close_others();
+void run_warm_program(struct warm_program *warm, int input_sock, int output_fd);
+void metrics_accepted();
+void metrics_session_begin();
+void metrics_session_end();
+void metrics_attach(struct relay *relay, int direction);
+void metrics_count(struct relay *relay, size_t bytes, unsigned long messages, unsigned long drops);
+void histogram_add(struct histogram *histogram, uint64_t us);
+uint64_t monotonic_us();
+int open_metrics_endpoint(const char *address);
+void metrics_accept(int listen_fd, struct metrics_client *clients);
+void metrics_client_ready(struct metrics_client *client);
+int metrics_clients_expire(struct metrics_client *clients);
+void metrics_client_close(struct metrics_client *client);
+int parse_rate(const char *spec);
+struct token_bucket *rate_source_bucket(struct sockaddr_storage *address);
+struct token_bucket *relay_stream_source(struct relay *relay);
+int rate_admit(struct relay *relay, struct token_bucket *source, size_t bytes, unsigned long messages);
+int relay_throttled(struct relay *relay, int *timeout_ms);
+void write_rate_counters(FILE *out, int json);
+void run_mux(int listen_port, const char *host, int port);
+void pool_release_process();
+void pool_forget_process();
 
-// variable indicating a timeout has occured
-volatile sig_atomic_t timeout_expired = 0;
+// time in milliseconds after which mync ends (-t), the time a session may go without data (--idle) and the time a
+// session may last (--session-timeout), 0 for no limit
+uint64_t global_timeout_ms = 0;
+uint64_t session_idle_ms = 0;
+uint64_t session_total_ms = 0;
 
-// method called when a timeout occurs
-void handle_alarm(int sig)
-{
-    timeout_expired = 1;
-}
+// engine used to serve chats (--engine=epoll or --engine=uring)
+int engine = ENGINE_EPOLL;
+
+// number of datagrams received and sent per system call on UDP relays (--udp-batch=N)
+int udp_batch = UDP_BATCH_DEFAULT;
+
+// segment size used with UDP_SEGMENT when stream data is sent as datagrams, 0 when disabled (--gso=SIZE).
+// setting it also turns on UDP_GRO for datagrams that are written to a stream
+size_t gso_size = 0;
+int gso_supported = 1;
+struct offload_stats offload_stats;
+
+// buffer pool of this process and the limits of buffered data per session and for all sessions together
+// (--session-mem=SIZE and --pool-mem=SIZE)
+__thread struct buffer_pool buffer_pool;
+// pool memory held by all threads of this process, given back to the global limit when the process ends
+size_t process_pool_used = 0;
+size_t session_mem_limit = SESSION_MEM_DEFAULT;
+size_t pool_mem_limit = POOL_MEM_DEFAULT;
+struct shared_state *shared;
+
+// prefork pool of a TCPMUXS server: initial/minimal number of workers, maximal number of workers and number of
+// sessions after which a worker is replaced, 0 workers means a fork per client (--prefork=N --prefork-max=N --recycle=N)
+int prefork_workers = 0;
+int prefork_max = 0;
+int recycle_sessions = 0;
+
+// number of SO_REUSEPORT listener sockets of a TCPMUXS or UDPS server, each served by a thread pinned to a CPU,
+// and whether a BPF program steers every flow to the socket of the CPU it arrived on (--listeners=N --steer=cpu).
+// the UDPS group is kept for run_chat, the address of the last UDP client is guarded by peer_lock
+int listener_count = 1;
+int steer_flows = 0;
+int udp_listener_fds[LISTENERS_MAX];
+int udp_listener_count = 0;
+pthread_mutex_t peer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// backlog of the listening TCP sockets (--backlog=N), the kernel caps it at net.core.somaxconn.
+// the TCPMUXS loop keeps the clients of its last accept4 batch until it forks their sessions
+int listen_backlog = SOMAXCONN;
+int pending_clients[ACCEPT_BATCH];
+int pending_count = 0;
+int pending_next = 0;
+struct accept_stats accept_stats;
+
+// words of the -e command, split once by program_arguments before the first fork and used by every session
+char **program_args = NULL;
+int program_argc = 0;
+
+// programs started ahead of their clients, a client is handed to the oldest one and the pool is refilled while
+// the accept loop has no client waiting (--prewarm=N). prewarm_program is set once the loop uses the pool
+int prewarm_count = 0;
+const char *prewarm_program = NULL;
+struct warm_program warm_programs[PREWARM_MAX];
+int warm_ready = 0;
+
+// plugin serving the sessions in process when -e names a shared object, NULL when the program is executed
+struct mync_plugin *plugin = NULL;
+
+// pidfd of the -e program whose pipes run_relays serves, the chat ends when the program ends. -1 otherwise
+int program_pidfd = -1;
+
+// address of the metrics endpoint (-m PORT or -m PATH), NULL when no metrics are collected. the listener that
+// accepted the session of a process or thread and the metrics slot of the session of this process
+char *metrics_address = NULL;
+__thread int current_listener = 0;
+struct session_metrics *current_session = NULL;
+
+// limits of every rate scope (--rate=SCOPE:...) and whether any limit is set, the relays skip them otherwise
+struct rate_limit rate_limits[RATE_SCOPES];
+int rate_limited = 0;
+const char *rate_scope_names[RATE_SCOPES] = {"session", "source", "listener"};
+
+// number of persistent connections the clients of the listener are multiplexed over (--mux=N), 0 for a connection
+// per client, and whether the listener takes mux connections and opens a connection per stream (--demux)
+int mux_connections = 0;
+int demux = 0;
+struct mux_stats mux_stats;
+
+// variable indicating a report of the relay statistics was requested with SIGUSR1
+volatile sig_atomic_t report_requested = 0;
 
 // method to print a message and exit the process due to an error
 void printErrorAndExit(const char *message)
@@ -33,740 +685,6139 @@ void printErrorAndExit(const char *message)
     exit(EXIT_FAILURE);
 }
 
-// method to create and return a tcp client socket connected to the specified host and port
-int connet_tcp_client(const char *client_host, int client_port)
+// method to get the length of a datagram address: a unix socket address ends with its path, an abstract name
+// (starting with a NUL byte) ends at the next NUL byte
+socklen_t sockaddr_length(const struct sockaddr_storage *addr)
 {
-
-    struct sockaddr_in client_serv_addr;
-
-    int client_socket = 0;
-    if ((client_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    if (addr->ss_family == AF_UNIX)
     {
-        printf("\n Socket creation error \n");
-        return -1;
+        const struct sockaddr_un *unix_addr = (const struct sockaddr_un *)addr;
+        if (unix_addr->sun_path[0] == '\0')
+        {
+            return offsetof(struct sockaddr_un, sun_path) + 1 + strnlen(unix_addr->sun_path + 1, sizeof(unix_addr->sun_path) - 1);
+        }
+        return offsetof(struct sockaddr_un, sun_path) + strnlen(unix_addr->sun_path, sizeof(unix_addr->sun_path));
     }
+    return sizeof(struct sockaddr_in);
+}
 
-    client_serv_addr.sin_family = AF_INET;
-    client_serv_addr.sin_port = htons(client_port);
+// method to parse a size given in bytes with an optional K, M or G suffix, returns 0 for an invalid size
+size_t parse_size(const char *text)
+{
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    switch (*end)
+    {
+    case 'K':
+    case 'k':
+        value <<= 10;
+        end++;
+        break;
+    case 'M':
+    case 'm':
+        value <<= 20;
+        end++;
+        break;
+    case 'G':
+    case 'g':
+        value <<= 30;
+        end++;
+        break;
+    }
+    return *end == '\0' ? value : 0;
+}
 
-    if (strcmp(client_host, "localhost") == 0)
+// method to parse a duration in seconds with an optional ms or s suffix ("2", "1.5", "250ms"), returns the duration
+// in milliseconds or 0 for an invalid duration
+uint64_t parse_duration(const char *text)
+{
+    char *end;
+    double value = strtod(text, &end);
+    if (strcmp(end, "ms") == 0)
     {
-        client_serv_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+        return value > 0 ? (uint64_t)value : 0;
     }
-    else
+    if (*end != '\0' && strcmp(end, "s") != 0)
     {
-        if (inet_pton(AF_INET, client_host, &client_serv_addr.sin_addr) <= 0)
-        {
-            printf("\nInvalid address/ Address not supported \n");
-            close(client_socket);
-            return -1;
-        }
+        return 0;
     }
+    return value > 0 ? (uint64_t)(value * 1000 + 0.5) : 0;
+}
 
-    printf("Connecting to client server at %s:%d\n", client_host, client_port);
+// method returning the monotonic time in milliseconds
+uint64_t monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    if (connect(client_socket, (struct sockaddr *)&client_serv_addr, sizeof(client_serv_addr)) < 0)
+// method to create a timer wheel whose timerfd becomes readable when the earliest armed timer expires
+void wheel_init(struct timer_wheel *wheel)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = monotonic_ms();
+    wheel->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (wheel->timer_fd == -1)
     {
-        printf("\nConnection to client server failed \n");
-        close(client_socket);
-        return -1;
+        printErrorAndExit("timerfd_create");
     }
-
-    printf("Connected to server at %s:%d\n", client_host, client_port);
-
-    return client_socket;
 }
 
-// method to bind a tcp listner to the specified port
-int bind_tcp_server(int port)
+void wheel_close(struct timer_wheel *wheel)
 {
-    int server_fd;
-    struct sockaddr_in address;
-    int opt = 1;
+    close(wheel->timer_fd);
+}
 
-    printf("bind_server %d\n", port);
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
+// method to put a timer into the slot of the level that covers its distance from the current tick, not before the
+// tick earliest. a timer further away than the wheel reaches waits in the last level and is placed again when that
+// slot cascades
+void wheel_place(struct timer_wheel *wheel, struct timer *timer, uint64_t earliest)
+{
+    uint64_t expires = timer->expires > earliest ? timer->expires : earliest;
+    uint64_t delta = expires - wheel->now;
+    int level = 0;
+    if (delta >= (1ULL << (WHEEL_BITS * WHEEL_LEVELS)))
     {
-        perror("socket failed");
-        exit(EXIT_FAILURE);
+        expires = wheel->now + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        delta = expires - wheel->now;
+    }
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1))))
+    {
+        level++;
+    }
+    struct timer **slot = &wheel->slots[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    timer->next = *slot;
+    if (*slot != NULL)
+    {
+        (*slot)->prev = &timer->next;
     }
+    timer->prev = slot;
+    *slot = timer;
+}
 
-    // Allow the socket to be reused
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1)
+// method to take a timer out of its slot
+void timer_stop(struct timer_wheel *wheel, struct timer *timer)
+{
+    if (timer->prev == NULL)
     {
-        perror("setsockopt");
-        close(server_fd);
-        exit(EXIT_FAILURE);
+        return;
     }
+    *timer->prev = timer->next;
+    if (timer->next != NULL)
+    {
+        timer->next->prev = timer->prev;
+    }
+    timer->prev = NULL;
+    timer->next = NULL;
+    wheel->armed--;
+}
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
+// method to (re)arm a timer that calls its callback after delay milliseconds, constant time for any number of timers
+void timer_start(struct timer_wheel *wheel, struct timer *timer, uint64_t delay)
+{
+    timer_stop(wheel, timer);
+    timer->expires = monotonic_ms() + delay;
+    wheel_place(wheel, timer, wheel->now + 1);
+    wheel->armed++;
+}
 
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+// method returning the tick at which the wheel has work next: the earliest timer of level 0, or the earliest
+// cascade of a higher level slot that holds timers. 0 when no timer is armed
+uint64_t wheel_next_tick(struct timer_wheel *wheel)
+{
+    uint64_t next = 0;
+    if (wheel->armed == 0)
     {
-        perror("bind failed");
-        close(server_fd);
-        exit(EXIT_FAILURE);
+        return 0;
+    }
+    for (int level = 0; level < WHEEL_LEVELS; ++level)
+    {
+        int shift = WHEEL_BITS * level;
+        uint64_t current = wheel->now >> shift;
+        for (uint64_t k = 1; k <= WHEEL_SLOTS; ++k)
+        {
+            uint64_t tick = (current + k) << shift;
+            if (next != 0 && tick >= next)
+            {
+                break;
+            }
+            if (wheel->slots[level][(current + k) & WHEEL_MASK] != NULL)
+            {
+                next = tick;
+                break;
+            }
+        }
     }
+    return next;
+}
 
-    if (listen(server_fd, 3) < 0)
+// method to set the timerfd to the next tick with work, or to disarm it
+void wheel_arm(struct timer_wheel *wheel)
+{
+    uint64_t next = wheel_next_tick(wheel);
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = next / 1000;
+    spec.it_value.tv_nsec = (next % 1000) * 1000000;
+    if (timerfd_settime(wheel->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1)
     {
-        perror("listen");
-        close(server_fd);
-        exit(EXIT_FAILURE);
+        printErrorAndExit("timerfd_settime");
     }
-    return server_fd;
 }
 
-// method to read from a straem file descriptor and write to a stream file descriptor
-void read_and_write(int src_fd, int dest_fd)
+// method to move the wheel to the current time: slots of higher levels cascade into lower ones when the lower
+// levels wrap around, the timers of every passed level 0 slot expire. empty level 0 slots are skipped up to the next
+// cascade, so a long sleep costs at most one step per 256 ms. the timerfd is armed again at the end
+void wheel_advance(struct timer_wheel *wheel)
 {
-    char buffer[1024];
-    int bytes_read;
-    // fflush(stdout);
-    while ((bytes_read = read(src_fd, buffer, sizeof(buffer))) > 0)
+    uint64_t now = monotonic_ms();
+    uint64_t count;
+    if (read(wheel->timer_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    {
+        printErrorAndExit("timerfd");
+    }
+    while (wheel->now < now)
     {
-        write(dest_fd, buffer, bytes_read);
+        uint64_t tick = wheel->now + 1;
+        uint64_t limit = ((tick | WHEEL_MASK) < now) ? (tick | WHEEL_MASK) : now;
+        while ((tick & WHEEL_MASK) != 0 && tick <= limit && wheel->slots[0][tick & WHEEL_MASK] == NULL)
+        {
+            tick++;
+        }
+        if (tick > limit)
+        {
+            wheel->now = limit;
+            continue;
+        }
+        wheel->now = tick;
+        for (int level = 1; level < WHEEL_LEVELS && (tick & ((1ULL << (WHEEL_BITS * level)) - 1)) == 0; ++level)
+        {
+            struct timer **slot = &wheel->slots[level][(tick >> (WHEEL_BITS * level)) & WHEEL_MASK];
+            struct timer *timer = *slot;
+            *slot = NULL;
+            while (timer != NULL)
+            {
+                struct timer *next = timer->next;
+                wheel_place(wheel, timer, tick);
+                timer = next;
+            }
+        }
+        struct timer *expired = wheel->slots[0][tick & WHEEL_MASK];
+        wheel->slots[0][tick & WHEEL_MASK] = NULL;
+        while (expired != NULL)
+        {
+            struct timer *timer = expired;
+            expired = timer->next;
+            if (timer->expires > tick)
+            {
+                // a timer beyond the reach of the wheel came down to level 0 before its time
+                wheel_place(wheel, timer, tick + 1);
+                continue;
+            }
+            timer->prev = NULL;
+            timer->next = NULL;
+            wheel->armed--;
+            timer->callback(timer);
+        }
     }
+    wheel_arm(wheel);
 }
 
-// method to read from a straem file descriptor and write to a datagram file descriptor
-void read_and_sendto(int src_fd, int dest_dgram_fd, struct sockaddr_in *client_addr)
+// method to create the state shared by all processes of mync, it must be called before the first fork
+void shared_state_init()
 {
-    char buffer[1024];
-    int bytes_read;
+    shared = mmap(NULL, sizeof(struct shared_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+    {
+        printErrorAndExit("mmap");
+    }
+    memset(shared, 0, sizeof(*shared));
+    // the resolver cache lock is robust: a process that dies holding it does not block the others
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared->dns_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
 
-    while ((bytes_read = read(src_fd, buffer, sizeof(buffer))) > 0)
+// method to lock the resolver cache, it is shared by all processes and threads of mync
+void dns_lock()
+{
+    if (pthread_mutex_lock(&shared->dns_lock) == EOWNERDEAD)
     {
-        sendto(dest_dgram_fd, buffer, bytes_read, 0, (struct sockaddr *)client_addr, sizeof(*client_addr));
+        // the owner died in the middle of an update, the entries it may have left half written are dropped
+        memset(shared->dns_cache, 0, sizeof(shared->dns_cache));
+        pthread_mutex_consistent(&shared->dns_lock);
     }
 }
 
-// method to read from an input datagram file descriptor and write to an output straem file descriptor
-// methos receives an optional initial content to write to the output fd
-void recvfrom_and_write(int src_dgram_fd, char *buffer, ssize_t buffer_size, ssize_t buffer_content, int dest_fd)
+// method to unlock the resolver cache
+void dns_unlock()
 {
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    while (1)
+    pthread_mutex_unlock(&shared->dns_lock);
+}
+
+// method to look up a name in the resolver cache, expired entries are ignored.
+// returns 1 for a cached address, 0 for a cached failure or -1 when the name is not cached
+int dns_cache_get(const char *name, struct in_addr *addr)
+{
+    time_t now = time(NULL);
+    int found = -1;
+    dns_lock();
+    for (int i = 0; i < DNS_CACHE_SIZE; ++i)
     {
-        if (buffer_content == -1)
+        struct dns_entry *entry = &shared->dns_cache[i];
+        if (entry->expires > now && strcmp(entry->name, name) == 0)
         {
+            *addr = entry->addr;
+            found = entry->negative ? 0 : 1;
             break;
         }
-
-        if (buffer_content > 0)
-        {
-            write(dest_fd, buffer, buffer_content);
-        }
-        buffer_content = recvfrom(src_dgram_fd, buffer, buffer_size, 0, (struct sockaddr *)&client_addr, &addr_len);
     }
+    dns_unlock();
+    return found;
 }
 
-// method to read from an input datagram file descriptor and write to an output datagram file descriptor
-// method receives an optional initial content to write to the output fd
-void recvfrom_and_sendto(int src_dgram_fd, char *buffer, ssize_t buffer_size, ssize_t buffer_content, int dest_dgram_fd, struct sockaddr_in *dest_addr)
+// method to store the result of a lookup for ttl seconds, replacing the entry of the name, an expired entry or
+// the entry that expires first
+void dns_cache_put(const char *name, struct in_addr *addr, int negative, unsigned int ttl)
 {
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    while (1)
+    time_t now = time(NULL);
+    if (strlen(name) >= sizeof(shared->dns_cache[0].name))
     {
-        if (buffer_content == -1)
+        return;
+    }
+    dns_lock();
+    struct dns_entry *slot = &shared->dns_cache[0];
+    for (int i = 0; i < DNS_CACHE_SIZE; ++i)
+    {
+        struct dns_entry *entry = &shared->dns_cache[i];
+        if (strcmp(entry->name, name) == 0)
         {
+            slot = entry;
             break;
         }
-
-        if (buffer_content > 0)
+        if (entry->expires < slot->expires)
         {
-            sendto(dest_dgram_fd, buffer, buffer_content, 0, (struct sockaddr *)dest_addr, sizeof(*dest_addr));
+            slot = entry;
         }
-        buffer_content = recvfrom(src_dgram_fd, buffer, buffer_size, 0, (struct sockaddr *)&client_addr, &addr_len);
-        printf("received %ld from socket\n", buffer_content);
     }
+    strcpy(slot->name, name);
+    slot->addr = *addr;
+    slot->negative = negative;
+    slot->expires = now + (ttl > DNS_TTL_MAX ? DNS_TTL_MAX : ttl);
+    dns_unlock();
 }
 
-// create initialize and return a udp server socket bound to the given port
-int start_udp_server(int port)
+// method to look up a name in /etc/hosts, returns 1 when an IPv4 address was found
+int hosts_lookup(const char *name, struct in_addr *addr)
 {
-    int server_sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (server_sock < 0)
+    char line[512];
+    FILE *hosts = fopen("/etc/hosts", "r");
+    if (hosts == NULL)
     {
-        printErrorAndExit("Error creating socket");
+        return 0;
     }
-
-    struct sockaddr_in server_addr = {};
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-
-    if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    int found = 0;
+    while (!found && fgets(line, sizeof(line), hosts) != NULL)
     {
-        perror("Error binding socket");
-        close(server_sock);
-        exit(EXIT_FAILURE);
+        char *save;
+        line[strcspn(line, "#")] = '\0';
+        char *address = strtok_r(line, " \t\n", &save);
+        if (address == NULL || inet_pton(AF_INET, address, addr) != 1)
+        {
+            continue;
+        }
+        for (char *alias = strtok_r(NULL, " \t\n", &save); alias != NULL; alias = strtok_r(NULL, " \t\n", &save))
+        {
+            if (strcasecmp(alias, name) == 0)
+            {
+                found = 1;
+                break;
+            }
+        }
     }
-
-    return server_sock;
+    fclose(hosts);
+    return found;
 }
 
-// create initialize a client socket and sockaddr_in structure for the given host and port
-int start_udp_client(char *hostname, int port, struct sockaddr_in *server_addr)
+// method to get the first IPv4 name server of /etc/resolv.conf, returns 1 when one is configured
+int dns_server(struct sockaddr_in *server)
 {
-    int client_sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (client_sock < 0)
+    char line[256];
+    FILE *conf = fopen("/etc/resolv.conf", "r");
+    if (conf == NULL)
     {
-        printErrorAndExit("Error creating socket");
+        return 0;
     }
-
-    struct hostent *server = gethostbyname(hostname);
-    if (server == NULL)
+    int found = 0;
+    memset(server, 0, sizeof(*server));
+    server->sin_family = AF_INET;
+    server->sin_port = htons(53);
+    while (!found && fgets(line, sizeof(line), conf) != NULL)
     {
-        printf("could not resolve hostname %s\n", hostname);
-        close(client_sock);
-        exit(EXIT_FAILURE);
+        char address[64];
+        found = sscanf(line, "nameserver %63s", address) == 1 && inet_pton(AF_INET, address, &server->sin_addr) == 1;
     }
-
-    server_addr->sin_family = AF_INET;
-    server_addr->sin_port = htons(port);
-    memcpy(&server_addr->sin_addr.s_addr, server->h_addr_list[0], server->h_length);
-
-    return client_sock;
+    fclose(conf);
+    return found;
 }
 
-// main method:
-// 1. parse input and set variables with the given process arguments
-// 2. set an alarm if -t option was given
-// 3. call main process method
-int main(int argc, char *argv[])
+// method to skip a (possibly compressed) name of a DNS message, returns the offset after it or -1
+int dns_skip_name(const unsigned char *msg, int len, int offset)
 {
-    char *tcp_port = NULL;
-    char *tcp_client_host = NULL;
-    char *tcp_client_port = NULL;
-    char *udp_port = NULL;
-    char *udp_client_host = NULL;
-    char *udp_client_port = NULL;
-    char *program = NULL;
-    int tcpmuxs = 0;
-    int timeout = 0;
-
-    int mode = 0; // 1 for input, 2 for output, 3 for both, 4 for input from client and output to server
-
-    for (int i = 1; i < argc; ++i)
+    while (offset < len)
+    {
+        if (msg[offset] == 0)
+        {
+            return offset + 1;
+        }
+        if ((msg[offset] & 0xC0) == 0xC0)
+        {
+            return offset + 2 <= len ? offset + 2 : -1;
+        }
+        offset += msg[offset] + 1;
+    }
+    return -1;
+}
+
+// method to build the query for the A record of a name with a random transaction id, returns its length or -1
+int dns_build_query(const char *name, unsigned char *query)
+{
+    unsigned short id;
+    size_t name_len = strlen(name);
+    if (name_len == 0 || name_len > 253)
+    {
+        return -1;
+    }
+    // an unpredictable id, together with the connected query socket and the question check of dns_parse_reply,
+    // keeps off-path answers from poisoning the shared cache
+    if (getrandom(&id, sizeof(id), GRND_NONBLOCK) != sizeof(id))
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        id = (unsigned short)(ts.tv_nsec ^ getpid());
+    }
+    // header: id, recursion desired, one question
+    memset(query, 0, 12);
+    query[0] = id >> 8;
+    query[1] = id & 0xFF;
+    query[2] = 0x01;
+    query[5] = 1;
+    int len = 12;
+    // question: the name as labels, type A, class IN
+    const char *label = name;
+    while (*label)
+    {
+        size_t label_len = strcspn(label, ".");
+        if (label_len == 0 || label_len > 63)
+        {
+            return -1;
+        }
+        query[len++] = label_len;
+        memcpy(query + len, label, label_len);
+        len += label_len;
+        label += label_len;
+        if (*label == '.')
+        {
+            label++;
+        }
+    }
+    query[len++] = 0;
+    query[len++] = 0;
+    query[len++] = 1;
+    query[len++] = 0;
+    query[len++] = 1;
+    return len;
+}
+
+// method to read the reply of a name server to a query: the reply must carry the id and the question of the query
+// (names compare without case).
+// returns 1 with the address and its TTL, 0 when the name has no address (with the TTL of the negative answer),
+// -1 for a reply that does not belong to the query and -2 when the server failed
+int dns_parse_reply(const unsigned char *reply, int n, const unsigned char *query, int query_len, struct in_addr *addr, unsigned int *ttl)
+{
+    if (n < query_len || reply[0] != query[0] || reply[1] != query[1] || !(reply[2] & 0x80) || reply[4] != 0 || reply[5] != 1)
+    {
+        return -1;
+    }
+    // label lengths, type and class are below 'A', so tolower only folds the letters of the name
+    for (int i = 12; i < query_len; ++i)
+    {
+        if (tolower(reply[i]) != tolower(query[i]))
+        {
+            return -1;
+        }
+    }
+    int rcode = reply[3] & 0x0F;
+    int answers = reply[6] << 8 | reply[7];
+    int authority = reply[8] << 8 | reply[9];
+    if (rcode != 0 && rcode != 3)
+    {
+        // a failing server is not a negative answer, the lookup falls back to getaddrinfo_a
+        return -2;
+    }
+    int offset = query_len;
+    *ttl = DNS_NEGATIVE_TTL;
+    // the first A record of the answer wins, the TTL of a SOA record in the authority section limits
+    // how long a negative answer is cached
+    for (int record = 0; record < answers + authority && offset != -1; ++record)
+    {
+        offset = dns_skip_name(reply, n, offset);
+        if (offset == -1 || offset + 10 > n)
+        {
+            break;
+        }
+        int type = reply[offset] << 8 | reply[offset + 1];
+        unsigned int record_ttl = (unsigned int)reply[offset + 4] << 24 | reply[offset + 5] << 16 | reply[offset + 6] << 8 | reply[offset + 7];
+        int rdlength = reply[offset + 8] << 8 | reply[offset + 9];
+        offset += 10;
+        if (offset + rdlength > n)
+        {
+            break;
+        }
+        if (record < answers && type == 1 && rdlength == 4)
+        {
+            memcpy(addr, reply + offset, 4);
+            *ttl = record_ttl;
+            return 1;
+        }
+        if (record >= answers && type == 6 && record_ttl < *ttl)
+        {
+            *ttl = record_ttl;
+        }
+        offset += rdlength;
+    }
+    return 0;
+}
+
+// method to give up one reference of a getaddrinfo_a request: the lookup and the completion callback each hold one,
+// so a request that is still running when the lookup gives up is freed by its callback and not under it
+void gai_release(struct gai_request *request)
+{
+    if (__atomic_sub_fetch(&request->references, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        close(request->event_fd);
+        if (request->cb.ar_result != NULL)
+        {
+            freeaddrinfo(request->cb.ar_result);
+        }
+        free(request);
+    }
+}
+
+// method called by glibc's resolver thread when a getaddrinfo_a request completed: it wakes the lookup through the
+// eventfd of the request
+void gai_done(union sigval value)
+{
+    struct gai_request *request = value.sival_ptr;
+    eventfd_write(request->event_fd, 1);
+    gai_release(request);
+}
+
+// method to start the getaddrinfo_a fallback of a lookup, its eventfd becomes readable when the request completed.
+// returns 0 or -1 when the request could not be started
+int gai_start(struct dns_lookup *lookup)
+{
+    struct gai_request *request = calloc(1, sizeof(struct gai_request));
+    if (request == NULL)
+    {
+        return -1;
+    }
+    request->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (request->event_fd == -1)
+    {
+        free(request);
+        return -1;
+    }
+    snprintf(request->name, sizeof(request->name), "%s", lookup->name);
+    request->hints.ai_family = AF_INET;
+    request->cb.ar_name = request->name;
+    request->cb.ar_request = &request->hints;
+    request->references = 2;
+    struct gaicb *requests[1] = {&request->cb};
+    struct sigevent notify;
+    memset(&notify, 0, sizeof(notify));
+    notify.sigev_notify = SIGEV_THREAD;
+    notify.sigev_notify_function = gai_done;
+    notify.sigev_value.sival_ptr = request;
+    if (getaddrinfo_a(GAI_NOWAIT, requests, 1, &notify) != 0)
+    {
+        close(request->event_fd);
+        free(request);
+        return -1;
+    }
+    lookup->gai = request;
+    lookup->fd = request->event_fd;
+    lookup->deadline_ms = monotonic_ms() + DNS_ATTEMPTS * DNS_TIMEOUT_MS;
+    return 0;
+}
+
+// method to abandon the getaddrinfo_a request of a lookup. a request that was cancelled never calls back, so its
+// reference is given up here too
+void gai_abandon(struct dns_lookup *lookup)
+{
+    if (lookup->gai == NULL)
+    {
+        return;
+    }
+    if (gai_cancel(&lookup->gai->cb) == EAI_CANCELED)
+    {
+        gai_release(lookup->gai);
+    }
+    gai_release(lookup->gai);
+    lookup->gai = NULL;
+}
+
+// method to end a lookup: the result is cached (failures too) and counted
+void dns_lookup_finish(struct dns_lookup *lookup, int found, unsigned int ttl)
+{
+    struct timespec end;
+    if (lookup->fd != -1 && lookup->gai == NULL)
+    {
+        close(lookup->fd);
+    }
+    gai_abandon(lookup);
+    lookup->fd = -1;
+    lookup->result = found;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    unsigned long latency = (end.tv_sec - lookup->start.tv_sec) * 1000000UL + (end.tv_nsec - lookup->start.tv_nsec) / 1000;
+    __atomic_add_fetch(&shared->dns_stats.latency_us, latency, __ATOMIC_RELAXED);
+    if (latency > __atomic_load_n(&shared->dns_stats.max_latency_us, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&shared->dns_stats.max_latency_us, latency, __ATOMIC_RELAXED);
+    }
+    if (found == 1)
+    {
+        dns_cache_put(lookup->name, &lookup->addr, 0, ttl < 1 ? 1 : ttl);
+        return;
+    }
+    __atomic_add_fetch(&shared->dns_stats.failures, 1, __ATOMIC_RELAXED);
+    if (found == 0)
+    {
+        dns_cache_put(lookup->name, &lookup->addr, 1, ttl < 1 ? 1 : ttl);
+    }
+}
+
+// method to fall back to getaddrinfo_a when the name server cannot be used, a lookup that cannot even start fails
+void dns_lookup_fallback(struct dns_lookup *lookup)
+{
+    if (lookup->fd != -1)
+    {
+        close(lookup->fd);
+        lookup->fd = -1;
+    }
+    __atomic_add_fetch(&shared->dns_stats.fallbacks, 1, __ATOMIC_RELAXED);
+    if (gai_start(lookup) == -1)
+    {
+        dns_lookup_finish(lookup, -1, 0);
+    }
+}
+
+// method to send the query of a lookup (again), after DNS_ATTEMPTS attempts the lookup falls back to getaddrinfo_a
+void dns_lookup_send(struct dns_lookup *lookup)
+{
+    if (lookup->attempt++ == DNS_ATTEMPTS ||
+        send(lookup->fd, lookup->query, lookup->query_len, 0) == -1)
+    {
+        dns_lookup_fallback(lookup);
+        return;
+    }
+    lookup->deadline_ms = monotonic_ms() + DNS_TIMEOUT_MS;
+}
+
+// method to start resolving a name without waiting: numeric addresses, the shared cache and /etc/hosts answer at
+// once, otherwise a query is sent to the name server of /etc/resolv.conf (getaddrinfo_a when there is none).
+// returns 1 when the lookup is done (its result is set), 0 when the caller must wait for lookup->fd to become
+// readable or for dns_lookup_timeout and then call dns_lookup_continue
+int dns_lookup_start(struct dns_lookup *lookup, const char *name)
+{
+    memset(lookup, 0, sizeof(*lookup));
+    lookup->fd = -1;
+    if (inet_pton(AF_INET, name, &lookup->addr) == 1)
+    {
+        lookup->result = 1;
+        return 1;
+    }
+    int cached = dns_cache_get(name, &lookup->addr);
+    if (cached != -1)
+    {
+        __atomic_add_fetch(cached ? &shared->dns_stats.hits : &shared->dns_stats.negative_hits, 1, __ATOMIC_RELAXED);
+        lookup->result = cached;
+        return 1;
+    }
+    if (strlen(name) >= sizeof(lookup->name))
+    {
+        lookup->result = -1;
+        return 1;
+    }
+    strcpy(lookup->name, name);
+    clock_gettime(CLOCK_MONOTONIC, &lookup->start);
+    __atomic_add_fetch(&shared->dns_stats.misses, 1, __ATOMIC_RELAXED);
+    if (hosts_lookup(name, &lookup->addr))
+    {
+        __atomic_add_fetch(&shared->dns_stats.hosts, 1, __ATOMIC_RELAXED);
+        dns_lookup_finish(lookup, 1, DNS_HOSTS_TTL);
+        return 1;
+    }
+    __atomic_add_fetch(&shared->dns_stats.queries, 1, __ATOMIC_RELAXED);
+    lookup->query_len = dns_build_query(name, lookup->query);
+    if (lookup->query_len == -1 || !dns_server(&lookup->server) ||
+        (lookup->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1 ||
+        connect(lookup->fd, (struct sockaddr *)&lookup->server, sizeof(lookup->server)) == -1)
+    {
+        dns_lookup_fallback(lookup);
+    }
+    else
+    {
+        dns_lookup_send(lookup);
+    }
+    return lookup->fd == -1;
+}
+
+// method to get the time in milliseconds until a pending lookup must be continued even when its fd is not readable
+int dns_lookup_timeout(struct dns_lookup *lookup)
+{
+    uint64_t now = monotonic_ms();
+    return lookup->deadline_ms > now ? (int)(lookup->deadline_ms - now) : 0;
+}
+
+// method to go on with a pending lookup after its fd became readable or its timeout passed, returns 1 when it is done
+int dns_lookup_continue(struct dns_lookup *lookup)
+{
+    unsigned char reply[1500];
+    unsigned int ttl;
+    if (lookup->fd == -1)
+    {
+        return 1;
+    }
+    if (lookup->gai != NULL)
+    {
+        int error = gai_error(&lookup->gai->cb);
+        if (error == EAI_INPROGRESS)
+        {
+            if (dns_lookup_timeout(lookup) == 0)
+            {
+                dns_lookup_finish(lookup, -1, 0);
+                return 1;
+            }
+            return 0;
+        }
+        if (error == 0)
+        {
+            lookup->addr = ((struct sockaddr_in *)lookup->gai->cb.ar_result->ai_addr)->sin_addr;
+        }
+        dns_lookup_finish(lookup, error == 0 ? 1 : (error == EAI_NONAME || error == EAI_NODATA) ? 0 : -1, DNS_FALLBACK_TTL);
+        return 1;
+    }
+    int n;
+    while ((n = recv(lookup->fd, reply, sizeof(reply), 0)) >= 0)
+    {
+        int found = dns_parse_reply(reply, n, lookup->query, lookup->query_len, &lookup->addr, &ttl);
+        if (found == -2)
+        {
+            dns_lookup_fallback(lookup);
+            return lookup->fd == -1;
+        }
+        if (found >= 0)
+        {
+            dns_lookup_finish(lookup, found, ttl);
+            return 1;
+        }
+    }
+    if (dns_lookup_timeout(lookup) == 0)
+    {
+        dns_lookup_send(lookup);
+    }
+    return lookup->fd == -1;
+}
+
+// method to stop a pending lookup whose result is no longer needed
+void dns_lookup_cancel(struct dns_lookup *lookup)
+{
+    if (lookup->fd != -1 && lookup->gai == NULL)
+    {
+        close(lookup->fd);
+    }
+    gai_abandon(lookup);
+    lookup->fd = -1;
+}
+
+// method to wait until a lookup is done, returns its result
+int dns_lookup_wait(struct dns_lookup *lookup)
+{
+    mynclog_drain();
+    while (!dns_lookup_continue(lookup))
+    {
+        struct pollfd pfd = {.fd = lookup->fd, .events = POLLIN};
+        if (poll(&pfd, 1, dns_lookup_timeout(lookup)) == -1 && errno != EINTR)
+        {
+            dns_lookup_cancel(lookup);
+            return -1;
+        }
+    }
+    return lookup->result;
+}
+
+// method to wait until a listening or datagram socket is readable while pending lookups go on, so that the address
+// of a session's destination is resolved by the time its client arrives
+void wait_resolving(int fd, struct dns_lookup *lookups, int count)
+{
+    while (1)
+    {
+        struct pollfd pfds[3];
+        int n = 0;
+        int timeout = -1;
+        pfds[n++] = (struct pollfd){.fd = fd, .events = POLLIN};
+        for (int i = 0; i < count && n < 3; ++i)
+        {
+            if (lookups[i].fd != -1)
+            {
+                int wait = dns_lookup_timeout(&lookups[i]);
+                timeout = timeout == -1 || wait < timeout ? wait : timeout;
+                pfds[n++] = (struct pollfd){.fd = lookups[i].fd, .events = POLLIN};
+            }
+        }
+        // without a pending lookup the caller's own blocking call waits for the socket
+        if (n == 1 || (poll(pfds, n, timeout) == -1 && errno != EINTR))
+        {
+            return;
+        }
+        for (int i = 0; i < count; ++i)
+        {
+            dns_lookup_continue(&lookups[i]);
+        }
+        if (pfds[0].revents != 0)
+        {
+            return;
+        }
+    }
+}
+
+// method to resolve a host name to an IPv4 address and wait for the answer, for the setup of a session that cannot go
+// on without it. returns 0 on success or -1 when the name cannot be resolved
+int resolve_host(const char *name, struct in_addr *addr)
+{
+    struct dns_lookup lookup;
+    if (!dns_lookup_start(&lookup, name))
+    {
+        dns_lookup_wait(&lookup);
+    }
+    *addr = lookup.addr;
+    return lookup.result == 1 ? 0 : -1;
+}
+
+// method to print the counters of the resolver shared by all processes
+void resolver_report()
+{
+    struct dns_stats *stats = &shared->dns_stats;
+    if (stats->hits + stats->negative_hits + stats->misses == 0)
+    {
+        return;
+    }
+    fprintf(stderr, "resolver: hits:%lu negative hits:%lu misses:%lu (hosts:%lu queries:%lu getaddrinfo_a:%lu failures:%lu) "
+                    "lookup latency avg:%luus max:%luus\n",
+            stats->hits, stats->negative_hits, stats->misses, stats->hosts, stats->queries, stats->fallbacks, stats->failures,
+            stats->misses ? stats->latency_us / stats->misses : 0, stats->max_latency_us);
+}
+
+// method to create and return a tcp client socket connected to the specified host and port
+int connet_tcp_client(const char *client_host, int client_port)
+{
+
+    struct sockaddr_in client_serv_addr;
+
+    int client_socket = 0;
+    if ((client_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+        LOG_ERROR("socket creation error");
+        return -1;
+    }
+
+    client_serv_addr.sin_family = AF_INET;
+    client_serv_addr.sin_port = htons(client_port);
+
+    if (resolve_host(client_host, &client_serv_addr.sin_addr) == -1)
+    {
+        LOG_ERROR("invalid address %s", client_host);
+        close(client_socket);
+        return -1;
+    }
+
+    LOG_INFO("connecting to client server at %s:%d", client_host, client_port);
+
+    if (connect(client_socket, (struct sockaddr *)&client_serv_addr, sizeof(client_serv_addr)) < 0)
+    {
+        LOG_ERROR("connection to client server %s:%d failed", client_host, client_port);
+        close(client_socket);
+        return -1;
+    }
+
+    LOG_INFO("connected to server at %s:%d", client_host, client_port);
+
+    return client_socket;
+}
+
+// method to bind a tcp listner to the specified port
+int bind_tcp_server(int port)
+{
+    int server_fd;
+    struct sockaddr_in address;
+    int opt = 1;
+
+    LOG_INFO("bind_server %d", port);
+    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
+    {
+        perror("socket failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Allow the socket to be reused
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1)
+    {
+        perror("setsockopt");
+        close(server_fd);
+        exit(EXIT_FAILURE);
+    }
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        perror("bind failed");
+        close(server_fd);
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen(server_fd, listen_backlog) < 0)
+    {
+        perror("listen");
+        close(server_fd);
+        exit(EXIT_FAILURE);
+    }
+    return server_fd;
+}
+
+// method to write a whole buffer to a (blocking) file descriptor, short writes are continued.
+// returns 0 on success or -1 when the destination failed
+int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// method to write io vectors completely to a (blocking) file descriptor, the vectors are modified on short writes.
+// returns 0 on success or -1 when the destination failed
+int writev_all(int fd, struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t n = writev(fd, iov, count);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// method to check whether a file descriptor is a stream that splice() can move data through
+// (a stream socket, a pipe or a character device such as a tty)
+int is_stream_fd(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        return 0;
+    }
+    if (S_ISSOCK(st.st_mode))
+    {
+        int type = 0;
+        socklen_t len = sizeof(type);
+        return getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_STREAM;
+    }
+    return S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode);
+}
+
+// method to move data from a stream file descriptor to a stream file descriptor through a pipe with splice(),
+// so that the data never gets copied to user memory.
+// returns 0 when the source reached end of file, or -1 when splice is not supported for these file descriptors
+// before any data was moved (the caller should then fall back to the copy loop)
+int splice_and_write(int src_fd, int dest_fd)
+{
+    int pipe_fds[2];
+    ssize_t in_pipe = 0;
+    int moved_any = 0;
+
+    if (pipe(pipe_fds) == -1)
+    {
+        return -1;
+    }
+    // a larger pipe lets every splice call move more data
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, SPLICE_CHUNK);
+
+    while (1)
+    {
+        ssize_t n = splice(src_fd, NULL, pipe_fds[1], NULL, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1 && !moved_any && (errno == EINVAL || errno == ENOSYS))
+        {
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+            return -1;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        moved_any = 1;
+        in_pipe = n;
+        // drain the pipe completely into the destination, splice may move less than asked for
+        while (in_pipe > 0)
+        {
+            ssize_t out = splice(pipe_fds[0], NULL, dest_fd, NULL, in_pipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (out == -1 && errno == EINVAL)
+            {
+                // the destination does not accept splice, hand the pipe content over with a copy
+                char buffer[1024];
+                ssize_t bytes_read;
+                while (in_pipe > 0 && (bytes_read = read(pipe_fds[0], buffer, sizeof(buffer))) > 0)
+                {
+                    write_all(dest_fd, buffer, bytes_read);
+                    in_pipe -= bytes_read;
+                }
+                close(pipe_fds[0]);
+                close(pipe_fds[1]);
+                return -1;
+            }
+            if (out <= 0)
+            {
+                close(pipe_fds[0]);
+                close(pipe_fds[1]);
+                return 0;
+            }
+            in_pipe -= out;
+        }
+    }
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return 0;
+}
+
+// method to read from a straem file descriptor and write to a stream file descriptor
+// when both ends are streams the data is moved with splice(), otherwise it is copied through a buffer.
+// writes block until the destination took all data, so a slow destination stops the reading as well
+void read_and_write(int src_fd, int dest_fd)
+{
+    char buffer[1024];
+    int bytes_read;
+
+    if (is_stream_fd(src_fd) && is_stream_fd(dest_fd) && splice_and_write(src_fd, dest_fd) == 0)
+    {
+        return;
+    }
+    // fflush(stdout);
+    while ((bytes_read = read(src_fd, buffer, sizeof(buffer))) > 0)
+    {
+        if (write_all(dest_fd, buffer, bytes_read) == -1)
+        {
+            break;
+        }
+    }
+}
+
+// method called when a report of the relay statistics is requested (SIGUSR1)
+void handle_report(int sig)
+{
+    report_requested = 1;
+}
+
+// method called when a process is terminated (the -t timeout, a supervisor or a prefork master): the pool memory it
+// holds is given back before it ends, so the sessions that go on do not wait for memory of a process that is gone
+void handle_terminate(int sig)
+{
+    pool_release_process();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// method to allocate a batch of datagram slots used with recvmmsg/sendmmsg.
+// every slot is large enough for any datagram (or a run of coalesced datagrams), a batch that receives
+// coalesced datagrams (gro) is limited to GRO_BATCH_MAX slots
+struct udp_batch *udp_batch_create(int size, int gro)
+{
+    struct udp_batch *batch = calloc(1, sizeof(struct udp_batch));
+    if (batch == NULL)
+    {
+        printErrorAndExit("calloc");
+    }
+    batch->size = gro && size > GRO_BATCH_MAX ? GRO_BATCH_MAX : size;
+    batch->gro = gro;
+    // every slot holds the largest datagram. the slots are one mapping whose pages are only backed by memory once a
+    // datagram was received into them, so small datagrams cost a page per slot and not 64 KiB
+    batch->slot_size = RELAY_BUFFER_SIZE;
+    batch->data = malloc(batch->size * batch->slot_size);
+    if (batch->data == NULL)
+    {
+        printErrorAndExit("malloc");
+    }
+    return batch;
+}
+
+// method to release a batch of datagram slots
+void udp_batch_free(struct udp_batch *batch)
+{
+    if (batch != NULL)
+    {
+        free(batch->data);
+        free(batch);
+    }
+}
+
+// method to receive up to a full batch of datagrams with one recvmmsg call.
+// returns the number of datagrams received (the batch statistics are updated) or -1 on error
+int udp_batch_recv(struct udp_batch *batch, int src_dgram_fd, int flags)
+{
+    for (int i = 0; i < batch->size; ++i)
+    {
+        batch->iovs[i].iov_base = batch->data + i * batch->slot_size;
+        batch->iovs[i].iov_len = batch->slot_size;
+        memset(&batch->msgs[i], 0, sizeof(batch->msgs[i]));
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addrs[i]);
+        if (batch->gro)
+        {
+            batch->msgs[i].msg_hdr.msg_control = batch->control[i];
+            batch->msgs[i].msg_hdr.msg_controllen = sizeof(batch->control[i]);
+        }
+    }
+    int count = recvmmsg(src_dgram_fd, batch->msgs, batch->size, flags, NULL);
+    if (count > 0)
+    {
+        batch->held[count]++;
+        // from now on the io vectors describe the received datagrams
+        for (int i = 0; i < count; ++i)
+        {
+            batch->iovs[i].iov_len = batch->msgs[i].msg_len;
+            // only a unix datagram can be larger than a slot, the part that did not fit is lost
+            if (batch->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+            {
+                batch->truncated++;
+            }
+            batch->segments[i] = 1;
+            if (batch->gro)
+            {
+                // the segment size of coalesced datagrams is passed as control message
+                offload_stats.gro_receives++;
+                for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&batch->msgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&batch->msgs[i].msg_hdr, cmsg))
+                {
+                    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+                    {
+                        int segment = *(int *)CMSG_DATA(cmsg);
+                        if (segment > 0 && batch->msgs[i].msg_len > (unsigned)segment)
+                        {
+                            batch->segments[i] = (batch->msgs[i].msg_len + segment - 1) / segment;
+                            offload_stats.gro_coalesced++;
+                            offload_stats.gro_segments += batch->segments[i];
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return count;
+}
+
+// method to send the datagrams first .. count-1 of a batch to dest_addr with sendmmsg.
+// datagrams a UDP socket does not accept are dropped and counted, a non-blocking send to a unix datagram socket
+// stops when the peer's queue is full. returns the index of the first datagram that was not sent
+int udp_batch_sendto(struct udp_batch *batch, int first, int count, int dest_dgram_fd, struct sockaddr_storage *dest_addr, int flags)
+{
+    int sent = first;
+    for (int i = first; i < count; ++i)
+    {
+        batch->msgs[i].msg_hdr.msg_name = dest_addr;
+        batch->msgs[i].msg_hdr.msg_namelen = sockaddr_length(dest_addr);
+    }
+    while (sent < count)
+    {
+        int n = sendmmsg(dest_dgram_fd, batch->msgs + sent, count - sent, flags);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && dest_addr->ss_family == AF_UNIX)
+        {
+            // the peer's queue is full, the rest waits until it has room
+            break;
+        }
+        if (n <= 0)
+        {
+            // skip the datagram that failed and try the rest
+            batch->dropped++;
+            sent++;
+            continue;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+// method to print how many datagrams the batches of a relay held
+void udp_batch_report(struct udp_batch *batch, const char *name)
+{
+    if (batch == NULL)
+    {
+        return;
+    }
+    fprintf(stderr, "%s: datagrams per batch:", name);
+    for (int i = 1; i <= batch->size; ++i)
+    {
+        if (batch->held[i] > 0)
+        {
+            fprintf(stderr, " %d:%lu", i, batch->held[i]);
+        }
+    }
+    fprintf(stderr, " dropped:%lu truncated:%lu\n", batch->dropped, batch->truncated);
+}
+
+// method to get the largest amount of stream data that is turned into datagrams at once:
+// a single datagram without UDP_SEGMENT, or as many segments as one UDP_SEGMENT send can carry
+size_t stream_to_dgram_size()
+{
+    if (gso_size == 0)
+    {
+        return STREAM_DGRAM_SIZE;
+    }
+    size_t segments = UDP_MAX_PAYLOAD / gso_size;
+    if (segments > UDP_GSO_MAX_SEGMENTS)
+    {
+        segments = UDP_GSO_MAX_SEGMENTS;
+    }
+    return segments * gso_size;
+}
+
+// method to send stream data as datagrams of at most gso_size bytes (one datagram when --gso is not given).
+// when possible all segments are handed to the kernel with one UDP_SEGMENT sendmsg, if the kernel rejects
+// UDP_SEGMENT the segments are sent one by one from then on.
+// returns the number of bytes sent or -1 when nothing could be sent
+ssize_t sendto_segmented(int dest_dgram_fd, const char *data, size_t len, struct sockaddr_storage *dest_addr, int flags)
+{
+    // unix datagram sockets ignore UDP_SEGMENT, they get the segments one by one
+    if (gso_size > 0 && gso_supported && len > gso_size && dest_addr->ss_family == AF_INET)
+    {
+        char control[CMSG_SPACE(sizeof(uint16_t))];
+        struct iovec iov = {.iov_base = (void *)data, .iov_len = len};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        memset(control, 0, sizeof(control));
+        msg.msg_name = dest_addr;
+        msg.msg_namelen = sockaddr_length(dest_addr);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        *(uint16_t *)CMSG_DATA(cmsg) = gso_size;
+
+        ssize_t n = sendmsg(dest_dgram_fd, &msg, flags);
+        if (n >= 0)
+        {
+            offload_stats.gso_sends++;
+            offload_stats.gso_segments += (len + gso_size - 1) / gso_size;
+            return n;
+        }
+        if (errno != EIO && errno != EINVAL && errno != ENOPROTOOPT && errno != EOPNOTSUPP)
+        {
+            return -1;
+        }
+        gso_supported = 0;
+        offload_stats.gso_fallbacks++;
+    }
+
+    size_t segment = gso_size > 0 ? gso_size : len;
+    size_t sent = 0;
+    while (sent < len)
+    {
+        size_t chunk = len - sent < segment ? len - sent : segment;
+        if (sendto(dest_dgram_fd, data + sent, chunk, flags, (struct sockaddr *)dest_addr, sockaddr_length(dest_addr)) == -1)
+        {
+            return sent > 0 ? (ssize_t)sent : -1;
+        }
+        sent += chunk;
+    }
+    return sent;
+}
+
+// method to turn on UDP_GRO on a datagram socket whose data goes to a stream, so that the kernel hands
+// over several coalesced datagrams of a flow with one receive. returns 1 when GRO was turned on
+int enable_udp_gro(int dgram_fd)
+{
+    int on = 1;
+    if (gso_size == 0)
+    {
+        return 0;
+    }
+    return setsockopt(dgram_fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+}
+
+// method to print how often the UDP segmentation offload fast paths were used
+void offload_report()
+{
+    if (gso_size == 0)
+    {
+        return;
+    }
+    fprintf(stderr, "udp offload: gso sends:%lu segments:%lu fallbacks:%lu gro receives:%lu coalesced:%lu segments:%lu\n",
+            offload_stats.gso_sends, offload_stats.gso_segments, offload_stats.gso_fallbacks,
+            offload_stats.gro_receives, offload_stats.gro_coalesced, offload_stats.gro_segments);
+}
+
+// method to read from a straem file descriptor and write to a datagram file descriptor
+// with --gso the data is read in large chunks that the kernel splits into datagrams (UDP_SEGMENT)
+void read_and_sendto(int src_fd, int dest_dgram_fd, struct sockaddr_storage *client_addr)
+{
+    char buffer[RELAY_BUFFER_SIZE];
+    int bytes_read;
+
+    while ((bytes_read = read(src_fd, buffer, stream_to_dgram_size())) > 0)
+    {
+        sendto_segmented(dest_dgram_fd, buffer, bytes_read, client_addr, 0);
+    }
+    offload_report();
+}
+
+// method to read from an input datagram file descriptor and write to an output straem file descriptor
+// methos receives an optional initial content to write to the output fd.
+// datagrams are received in batches with recvmmsg and every batch is written with a single writev
+void recvfrom_and_write(int src_dgram_fd, char *buffer, ssize_t buffer_size, ssize_t buffer_content, int dest_fd)
+{
+    struct udp_batch *batch = udp_batch_create(udp_batch, enable_udp_gro(src_dgram_fd));
+
+    if (buffer_content > 0)
+    {
+        write_all(dest_fd, buffer, buffer_content);
+    }
+    while (1)
+    {
+        int count = udp_batch_recv(batch, src_dgram_fd, MSG_WAITFORONE);
+        if (report_requested)
+        {
+            report_requested = 0;
+            udp_batch_report(batch, "recvfrom_and_write");
+            offload_report();
+        }
+        if (count == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count == -1)
+        {
+            break;
+        }
+        if (writev_all(dest_fd, batch->iovs, count) == -1)
+        {
+            break;
+        }
+    }
+    udp_batch_report(batch, "recvfrom_and_write");
+    offload_report();
+    udp_batch_free(batch);
+}
+
+// method to read from an input datagram file descriptor and write to an output datagram file descriptor
+// method receives an optional initial content to write to the output fd.
+// datagrams are received in batches with recvmmsg and every batch is forwarded with a single sendmmsg
+void recvfrom_and_sendto(int src_dgram_fd, char *buffer, ssize_t buffer_size, ssize_t buffer_content, int dest_dgram_fd, struct sockaddr_storage *dest_addr)
+{
+    struct udp_batch *batch = udp_batch_create(udp_batch, 0);
+
+    if (buffer_content > 0)
+    {
+        sendto(dest_dgram_fd, buffer, buffer_content, 0, (struct sockaddr *)dest_addr, sockaddr_length(dest_addr));
+    }
+    while (1)
+    {
+        int count = udp_batch_recv(batch, src_dgram_fd, MSG_WAITFORONE);
+        if (report_requested)
+        {
+            report_requested = 0;
+            udp_batch_report(batch, "recvfrom_and_sendto");
+        }
+        if (count == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count == -1)
+        {
+            break;
+        }
+        udp_batch_sendto(batch, 0, count, dest_dgram_fd, dest_addr, 0);
+    }
+    udp_batch_report(batch, "recvfrom_and_sendto");
+    udp_batch_free(batch);
+}
+
+// create initialize and return a udp server socket bound to the given port
+int start_udp_server(int port)
+{
+    int server_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (server_sock < 0)
+    {
+        printErrorAndExit("Error creating socket");
+    }
+
+    struct sockaddr_in server_addr = {};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        perror("Error binding socket");
+        close(server_sock);
+        exit(EXIT_FAILURE);
+    }
+
+    return server_sock;
+}
+
+// create initialize a client socket and the address of the given host and port
+int start_udp_client(char *hostname, int port, struct sockaddr_storage *server_addr)
+{
+    struct sockaddr_in *server_in = (struct sockaddr_in *)server_addr;
+    int client_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (client_sock < 0)
+    {
+        printErrorAndExit("Error creating socket");
+    }
+
+    memset(server_addr, 0, sizeof(*server_addr));
+    if (resolve_host(hostname, &server_in->sin_addr) == -1)
+    {
+        LOG_ERROR("could not resolve hostname %s", hostname);
+        close(client_sock);
+        exit(EXIT_FAILURE);
+    }
+
+    server_in->sin_family = AF_INET;
+    server_in->sin_port = htons(port);
+
+    return client_sock;
+}
+
+// method to fill the address of a unix domain socket, a path starting with '@' names an abstract socket.
+// returns the length of the address
+socklen_t unix_address(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        fprintf(stderr, "Error: unix socket path too long %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr->sun_path, path);
+    if (path[0] == '@')
+    {
+        addr->sun_path[0] = '\0';
+    }
+    return sockaddr_length((struct sockaddr_storage *)addr);
+}
+
+// method to check whether a server still has a socket bound to path. the bound sockets of the system are listed in
+// /proc/net/unix, a probing connect would be taken as a client by a stream server. returns 1 when the path is in use
+int unix_path_in_use(const char *path)
+{
+    char line[PATH_MAX + 128];
+    char resolved[PATH_MAX];
+    const char *names[2] = {path, realpath(path, resolved)};
+    int in_use = 0;
+    FILE *sockets = fopen("/proc/net/unix", "r");
+    if (sockets == NULL)
+    {
+        return 0;
+    }
+    while (!in_use && fgets(line, sizeof(line), sockets) != NULL)
+    {
+        // the path is the last field of a line
+        line[strcspn(line, "\n")] = '\0';
+        char *name = strrchr(line, ' ');
+        for (int i = 0; i < 2 && name != NULL; ++i)
+        {
+            in_use |= names[i] != NULL && strcmp(name + 1, names[i]) == 0;
+        }
+    }
+    fclose(sockets);
+    return in_use;
+}
+
+// method to create a unix domain server socket of the given type (SOCK_STREAM or SOCK_DGRAM) bound to path,
+// a stream socket listens for clients. a stale socket file left by an earlier server is removed, a path that another
+// server still uses is refused
+int bind_unix_server(const char *path, int type)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    socklen_t len = unix_address(path, &addr);
+
+    int server_fd = socket(AF_UNIX, type, 0);
+    if (server_fd < 0)
+    {
+        printErrorAndExit("socket failed");
+    }
+    // a socket file left behind by an ended server is replaced, one that a server still serves is not
+    if (path[0] != '@' && stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        if (unix_path_in_use(path))
+        {
+            fprintf(stderr, "Error: %s is in use by another server\n", path);
+            exit(EXIT_FAILURE);
+        }
+        unlink(path);
+    }
+    if (bind(server_fd, (struct sockaddr *)&addr, len) < 0)
+    {
+        perror("bind failed");
+        close(server_fd);
+        exit(EXIT_FAILURE);
+    }
+    if (type == SOCK_STREAM && listen(server_fd, listen_backlog) < 0)
+    {
+        perror("listen");
+        close(server_fd);
+        exit(EXIT_FAILURE);
+    }
+    return server_fd;
+}
+
+// method to create a unix domain client socket of the given type for the server at path: a stream socket is
+// connected, a datagram socket gets an autobound abstract name so that the server can answer and the address
+// of the server is stored in server_addr
+int start_unix_client(const char *path, int type, struct sockaddr_storage *server_addr)
+{
+    struct sockaddr_un addr;
+    socklen_t len = unix_address(path, &addr);
+
+    int client_sock = socket(AF_UNIX, type, 0);
+    if (client_sock < 0)
+    {
+        printErrorAndExit("Error creating socket");
+    }
+    if (type == SOCK_STREAM)
+    {
+        if (connect(client_sock, (struct sockaddr *)&addr, len) < 0)
+        {
+            LOG_ERROR("connection to unix server %s failed", path);
+            close(client_sock);
+            exit(EXIT_FAILURE);
+        }
+        return client_sock;
+    }
+    sa_family_t family = AF_UNIX;
+    if (bind(client_sock, (struct sockaddr *)&family, sizeof(family)) < 0)
+    {
+        printErrorAndExit("bind");
+    }
+    // a connected datagram socket is reported writable by epoll only while the server's queue has room
+    if (connect(client_sock, (struct sockaddr *)&addr, len) < 0)
+    {
+        LOG_ERROR("connection to unix server %s failed", path);
+        close(client_sock);
+        exit(EXIT_FAILURE);
+    }
+    memset(server_addr, 0, sizeof(*server_addr));
+    memcpy(server_addr, &addr, sizeof(addr));
+    return client_sock;
+}
+
+// method to add a sample in microseconds to a histogram: bucket n counts the samples below 2^n us
+void histogram_add(struct histogram *histogram, uint64_t us)
+{
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= HISTOGRAM_BUCKETS)
+    {
+        bucket = HISTOGRAM_BUCKETS - 1;
+    }
+    __atomic_add_fetch(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->sum_us, us, __ATOMIC_RELAXED);
+}
+
+// method returning the upper bound in microseconds of the bucket that holds the given fraction of the samples
+unsigned long histogram_percentile(struct histogram *histogram, double fraction)
+{
+    unsigned long count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    unsigned long seen = 0;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS && count > 0; ++bucket)
+    {
+        seen += __atomic_load_n(&histogram->buckets[bucket], __ATOMIC_RELAXED);
+        if (seen >= fraction * count)
+        {
+            return 1UL << bucket;
+        }
+    }
+    return 0;
+}
+
+// method returning the time in microseconds, used for the latency histograms
+uint64_t monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// method to count a client accepted by a listener
+void metrics_accepted()
+{
+    __atomic_add_fetch(&shared->metrics.listeners[current_listener].accepted, 1, __ATOMIC_RELAXED);
+}
+
+// method to take a session slot for this process when metrics are served (-m). a process that finds all slots
+// taken is only counted in the totals
+void metrics_session_begin()
+{
+    struct metrics *metrics = &shared->metrics;
+    if (metrics_address == NULL)
+    {
+        return;
+    }
+    __atomic_add_fetch(&metrics->sessions_started, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&metrics->listeners[current_listener].sessions, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < METRICS_SESSIONS; ++i)
+    {
+        pid_t free_slot = 0;
+        struct session_metrics *session = &metrics->sessions[i];
+        if (__atomic_compare_exchange_n(&session->pid, &free_slot, getpid(), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            memset(session->traffic, 0, sizeof(session->traffic));
+            session->listener = current_listener;
+            session->started_ms = monotonic_ms();
+            current_session = session;
+            return;
+        }
+    }
+    __atomic_add_fetch(&metrics->sessions_untracked, 1, __ATOMIC_RELAXED);
+}
+
+// method to give the session slot of this process back
+void metrics_session_end()
+{
+    if (current_session != NULL)
+    {
+        __atomic_store_n(&current_session->pid, 0, __ATOMIC_RELEASE);
+        current_session = NULL;
+    }
+}
+
+// method to point a relay at the counters of its direction (0 for the first direction of the chat, 1 for the
+// second) in the session and the listener it belongs to
+void metrics_attach(struct relay *relay, int direction)
+{
+    if (metrics_address == NULL)
+    {
+        return;
+    }
+    relay->traffic[0] = current_session != NULL ? &current_session->traffic[direction] : NULL;
+    relay->traffic[1] = &shared->metrics.listeners[current_listener].traffic[direction];
+}
+
+// method to count data received by a relay: the only work metrics add to the relay paths are these atomic adds
+void metrics_count(struct relay *relay, size_t bytes, unsigned long messages, unsigned long drops)
+{
+    for (int i = 0; i < 2; ++i)
+    {
+        if (relay->traffic[i] != NULL)
+        {
+            __atomic_add_fetch(&relay->traffic[i]->bytes, bytes, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&relay->traffic[i]->messages, messages, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&relay->traffic[i]->drops, drops, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// method to write the counters of both directions as text or JSON
+void write_traffic(FILE *out, int json, const char *labels, struct traffic_counters traffic[2])
+{
+    const char *names[2] = {"forward", "reverse"};
+    for (int d = 0; d < 2; ++d)
+    {
+        unsigned long bytes = __atomic_load_n(&traffic[d].bytes, __ATOMIC_RELAXED);
+        unsigned long messages = __atomic_load_n(&traffic[d].messages, __ATOMIC_RELAXED);
+        unsigned long drops = __atomic_load_n(&traffic[d].drops, __ATOMIC_RELAXED);
+        if (json)
+        {
+            fprintf(out, "%s\"%s\":{\"bytes\":%lu,\"messages\":%lu,\"drops\":%lu}", d ? "," : "", names[d], bytes, messages, drops);
+        }
+        else
+        {
+            fprintf(out, "mync_bytes{%s,direction=\"%s\"} %lu\n", labels, names[d], bytes);
+            fprintf(out, "mync_messages{%s,direction=\"%s\"} %lu\n", labels, names[d], messages);
+            fprintf(out, "mync_drops{%s,direction=\"%s\"} %lu\n", labels, names[d], drops);
+        }
+    }
+}
+
+// method to write a histogram as text (cumulative buckets like Prometheus) or JSON (buckets and percentiles)
+void write_histogram(FILE *out, int json, const char *name, struct histogram *histogram)
+{
+    unsigned long count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    unsigned long sum = __atomic_load_n(&histogram->sum_us, __ATOMIC_RELAXED);
+    unsigned long cumulative = 0;
+    if (json)
+    {
+        fprintf(out, "\"%s\":{\"count\":%lu,\"sum_us\":%lu,\"p50_us\":%lu,\"p99_us\":%lu,\"p999_us\":%lu,\"buckets\":[", name, count, sum,
+                histogram_percentile(histogram, 0.5), histogram_percentile(histogram, 0.99), histogram_percentile(histogram, 0.999));
+    }
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket)
+    {
+        unsigned long value = __atomic_load_n(&histogram->buckets[bucket], __ATOMIC_RELAXED);
+        cumulative += value;
+        if (json)
+        {
+            fprintf(out, "%s%lu", bucket ? "," : "", value);
+        }
+        else if (bucket == HISTOGRAM_BUCKETS - 1)
+        {
+            // the last bucket also holds everything slower
+            fprintf(out, "mync_%s_bucket{le=\"+Inf\"} %lu\n", name, cumulative);
+        }
+        else if (value > 0)
+        {
+            fprintf(out, "mync_%s_bucket{le=\"%lu\"} %lu\n", name, 1UL << bucket, cumulative);
+        }
+    }
+    if (json)
+    {
+        fprintf(out, "]}");
+    }
+    else
+    {
+        fprintf(out, "mync_%s_count %lu\nmync_%s_sum %lu\n", name, count, name, sum);
+    }
+}
+
+// method to write all metrics. sessions whose process was killed without releasing the slot are skipped
+void write_metrics(FILE *out, int json)
+{
+    struct metrics *metrics = &shared->metrics;
+    char labels[64];
+    int live = 0;
+    uint64_t now = monotonic_ms();
+
+    for (int i = 0; i < METRICS_SESSIONS; ++i)
+    {
+        pid_t pid = __atomic_load_n(&metrics->sessions[i].pid, __ATOMIC_ACQUIRE);
+        live += pid != 0 && kill(pid, 0) == 0;
+    }
+    if (json)
+    {
+        fprintf(out, "{\"sessions_started\":%lu,\"sessions_live\":%d,\"sessions_untracked\":%lu,\"listeners\":[",
+                metrics->sessions_started, live, metrics->sessions_untracked);
+    }
+    else
+    {
+        fprintf(out, "mync_sessions_started %lu\nmync_sessions_live %d\nmync_sessions_untracked %lu\n",
+                metrics->sessions_started, live, metrics->sessions_untracked);
+    }
+
+    int first = 1;
+    for (int l = 0; l < LISTENERS_MAX; ++l)
+    {
+        struct listener_metrics *listener = &metrics->listeners[l];
+        if (l > 0 && listener->accepted == 0 && listener->sessions == 0 && listener->traffic[0].messages == 0 && listener->traffic[1].messages == 0)
+        {
+            continue;
+        }
+        if (json)
+        {
+            fprintf(out, "%s{\"listener\":%d,\"accepted\":%lu,\"sessions\":%lu,", first ? "" : ",", l, listener->accepted, listener->sessions);
+            write_traffic(out, json, NULL, listener->traffic);
+            fprintf(out, "}");
+        }
+        else
+        {
+            snprintf(labels, sizeof(labels), "listener=\"%d\"", l);
+            fprintf(out, "mync_accepted{%s} %lu\nmync_listener_sessions{%s} %lu\n", labels, listener->accepted, labels, listener->sessions);
+            write_traffic(out, json, labels, listener->traffic);
+        }
+        first = 0;
+    }
+
+    fprintf(out, json ? "],\"sessions\":[" : "");
+    first = 1;
+    for (int i = 0; i < METRICS_SESSIONS; ++i)
+    {
+        struct session_metrics *session = &metrics->sessions[i];
+        pid_t pid = __atomic_load_n(&session->pid, __ATOMIC_ACQUIRE);
+        if (pid == 0 || kill(pid, 0) != 0)
+        {
+            continue;
+        }
+        if (json)
+        {
+            fprintf(out, "%s{\"pid\":%d,\"listener\":%d,\"age_ms\":%llu,", first ? "" : ",", pid, session->listener,
+                    (unsigned long long)(now - session->started_ms));
+            write_traffic(out, json, NULL, session->traffic);
+            fprintf(out, "}");
+        }
+        else
+        {
+            snprintf(labels, sizeof(labels), "session=\"%d\",listener=\"%d\"", pid, session->listener);
+            fprintf(out, "mync_session_age_ms{%s} %llu\n", labels, (unsigned long long)(now - session->started_ms));
+            write_traffic(out, json, labels, session->traffic);
+        }
+        first = 0;
+    }
+
+    fprintf(out, json ? "]," : "");
+    write_histogram(out, json, "spawn_latency_us", &metrics->spawn_latency);
+    fprintf(out, json ? "," : "");
+    write_histogram(out, json, "relay_latency_us", &metrics->relay_latency);
+    fprintf(out, json ? "," : "");
+    write_rate_counters(out, json);
+    fprintf(out, json ? "}\n" : "");
+}
+
+// method to open the metrics endpoint of -m: a port number listens on 127.0.0.1, anything else is the path of a
+// unix socket (@ for an abstract name)
+int open_metrics_endpoint(const char *address)
+{
+    if (strspn(address, "0123456789") != strlen(address))
+    {
+        return bind_unix_server(address, SOCK_STREAM);
+    }
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(atoi(address)), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    int opt = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1 ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, listen_backlog) == -1)
+    {
+        printErrorAndExit("metrics endpoint");
+    }
+    return fd;
+}
+
+// method to take a client of the metrics endpoint into a free slot, a client that finds every slot busy is closed
+void metrics_accept(int listen_fd, struct metrics_client *clients)
+{
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1)
+    {
+        return;
+    }
+    for (int i = 0; i < METRICS_CLIENTS; ++i)
+    {
+        if (clients[i].fd == -1)
+        {
+            memset(&clients[i], 0, sizeof(clients[i]));
+            clients[i].fd = fd;
+            clients[i].deadline_ms = monotonic_ms() + METRICS_REQUEST_WAIT_MS;
+            return;
+        }
+    }
+    close(fd);
+}
+
+// method to close a client of the metrics endpoint and free its slot
+void metrics_client_close(struct metrics_client *client)
+{
+    close(client->fd);
+    free(client->response);
+    client->fd = -1;
+    client->response = NULL;
+}
+
+// method to send what the socket takes of a client's response, the client is closed once it has all of it
+void metrics_send(struct metrics_client *client)
+{
+    while (client->sent < client->response_len)
+    {
+        ssize_t n = send(client->fd, client->response + client->sent, client->response_len - client->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            break;
+        }
+        client->sent += n;
+    }
+    metrics_client_close(client);
+}
+
+// method to build the response to the request of a client: a line that contains "json" selects JSON, a line that
+// starts with "GET " gets an HTTP response (curl http://127.0.0.1:PORT/json), no request gets text
+void metrics_respond(struct metrics_client *client)
+{
+    char *text = NULL;
+    size_t len = 0;
+    client->request[client->request_len] = '\0';
+    client->request[strcspn(client->request, "\r\n")] = '\0';
+    int json = strstr(client->request, "json") != NULL;
+
+    FILE *out = open_memstream(&text, &len);
+    if (out == NULL)
+    {
+        metrics_client_close(client);
+        return;
+    }
+    write_metrics(out, json);
+    fclose(out);
+    if (strncmp(client->request, "GET ", 4) == 0)
+    {
+        char header[128];
+        int header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+                                  json ? "application/json" : "text/plain", len);
+        char *response = malloc(header_len + len);
+        if (response == NULL)
+        {
+            free(text);
+            metrics_client_close(client);
+            return;
+        }
+        memcpy(response, header, header_len);
+        memcpy(response + header_len, text, len);
+        free(text);
+        text = response;
+        len += header_len;
+    }
+    client->response = text;
+    client->response_len = len;
+    client->deadline_ms = monotonic_ms() + METRICS_SEND_WAIT_MS;
+    metrics_send(client);
+}
+
+// method to serve a client of the metrics endpoint that became readable or writable. the first read ends the
+// request, as a request line arrives in one piece
+void metrics_client_ready(struct metrics_client *client)
+{
+    if (client->response != NULL)
+    {
+        metrics_send(client);
+        return;
+    }
+    ssize_t n = recv(client->fd, client->request, sizeof(client->request) - 1, 0);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return;
+    }
+    client->request_len = n > 0 ? n : 0;
+    metrics_respond(client);
+}
+
+// method to answer the clients that sent no request in time and to drop the ones that did not take their response
+// in time. returns the poll timeout until the next deadline, -1 without clients
+int metrics_clients_expire(struct metrics_client *clients)
+{
+    uint64_t now = monotonic_ms();
+    int timeout = -1;
+    for (int i = 0; i < METRICS_CLIENTS; ++i)
+    {
+        struct metrics_client *client = &clients[i];
+        if (client->fd != -1 && now >= client->deadline_ms)
+        {
+            if (client->response == NULL)
+            {
+                metrics_respond(client);
+            }
+            else
+            {
+                metrics_client_close(client);
+            }
+        }
+        if (client->fd != -1 && (timeout == -1 || client->deadline_ms - now < (uint64_t)timeout))
+        {
+            timeout = client->deadline_ms - now;
+        }
+    }
+    return timeout;
+}
+
+// method returning the time in nanoseconds, the time line of the token buckets
+uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// method to parse a limit of --rate=SCOPE:bytes=N,msgs=N,burst=N,msg-burst=N,policy=drop|delay (sizes may end with
+// K, M or G). returns 0, or -1 for an invalid limit
+int parse_rate(const char *spec)
+{
+    char text[256];
+    int scope;
+    snprintf(text, sizeof(text), "%s", spec);
+    char *colon = strchr(text, ':');
+    if (colon == NULL)
+    {
+        return -1;
+    }
+    *colon = '\0';
+    for (scope = 0; scope < RATE_SCOPES && strcmp(text, rate_scope_names[scope]) != 0; ++scope)
+    {
+    }
+    if (scope == RATE_SCOPES)
+    {
+        return -1;
+    }
+    struct rate_limit *limit = &rate_limits[scope];
+    memset(limit, 0, sizeof(*limit));
+    char *saveptr;
+    for (char *item = strtok_r(colon + 1, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr))
+    {
+        char *value = strchr(item, '=');
+        if (value == NULL)
+        {
+            return -1;
+        }
+        *value++ = '\0';
+        if (strcmp(item, "bytes") == 0)
+        {
+            limit->bytes_per_s = parse_size(value);
+        }
+        else if (strcmp(item, "msgs") == 0)
+        {
+            limit->msgs_per_s = parse_size(value);
+        }
+        else if (strcmp(item, "burst") == 0)
+        {
+            limit->burst_bytes = parse_size(value);
+        }
+        else if (strcmp(item, "msg-burst") == 0)
+        {
+            limit->burst_msgs = parse_size(value);
+        }
+        else if (strcmp(item, "policy") == 0 && (strcmp(value, "drop") == 0 || strcmp(value, "delay") == 0))
+        {
+            limit->delay = strcmp(value, "delay") == 0;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    if (limit->bytes_per_s == 0 && limit->msgs_per_s == 0)
+    {
+        return -1;
+    }
+    // the default burst is 100 ms of traffic, at least the largest datagram or a single message
+    if (limit->burst_bytes == 0)
+    {
+        limit->burst_bytes = limit->bytes_per_s / 10 > RATE_MIN_BURST_BYTES ? limit->bytes_per_s / 10 : RATE_MIN_BURST_BYTES;
+    }
+    if (limit->burst_msgs == 0)
+    {
+        limit->burst_msgs = limit->msgs_per_s / 10 > 1 ? limit->msgs_per_s / 10 : 1;
+    }
+    rate_limited = 1;
+    return 0;
+}
+
+// method to take cost ns from a bucket (GCRA): the bucket's time line runs ahead of now by what was taken and not
+// yet earned back. returns how far it runs ahead beyond the tolerated burst, 0 when the traffic conforms. without
+// charge nothing is taken. the compare and swap lets processes and threads share a bucket without a lock
+uint64_t bucket_take(uint64_t *tat, uint64_t now, uint64_t cost, uint64_t tolerance, int charge)
+{
+    uint64_t old = __atomic_load_n(tat, __ATOMIC_RELAXED);
+    while (1)
+    {
+        uint64_t start = old > now ? old : now;
+        uint64_t ahead = start + cost - now;
+        uint64_t excess = ahead > tolerance ? ahead - tolerance : 0;
+        if (!charge || __atomic_compare_exchange_n(tat, &old, start + cost, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            return excess;
+        }
+    }
+}
+
+// method to take bytes and messages from the bucket of a limit, returns the larger excess of the two
+uint64_t rate_take(struct rate_limit *limit, struct token_bucket *bucket, uint64_t now, size_t bytes, unsigned long messages, int charge)
+{
+    uint64_t excess = 0;
+    if (limit->bytes_per_s > 0)
+    {
+        uint64_t cost = bytes * 1000000000ULL / limit->bytes_per_s;
+        excess = bucket_take(&bucket->bytes_tat, now, cost, limit->burst_bytes * 1000000000ULL / limit->bytes_per_s, charge);
+    }
+    if (limit->msgs_per_s > 0)
+    {
+        uint64_t cost = 1000000000ULL / limit->msgs_per_s;
+        uint64_t msgs_excess = bucket_take(&bucket->msgs_tat, now, messages * cost, limit->burst_msgs * cost, charge);
+        excess = msgs_excess > excess ? msgs_excess : excess;
+    }
+    return excess;
+}
+
+// method to find the shared bucket of a source address (the IP address, not the port). addresses whose slots
+// collide share a bucket until the bucket of the older one ran empty
+struct token_bucket *rate_source_bucket(struct sockaddr_storage *address)
+{
+    const unsigned char *bytes;
+    size_t len;
+    if (address->ss_family == AF_INET)
+    {
+        bytes = (const unsigned char *)&((struct sockaddr_in *)address)->sin_addr;
+        len = sizeof(struct in_addr);
+    }
+    else if (address->ss_family == AF_INET6)
+    {
+        bytes = (const unsigned char *)&((struct sockaddr_in6 *)address)->sin6_addr;
+        len = sizeof(struct in6_addr);
+    }
+    else
+    {
+        return NULL;
+    }
+    // FNV-1a, the key is never 0 so that 0 marks a free slot
+    uint64_t key = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i)
+    {
+        key = (key ^ bytes[i]) * 1099511628211ULL;
+    }
+    key |= 1;
+    struct rate_source *source = &shared->rate.sources[key % RATE_SOURCES];
+    uint64_t owner = __atomic_load_n(&source->key, __ATOMIC_RELAXED);
+    uint64_t now = monotonic_ns();
+    if (owner != key && __atomic_load_n(&source->bucket.bytes_tat, __ATOMIC_RELAXED) <= now &&
+        __atomic_load_n(&source->bucket.msgs_tat, __ATOMIC_RELAXED) <= now)
+    {
+        __atomic_compare_exchange_n(&source->key, &owner, key, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    return &source->bucket;
+}
+
+// method to find the source bucket of a stream relay once, from the peer of its source socket
+struct token_bucket *relay_stream_source(struct relay *relay)
+{
+    if (!relay->source_resolved)
+    {
+        struct sockaddr_storage address;
+        socklen_t len = sizeof(address);
+        relay->source_resolved = 1;
+        if (getpeername(relay->src_fd, (struct sockaddr *)&address, &len) == 0)
+        {
+            relay->source_bucket = rate_source_bucket(&address);
+        }
+    }
+    return relay->source_bucket;
+}
+
+// method to pass data of a relay through the limits of its session, its source and its listener. returns 0 when
+// a drop limit is exceeded (nothing is charged then), otherwise the data is charged to every bucket and a delay
+// limit that ran out throttles the relay's reads until its bucket earned the excess back. a GRO datagram is
+// charged the messages it coalesced
+int rate_admit(struct relay *relay, struct token_bucket *source, size_t bytes, unsigned long messages)
+{
+    struct token_bucket *buckets[RATE_SCOPES] = {relay->session_bucket, source, &shared->rate.listeners[current_listener]};
+    struct rate_counters *counters = shared->rate.counters;
+    uint64_t now = monotonic_ns();
+    uint64_t wait = 0;
+    for (int scope = 0; scope < RATE_SCOPES; ++scope)
+    {
+        struct rate_limit *limit = &rate_limits[scope];
+        if (buckets[scope] != NULL && !limit->delay && (limit->bytes_per_s || limit->msgs_per_s) &&
+            rate_take(limit, buckets[scope], now, bytes, messages, 0) > 0)
+        {
+            __atomic_add_fetch(&counters[scope].dropped_bytes, bytes, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&counters[scope].dropped_messages, messages, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+    for (int scope = 0; scope < RATE_SCOPES; ++scope)
+    {
+        struct rate_limit *limit = &rate_limits[scope];
+        if (buckets[scope] == NULL || (limit->bytes_per_s == 0 && limit->msgs_per_s == 0))
+        {
+            continue;
+        }
+        uint64_t excess = rate_take(limit, buckets[scope], now, bytes, messages, 1);
+        if (limit->delay && excess > 0)
+        {
+            __atomic_add_fetch(&counters[scope].shaped_bytes, bytes, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&counters[scope].shaped_messages, messages, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&counters[scope].delay_us, excess / 1000, __ATOMIC_RELAXED);
+            wait = excess > wait ? excess : wait;
+        }
+    }
+    if (wait > 0 && now + wait > relay->throttled_until_ns)
+    {
+        relay->throttled_until_ns = now + wait;
+    }
+    return 1;
+}
+
+// method to check whether a relay waits for its delay limits, the wait in ms is merged into timeout_ms (-1 for none)
+int relay_throttled(struct relay *relay, int *timeout_ms)
+{
+    if (relay->throttled_until_ns == 0)
+    {
+        return 0;
+    }
+    uint64_t now = monotonic_ns();
+    if (now >= relay->throttled_until_ns)
+    {
+        relay->throttled_until_ns = 0;
+        return 0;
+    }
+    if (timeout_ms != NULL)
+    {
+        int ms = (relay->throttled_until_ns - now + 999999) / 1000000;
+        if (*timeout_ms == -1 || ms < *timeout_ms)
+        {
+            *timeout_ms = ms;
+        }
+    }
+    return 1;
+}
+
+// method to write the counters of the rate limits as text or JSON
+void write_rate_counters(FILE *out, int json)
+{
+    const char *names[] = {"shaped_bytes", "shaped_messages", "delay_us", "dropped_bytes", "dropped_messages"};
+    fprintf(out, json ? "\"rate\":{" : "");
+    for (int scope = 0; scope < RATE_SCOPES; ++scope)
+    {
+        struct rate_counters *counters = &shared->rate.counters[scope];
+        unsigned long values[] = {counters->shaped_bytes, counters->shaped_messages, counters->delay_us, counters->dropped_bytes, counters->dropped_messages};
+        if (json)
+        {
+            fprintf(out, "%s\"%s\":{", scope > 0 ? "," : "", rate_scope_names[scope]);
+        }
+        for (int i = 0; i < 5; ++i)
+        {
+            if (json)
+            {
+                fprintf(out, "%s\"%s\":%lu", i > 0 ? "," : "", names[i], values[i]);
+            }
+            else
+            {
+                fprintf(out, "mync_rate_%s{scope=\"%s\"} %lu\n", names[i], rate_scope_names[scope], values[i]);
+            }
+        }
+        fprintf(out, json ? "}" : "");
+    }
+    fprintf(out, json ? "}" : "");
+}
+
+// main method:
+// 1. parse input and set variables with the given process arguments
+// 2. set the timeouts of the -t, --idle and --session-timeout options
+// 3. call main process method
+int main(int argc, char *argv[])
+{
+    char *tcp_port = NULL;
+    char *tcp_client_host = NULL;
+    char *tcp_client_port = NULL;
+    char *udp_port = NULL;
+    char *udp_client_host = NULL;
+    char *udp_client_port = NULL;
+    char *program = NULL;
+    int tcpmuxs = 0;
+    struct unix_endpoints unix_endpoints = {NULL, NULL, NULL, NULL};
+
+    int mode = 0; // 1 for input, 2 for output, 3 for both, 4 for input from client and output to server
+
+    for (int i = 1; i < argc; ++i)
     {
         if (strcmp(argv[i], "-t") == 0)
         {
-            timeout = atoi(argv[++i]);
+            global_timeout_ms = parse_duration(argv[++i]);
+            if (global_timeout_ms == 0)
+            {
+                fprintf(stderr, "Error: invalid timeout %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(argv[i], "--idle=", 7) == 0)
+        {
+            session_idle_ms = parse_duration(argv[i] + 7);
+            if (session_idle_ms == 0)
+            {
+                fprintf(stderr, "Error: invalid --idle timeout %s\n", argv[i] + 7);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(argv[i], "--session-timeout=", 18) == 0)
+        {
+            session_total_ms = parse_duration(argv[i] + 18);
+            if (session_total_ms == 0)
+            {
+                fprintf(stderr, "Error: invalid --session-timeout %s\n", argv[i] + 18);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(argv[i], "--udp-batch=", 12) == 0)
+        {
+            udp_batch = atoi(argv[i] + 12);
+            if (udp_batch < 1 || udp_batch > UDP_BATCH_MAX)
+            {
+                fprintf(stderr, "Error: --udp-batch must be between 1 and %d\n", UDP_BATCH_MAX);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(argv[i], "--gso=", 6) == 0)
+        {
+            int size = atoi(argv[i] + 6);
+            if (size < 1 || size > UDP_MAX_PAYLOAD)
+            {
+                fprintf(stderr, "Error: invalid --gso segment size %s\n", argv[i] + 6);
+                exit(EXIT_FAILURE);
+            }
+            gso_size = size;
+        }
+        else if (strncmp(argv[i], "--mux=", 6) == 0)
+        {
+            mux_connections = atoi(argv[i] + 6);
+            if (mux_connections < 1 || mux_connections > MUX_CONNECTIONS_MAX)
+            {
+                fprintf(stderr, "Error: --mux must be between 1 and %d\n", MUX_CONNECTIONS_MAX);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "--demux") == 0)
+        {
+            demux = 1;
+        }
+        else if (strncmp(argv[i], "--rate=", 7) == 0)
+        {
+            if (parse_rate(argv[i] + 7) == -1)
+            {
+                fprintf(stderr, "Error: invalid rate limit %s, expected --rate=session|source|listener:bytes=N,msgs=N,burst=N,msg-burst=N,policy=drop|delay\n", argv[i] + 7);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(argv[i], "--backlog=", 10) == 0)
+        {
+            listen_backlog = atoi(argv[i] + 10);
+            if (listen_backlog < 1)
+            {
+                fprintf(stderr, "Error: invalid backlog %s\n", argv[i] + 10);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(argv[i], "--listeners=", 12) == 0)
+        {
+            listener_count = atoi(argv[i] + 12);
+            if (listener_count < 1 || listener_count > LISTENERS_MAX)
+            {
+                fprintf(stderr, "Error: --listeners must be between 1 and %d\n", LISTENERS_MAX);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "--steer=cpu") == 0)
+        {
+            steer_flows = 1;
+        }
+        else if (strncmp(argv[i], "--prefork=", 10) == 0)
+        {
+            prefork_workers = atoi(argv[i] + 10);
+        }
+        else if (strncmp(argv[i], "--prefork-max=", 14) == 0)
+        {
+            prefork_max = atoi(argv[i] + 14);
+        }
+        else if (strncmp(argv[i], "--recycle=", 10) == 0)
+        {
+            recycle_sessions = atoi(argv[i] + 10);
+        }
+        else if (strncmp(argv[i], "--session-mem=", 14) == 0)
+        {
+            session_mem_limit = parse_size(argv[i] + 14);
+            if (session_mem_limit < RING_MIN_SIZE)
+            {
+                fprintf(stderr, "Error: invalid --session-mem size %s\n", argv[i] + 14);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(argv[i], "--pool-mem=", 11) == 0)
+        {
+            pool_mem_limit = parse_size(argv[i] + 11);
+            if (pool_mem_limit < RING_MIN_SIZE)
+            {
+                fprintf(stderr, "Error: invalid --pool-mem size %s\n", argv[i] + 11);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "-m") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                metrics_address = argv[++i];
+            }
+            else
+            {
+                fprintf(stderr, "Error: -m requires a port or a unix socket path\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(argv[i], "--log=", 6) == 0)
+        {
+            if (mynclog_open(argv[i] + 6) == -1)
+            {
+                printErrorAndExit(argv[i] + 6);
+            }
+        }
+        else if (strncmp(argv[i], "--prewarm=", 10) == 0)
+        {
+            prewarm_count = atoi(argv[i] + 10);
+            if (prewarm_count < 1 || prewarm_count > PREWARM_MAX)
+            {
+                fprintf(stderr, "Error: --prewarm must be between 1 and %d\n", PREWARM_MAX);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(argv[i], "--engine=", 9) == 0)
+        {
+            if (strcmp(argv[i] + 9, "uring") == 0)
+            {
+                engine = ENGINE_URING;
+            }
+            else if (strcmp(argv[i] + 9, "epoll") == 0)
+            {
+                engine = ENGINE_EPOLL;
+            }
+            else
+            {
+                fprintf(stderr, "Error: unknown engine %s\n", argv[i] + 9);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "-i") == 0)
+        {
+            mode = 1;
+        }
+        else if (strcmp(argv[i], "-o") == 0)
+        {
+            if (mode == 1)
+            {
+                mode = 4;
+            }
+            else
+            {
+                mode = 2;
+            }
+        }
+        else if (strcmp(argv[i], "-b") == 0)
+        {
+            mode = 3;
+        }
+        else if (strcmp(argv[i], "-e") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                program = argv[++i];
+            }
+            else
+            {
+                fprintf(stderr, "Error: missing argument for -e\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(argv[i], "TCPMUXS", 7) == 0)
+        {
+            tcp_port = argv[i] + 7;
+            tcpmuxs = 1;
+        }
+        else if (strncmp(argv[i], "TCPS", 4) == 0)
+        {
+            tcp_port = argv[i] + 4;
+        }
+        else if (strncmp(argv[i], "TCPC", 4) == 0)
+        {
+            char *sep = strchr(argv[i] + 4, ',');
+            if (sep)
+            {
+                tcp_client_host = argv[i] + 4;
+                *sep = '\0';
+                tcp_client_port = sep + 1;
+            }
+            else
+            {
+                fprintf(stderr, "Error: invalid TCPC format\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        else if (strncmp(argv[i], "UDSSS", 5) == 0)
+        {
+            unix_endpoints.stream_server = argv[i] + 5;
+        }
+        else if (strncmp(argv[i], "UDSCS", 5) == 0)
+        {
+            unix_endpoints.stream_client = argv[i] + 5;
+        }
+        else if (strncmp(argv[i], "UDSSD", 5) == 0)
+        {
+            unix_endpoints.dgram_server = argv[i] + 5;
+        }
+        else if (strncmp(argv[i], "UDSCD", 5) == 0)
+        {
+            unix_endpoints.dgram_client = argv[i] + 5;
+        }
+        else if (strncmp(argv[i], "UDPS", 4) == 0)
+        {
+            udp_port = argv[i] + 4;
+        }
+        else if (strncmp(argv[i], "UDPC", 4) == 0)
+        {
+            LOG_DEBUG("UDPC");
+            char *sep = strchr(argv[i] + 4, ',');
+            if (sep)
+            {
+                udp_client_host = argv[i] + 4;
+                *sep = '\0';
+                udp_client_port = sep + 1;
+                LOG_DEBUG("UDPC: %s:%s", udp_client_host, udp_client_port);
+            }
+            else
+            {
+                fprintf(stderr, "Error: invalid UDPC format\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        else
+        {
+            fprintf(stderr, "Error: invalid argument %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (prefork_workers < 0 || prefork_workers > PREFORK_MAX || prefork_max < 0 || prefork_max > PREFORK_MAX || recycle_sessions < 0)
+    {
+        fprintf(stderr, "Error: prefork options must be between 0 and %d\n", PREFORK_MAX);
+        exit(EXIT_FAILURE);
+    }
+    if (prefork_workers > 0 && listener_count > 1)
+    {
+        fprintf(stderr, "Error: --prefork and --listeners cannot be combined\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((mux_connections > 0 || demux) && (program || tcp_port == NULL || tcp_client_host == NULL || (mux_connections > 0 && demux)))
+    {
+        fprintf(stderr, "Error: --mux=N and --demux need -i TCPS or TCPMUXS and -o TCPC without -e\n");
+        exit(EXIT_FAILURE);
+    }
+    if (prefork_max < prefork_workers)
+    {
+        prefork_max = prefork_workers * 4 < PREFORK_MAX ? prefork_workers * 4 : PREFORK_MAX;
+    }
+    // dropping part of a byte stream corrupts it, policy=drop is only allowed when every relay reads datagrams: a
+    // datagram input with a datagram output (or -b) and no program. the replies of a stream output, stdin and
+    // program pipes are streams, they can only be delayed
+    int dgram_sources = program == NULL && (udp_port != NULL || unix_endpoints.dgram_server != NULL) &&
+                        (mode == 3 || udp_client_host != NULL || unix_endpoints.dgram_client != NULL) &&
+                        tcp_client_host == NULL && unix_endpoints.stream_client == NULL;
+    for (int scope = 0; scope < RATE_SCOPES && !dgram_sources; ++scope)
+    {
+        if ((rate_limits[scope].bytes_per_s || rate_limits[scope].msgs_per_s) && !rate_limits[scope].delay)
+        {
+            fprintf(stderr, "Error: --rate policy=drop needs datagram sources only (-i UDPS or UDSSD with -o UDPC or UDSCD, or -b, without -e), streams can only use policy=delay\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    shared_state_init();
+    if (program)
+    {
+        plugin_load(program_arguments(program, NULL)[0]);
+    }
+
+    // the pool memory of a process is given back to the global limit when it exits or is terminated. a forked child
+    // starts without any, what it inherited is still held by its parent
+    atexit(pool_release_process);
+    pthread_atfork(NULL, NULL, pool_forget_process);
+    signal(SIGTERM, handle_terminate);
+
+    // SIGUSR1 prints the relay statistics. it is installed with SA_RESTART so that it does not break the waits of a
+    // session (waitpid, read): the event loops see it when epoll_wait returns EINTR (never restarted), the blocking
+    // datagram loops after their next datagram
+    struct sigaction report_action;
+    memset(&report_action, 0, sizeof(report_action));
+    report_action.sa_handler = handle_report;
+    report_action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &report_action, NULL);
+
+    process(
+        tcp_port ? atoi(tcp_port) : 0,
+        tcp_client_host,
+        tcp_client_port ? atoi(tcp_client_port) : 0,
+        udp_port ? atoi(udp_port) : 0,
+        udp_client_host,
+        udp_client_port ? atoi(udp_client_port) : 0,
+        program,
+        mode,
+        tcpmuxs,
+        &unix_endpoints);
+
+    return 0;
+}
+
+// method called when the -t timeout expires
+void global_timeout_expired(struct timer *timer)
+{
+    *(int *)timer->arg = 1;
+}
+
+// method for the parent to wait until the processing child ends or the -t timeout expires. it sleeps on a pidfd, a
+// signalfd (SIGUSR1 reports, SIGCHLD where pidfd_open is missing), the timerfd of a timer wheel and the metrics
+// endpoint (-m) with its clients, which are served without blocking
+void supervise(pid_t pid_process, int metrics_fd)
+{
+    struct timer_wheel wheel;
+    int expired = 0;
+    struct timer timeout = {.callback = global_timeout_expired, .arg = &expired};
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1)
+    {
+        printErrorAndExit("signalfd");
+    }
+    int pidfd = syscall(SYS_pidfd_open, pid_process, 0);
+
+    wheel_init(&wheel);
+    if (global_timeout_ms > 0)
+    {
+        timer_start(&wheel, &timeout, global_timeout_ms);
+    }
+    wheel_arm(&wheel);
+
+    struct metrics_client clients[METRICS_CLIENTS];
+    struct pollfd pfds[4 + METRICS_CLIENTS] = {{.fd = signal_fd, .events = POLLIN}, {.fd = wheel.timer_fd, .events = POLLIN}, {.fd = pidfd, .events = POLLIN}, {.fd = metrics_fd, .events = POLLIN}};
+    for (int i = 0; i < METRICS_CLIENTS; ++i)
+    {
+        clients[i].fd = -1;
+    }
+    while (!expired && waitpid(pid_process, NULL, WNOHANG) == 0)
+    {
+        if (report_requested)
+        {
+            // a SIGUSR1 that arrived before the signal was blocked
+            report_requested = 0;
+            resolver_report();
+        }
+        mynclog_drain();
+        int timeout = metrics_clients_expire(clients);
+        for (int i = 0; i < METRICS_CLIENTS; ++i)
+        {
+            pfds[4 + i].fd = clients[i].fd;
+            pfds[4 + i].events = clients[i].response != NULL ? POLLOUT : POLLIN;
+            pfds[4 + i].revents = 0;
+        }
+        if (poll(pfds, 4 + METRICS_CLIENTS, timeout) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printErrorAndExit("poll");
+        }
+        if (pfds[0].revents)
+        {
+            struct signalfd_siginfo info;
+            while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+            {
+                if (info.ssi_signo == SIGUSR1)
+                {
+                    resolver_report();
+                }
+            }
+        }
+        if (pfds[1].revents)
+        {
+            wheel_advance(&wheel);
+        }
+        for (int i = 0; i < METRICS_CLIENTS; ++i)
+        {
+            if (pfds[4 + i].revents && clients[i].fd != -1)
+            {
+                metrics_client_ready(&clients[i]);
+            }
+        }
+        if (pfds[3].revents)
+        {
+            metrics_accept(metrics_fd, clients);
+        }
+    }
+    if (expired)
+    {
+        LOG_INFO("timeout expired");
+    }
+
+    wheel_close(&wheel);
+    close(signal_fd);
+    for (int i = 0; i < METRICS_CLIENTS; ++i)
+    {
+        if (clients[i].fd != -1)
+        {
+            metrics_client_close(&clients[i]);
+        }
+    }
+    if (metrics_fd != -1)
+    {
+        close(metrics_fd);
+    }
+    if (pidfd != -1)
+    {
+        close(pidfd);
+    }
+}
+
+// method to
+// 1. setup network connectivity (input/output tcp/udp)
+// 2. for UDP input opttion, wait for a client to send some data so that the clients address can be captured
+// 3. if program was given (-e option), call the run_program method. if TCPMUXS option was given, keep on calling
+//    run_program in a child process for every new client that connects
+// 4. if no program was given, call the run_chat method
+// with --mux=N or --demux the child runs the multiplexer instead
+void process(
+    int tcp_port,
+    char *tcp_client_host,
+    int tcp_client_port,
+    int udp_port,
+    char *udp_client_host,
+    int udp_client_port,
+    char *program,
+    int mode,
+    int tcpmuxs,
+    struct unix_endpoints *unix_endpoints)
+{
+    // the metrics endpoint is opened first, so that a port or path another server uses ends mync before it starts
+    int metrics_fd = metrics_address != NULL ? open_metrics_endpoint(metrics_address) : -1;
+    // processing will commence with a child process, the parent process will wait for the child process or a timeout (if -t option was given)
+    pid_t pid_process = fork();
+    if (pid_process == -1)
+    {
+        printErrorAndExit("fork");
+    }
+    else if (pid_process == 0)
+    {
+        if (metrics_fd != -1)
+        {
+            close(metrics_fd);
+        }
+        if (mux_connections > 0 || demux)
+        {
+            run_mux(tcp_port, tcp_client_host, tcp_client_port);
+        }
+
+        struct sockaddr_storage server_addr, client_addr;
+        struct sockaddr_in address;
+        socklen_t addr_len;
+        int addrlen = sizeof(address);
+        char buffer[1024];
+        int n = 0;
+
+        int tcp_server_fd = 0;
+        int tcp_listener_fds[LISTENERS_MAX];
+        int tcp_server_sock = 0;
+        int tcp_client_sock = 0;
+        int udp_server_sock = 0;
+        int udp_client_sock = 0;
+
+        // the -o host names are looked up while the -i side waits for its client
+        struct dns_lookup lookups[2];
+        lookups[0].fd = lookups[1].fd = -1;
+        if (tcp_client_host != NULL)
+        {
+            dns_lookup_start(&lookups[0], tcp_client_host);
+        }
+        if (udp_client_host != NULL)
+        {
+            dns_lookup_start(&lookups[1], udp_client_host);
+        }
+        // -i option with TCPS
+        if (tcp_port > 0)
+        {
+            LOG_DEBUG("going to call bind_tcp_server");
+            // a TCPMUXS server with several listeners opens a SO_REUSEPORT group, its threads accept the clients
+            if (tcpmuxs && program && listener_count > 1)
+            {
+                open_reuseport_listeners(SOCK_STREAM, tcp_port, listener_count, tcp_listener_fds);
+                tcp_server_fd = tcp_listener_fds[0];
+            }
+            else
+            {
+                tcp_server_fd = bind_tcp_server(tcp_port);
+            }
+            if (tcpmuxs && program && prefork_workers == 0 && listener_count == 1)
+            {
+                // the TCPMUXS loop drains the accept queue on every wakeup, so the listener must not block
+                if (fcntl(tcp_server_fd, F_SETFL, fcntl(tcp_server_fd, F_GETFL) | O_NONBLOCK) == -1)
+                {
+                    printErrorAndExit("fcntl");
+                }
+                tcp_server_sock = next_client(tcp_server_fd);
+            }
+            // with a prefork pool or listener threads the clients are accepted later
+            else if (!(tcpmuxs && program && (prefork_workers > 0 || listener_count > 1)))
+            {
+                // the records of the setup are written out before the wait for the client
+                mynclog_drain();
+                wait_resolving(tcp_server_fd, lookups, 2);
+                if ((tcp_server_sock = accept4(tcp_server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen, SOCK_CLOEXEC)) < 0)
+                {
+                    perror("accept4");
+                    close(tcp_server_fd);
+                    exit(EXIT_FAILURE);
+                }
+                metrics_accepted();
+            }
+        }
+        // -i option with UDSSS
+        if (unix_endpoints->stream_server != NULL)
+        {
+            tcp_server_fd = bind_unix_server(unix_endpoints->stream_server, SOCK_STREAM);
+            mynclog_drain();
+            wait_resolving(tcp_server_fd, lookups, 2);
+            if ((tcp_server_sock = accept4(tcp_server_fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+            {
+                perror("accept4");
+                close(tcp_server_fd);
+                exit(EXIT_FAILURE);
+            }
+            metrics_accepted();
+        }
+        // -o option with TCPC
+        if (tcp_client_host != NULL && tcp_client_port > 0)
+        {
+            dns_lookup_wait(&lookups[0]);
+            tcp_client_sock = connet_tcp_client(tcp_client_host, tcp_client_port);
+        }
+        // -o option with UDSCS
+        if (unix_endpoints->stream_client != NULL)
+        {
+            tcp_client_sock = start_unix_client(unix_endpoints->stream_client, SOCK_STREAM, NULL);
+        }
+        // -i option with UDPS
+        if (udp_port > 0)
+        {
+            if (!program && listener_count > 1)
+            {
+                // the listener threads of the SO_REUSEPORT group learn the clients, there is no wait for a first client
+                open_reuseport_listeners(SOCK_DGRAM, udp_port, listener_count, udp_listener_fds);
+                udp_listener_count = listener_count;
+                udp_server_sock = udp_listener_fds[0];
+            }
+            else
+            {
+                udp_server_sock = start_udp_server(udp_port);
+            }
+            LOG_INFO("started server on %d, server_sock: %d", udp_port, udp_server_sock);
+        }
+        // -i option with UDSSD
+        if (unix_endpoints->dgram_server != NULL)
+        {
+            udp_server_sock = bind_unix_server(unix_endpoints->dgram_server, SOCK_DGRAM);
+        }
+        // -o option with UDPC
+        if (udp_client_host != NULL && udp_client_port > 0)
+        {
+            LOG_DEBUG("UDPC going to start");
+            dns_lookup_wait(&lookups[1]);
+            udp_client_sock = start_udp_client(udp_client_host, udp_client_port, &server_addr);
+        }
+        // -o option with UDSCD
+        if (unix_endpoints->dgram_client != NULL)
+        {
+            udp_client_sock = start_unix_client(unix_endpoints->dgram_client, SOCK_DGRAM, &server_addr);
+        }
+
+        // in case of -i UDPS, we wait for a UDP client to send something so that we can obtain the client address and subsequently
+        // transmit data to that client
+        memset(&client_addr, 0, sizeof(client_addr));
+        if (udp_server_sock > 0 && udp_listener_count == 0)
+        {
+            addr_len = sizeof(client_addr);
+            LOG_INFO("waiting for a client to connect and transmit some data");
+            mynclog_drain();
+            n = recvfrom(udp_server_sock, buffer, sizeof(buffer), 0, (struct sockaddr *)&client_addr, &addr_len);
+            if (n == -1)
+            {
+                printErrorAndExit("recvfrom");
+            }
+        }
+        if (program && tcpmuxs && listener_count > 1)
+        {
+            run_tcp_listeners(tcp_listener_fds, listener_count, program, mode, tcp_client_sock);
+        }
+        else if (program && tcpmuxs && prefork_workers > 0)
+        {
+            run_prefork(tcp_server_fd, program, mode, tcp_client_sock);
+        }
+        else if (program)
+        {
+            // a warm program talks to the session through a stream socket, datagram endpoints and plugins need
+            // their own setup for every session
+            if (prewarm_count > 0 && (plugin != NULL || udp_server_sock > 0 || udp_client_sock > 0))
+            {
+                fprintf(stderr, "--prewarm needs stream endpoints and an executed program, starting programs per session\n");
+                prewarm_count = 0;
+            }
+            prewarm_program = prewarm_count > 0 ? program : NULL;
+            do
+            {
+                struct warm_program warm = prewarm_take();
+                pid_t pidmux = fork();
+                if (pidmux == -1)
+                {
+                    printErrorAndExit("fork");
+                }
+                else if (pidmux == 0)
+                {
+                    close_pending_clients();
+                    if (prewarm_count > 0)
+                    {
+                        prewarm_close_others();
+                        LOG_DEBUG("handing the client to program %d", warm.pid);
+                        run_warm_program(&warm, tcp_server_sock, mode == 3 ? tcp_server_sock : tcp_client_sock > 0 ? tcp_client_sock : STDOUT_FILENO);
+                    }
+                    else
+                    {
+                        LOG_DEBUG("going to execute program");
+                        run_program(
+                            program,
+                            udp_server_sock,
+                            mode == 3 ? udp_server_sock : udp_client_sock,
+                            mode == 3 ? &client_addr : &server_addr,
+                            tcp_server_sock,
+                            mode == 3 ? tcp_server_sock : tcp_client_sock);
+                    }
+                    close(tcp_server_sock);
+                    LOG_DEBUG("done run_program, going to exit");
+                    return;
+                }
+                else
+                {
+                    LOG_DEBUG("created child process to run_program %d", pidmux);
+                    if (prewarm_count > 0)
+                    {
+                        close(warm.fd);
+                    }
+                    if (tcpmuxs)
+                    {
+                        close(tcp_server_sock);
+                        tcp_server_sock = 0;
+                        reap_sessions();
+                        LOG_DEBUG("waiting for another client");
+                        tcp_server_sock = next_client(tcp_server_fd);
+                        LOG_DEBUG("another client connected");
+                    }
+                    else
+                    {
+                        mynclog_drain();
+                        while (waitpid(pidmux, NULL, 0) == -1 && errno == EINTR)
+                        {
+                        }
+                        LOG_DEBUG("child process to run_program: return from waitpid");
+                    }
+                }
+
+            } while (tcpmuxs);
+        }
+        else
+        {
+            // run_chat_mixed(udp_server_sock, udp_client_sock, &server_addr, tcp_server_sock, tcp_client_sock);
+            run_chat(
+                udp_server_sock,
+                mode == 3 ? udp_server_sock : udp_client_sock,
+                mode == 3 ? &client_addr : &server_addr,
+                &client_addr,
+                tcp_server_sock,
+                mode == 3 ? tcp_server_sock : tcp_client_sock,
+                buffer,
+                sizeof(buffer),
+                n);
+        }
+    }
+    else
+    {
+        LOG_DEBUG("created child process to process %d", pid_process);
+        supervise(pid_process, metrics_fd);
+
+        LOG_DEBUG("in parent process, return from wait");
+        // the parent ends with the rest of the process group and does not reach its exit handlers
+        mynclog_drain();
+        kill(0, SIGTERM);
+    }
+}
+
+// method to take a chunk of the given size class from the buffer pool.
+// returns NULL when the session limit or the global limit (shared by all sessions) would be exceeded
+char *pool_alloc(int size_class)
+{
+    size_t size = (size_t)RING_MIN_SIZE << (2 * size_class);
+    if (buffer_pool.session_used + size > session_mem_limit)
+    {
+        return NULL;
+    }
+    if (__atomic_add_fetch(&shared->pool_used, size, __ATOMIC_RELAXED) > pool_mem_limit)
+    {
+        __atomic_sub_fetch(&shared->pool_used, size, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    char *chunk;
+    if (buffer_pool.free_count[size_class] > 0)
+    {
+        chunk = buffer_pool.free_chunks[size_class][--buffer_pool.free_count[size_class]];
+    }
+    else if ((chunk = malloc(size)) == NULL)
+    {
+        __atomic_sub_fetch(&shared->pool_used, size, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    buffer_pool.session_used += size;
+    __atomic_add_fetch(&process_pool_used, size, __ATOMIC_RELAXED);
+    return chunk;
+}
+
+// method to give a chunk back to the buffer pool, a few chunks of every size class are kept for reuse
+void pool_release(char *chunk, int size_class)
+{
+    size_t size = (size_t)RING_MIN_SIZE << (2 * size_class);
+    buffer_pool.session_used -= size;
+    // a chunk inherited from the parent or released after the process gave its memory back is not counted again
+    size_t used = __atomic_load_n(&process_pool_used, __ATOMIC_RELAXED);
+    while (used >= size && !__atomic_compare_exchange_n(&process_pool_used, &used, used - size, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+    if (used >= size)
+    {
+        __atomic_sub_fetch(&shared->pool_used, size, __ATOMIC_RELAXED);
+    }
+    if (buffer_pool.free_count[size_class] < POOL_CACHE_PER_CLASS)
+    {
+        buffer_pool.free_chunks[size_class][buffer_pool.free_count[size_class]++] = chunk;
+    }
+    else
+    {
+        free(chunk);
+    }
+}
+
+// method to give the pool memory this process still holds back to the global limit, at exit and on SIGTERM.
+// only atomic operations are used, it runs in a signal handler
+void pool_release_process()
+{
+    size_t used = __atomic_exchange_n(&process_pool_used, 0, __ATOMIC_RELAXED);
+    if (used > 0 && shared != NULL)
+    {
+        __atomic_sub_fetch(&shared->pool_used, used, __ATOMIC_RELAXED);
+    }
+}
+
+// method run in a forked child: the pool memory the child inherited stays counted for its parent
+void pool_forget_process()
+{
+    process_pool_used = 0;
+}
+
+// method to get the size class a ring buffer grows to for min_free more bytes, RING_CLASSES when it cannot grow
+int ring_grow_class(struct ring_buf *ring, size_t min_free)
+{
+    int size_class = ring->data == NULL ? 0 : ring->size_class + 1;
+    while (size_class < RING_CLASSES - 1 && ((size_t)RING_MIN_SIZE << (2 * size_class)) < ring->len + min_free)
+    {
+        size_class++;
+    }
+    return ring->fixed ? RING_CLASSES : size_class;
+}
+
+// method to check whether a ring buffer could grow by min_free bytes within the memory limits, without taking memory
+int ring_can_grow(struct ring_buf *ring, size_t min_free)
+{
+    int size_class = ring_grow_class(ring, min_free);
+    if (size_class >= RING_CLASSES)
+    {
+        return 0;
+    }
+    size_t size = (size_t)RING_MIN_SIZE << (2 * size_class);
+    return buffer_pool.session_used + size <= session_mem_limit && __atomic_load_n(&shared->pool_used, __ATOMIC_RELAXED) + size <= pool_mem_limit;
+}
+
+// method to grow a ring buffer to the next size class that has room for min_free more bytes
+// (or give a ring without memory its first chunk). the content is kept in order.
+// returns 0 on success or -1 when the ring cannot grow
+int ring_grow(struct ring_buf *ring, size_t min_free)
+{
+    int size_class = ring_grow_class(ring, min_free);
+    if (size_class >= RING_CLASSES)
+    {
+        return -1;
+    }
+    char *data = pool_alloc(size_class);
+    if (data == NULL)
+    {
+        return -1;
+    }
+    if (ring->data != NULL)
+    {
+        size_t first = ring->size - ring->head < ring->len ? ring->size - ring->head : ring->len;
+        memcpy(data, ring->data + ring->head, first);
+        memcpy(data + first, ring->data, ring->len - first);
+        pool_release(ring->data, ring->size_class);
+    }
+    ring->data = data;
+    ring->size = (size_t)RING_MIN_SIZE << (2 * size_class);
+    ring->size_class = size_class;
+    ring->head = 0;
+    return 0;
+}
+
+// method to give the chunk of a ring buffer back to the pool
+void ring_release(struct ring_buf *ring)
+{
+    if (ring->data != NULL)
+    {
+        pool_release(ring->data, ring->size_class);
+    }
+    memset(ring, 0, sizeof(*ring));
+}
+
+// method to describe the free space of a ring buffer with up to two io vectors, returns the number of vectors
+int ring_space(struct ring_buf *ring, struct iovec iov[2])
+{
+    if (ring->len == ring->size)
+    {
+        return 0;
+    }
+    size_t tail = (ring->head + ring->len) % ring->size;
+    size_t end = tail >= ring->head ? ring->size : ring->head;
+    iov[0].iov_base = ring->data + tail;
+    iov[0].iov_len = end - tail;
+    if (tail >= ring->head && ring->head > 0)
+    {
+        iov[1].iov_base = ring->data;
+        iov[1].iov_len = ring->head;
+        return 2;
+    }
+    return 1;
+}
+
+// method to describe the content of a ring buffer with up to two io vectors, returns the number of vectors
+int ring_content(struct ring_buf *ring, struct iovec iov[2])
+{
+    if (ring->len == 0)
+    {
+        return 0;
+    }
+    size_t first = ring->size - ring->head < ring->len ? ring->size - ring->head : ring->len;
+    iov[0].iov_base = ring->data + ring->head;
+    iov[0].iov_len = first;
+    if (first < ring->len)
+    {
+        iov[1].iov_base = ring->data;
+        iov[1].iov_len = ring->len - first;
+        return 2;
+    }
+    return 1;
+}
+
+// method to remove written data from the front of a ring buffer.
+// an emptied ring gives its chunk back so that an idle relay holds no memory and the next burst starts small
+void ring_consume(struct ring_buf *ring, size_t n)
+{
+    ring->head = (ring->head + n) % ring->size;
+    ring->len -= n;
+    if (ring->len == 0)
+    {
+        ring->head = 0;
+        if (!ring->fixed)
+        {
+            ring_release(ring);
+        }
+    }
+}
+
+// method to append data to a ring buffer, growing it when needed. returns -1 when the data does not fit
+int ring_append(struct ring_buf *ring, const char *data, size_t len)
+{
+    struct iovec iov[2];
+    while (ring->size - ring->len < len)
+    {
+        if (ring_grow(ring, len) == -1)
+        {
+            return -1;
+        }
+    }
+    int count = ring_space(ring, iov);
+    for (int i = 0; i < count && len > 0; ++i)
+    {
+        size_t part = len < iov[i].iov_len ? len : iov[i].iov_len;
+        memcpy(iov[i].iov_base, data, part);
+        data += part;
+        len -= part;
+        ring->len += part;
+    }
+    return 0;
+}
+
+// method to put a socket into non-blocking mode, other file descriptors (the standard input and output that are
+// shared with the terminal) are left untouched and are only accessed when epoll reports them ready.
+// unix datagram sockets stay blocking for the loops that wait on them, the relays read and send them with MSG_DONTWAIT
+void set_nonblocking(int fd)
+{
+    struct stat st;
+    int domain = 0, type = 0;
+    socklen_t len = sizeof(int);
+    if (fstat(fd, &st) != 0 || !S_ISSOCK(st.st_mode))
+    {
+        return;
+    }
+    getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len);
+    len = sizeof(int);
+    getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len);
+    if (domain != AF_UNIX || type != SOCK_DGRAM)
+    {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+}
+
+// method to initialize one direction of a chat: data read from src_fd is written to dest_fd.
+// a datagram source stores the address of the last sender in src_peer (if given) so that the other
+// direction can answer that sender, a datagram destination is written with sendto to dest_addr.
+// data that the destination does not accept right away waits in a ring buffer taken from the buffer pool
+void init_relay(struct relay *relay, int src_fd, int src_dgram, struct sockaddr_storage *src_peer, int dest_fd, int dest_dgram, struct sockaddr_storage *dest_addr)
+{
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    memset(relay, 0, sizeof(*relay));
+    relay->src_fd = src_fd;
+    relay->src_dgram = src_dgram;
+    relay->src_peer = src_peer;
+    relay->dest_fd = dest_fd;
+    relay->dest_dgram = dest_dgram;
+    relay->dest_addr = dest_addr;
+    // epoll reports an unconnected unix datagram socket writable even when the peer's queue is full
+    relay->dest_unwatched = dest_dgram && dest_addr->ss_family == AF_UNIX && getpeername(dest_fd, (struct sockaddr *)&peer, &peer_len) == -1;
+    if (src_dgram)
+    {
+        relay->batch = udp_batch_create(udp_batch, !dest_dgram && enable_udp_gro(src_fd));
+    }
+}
+
+// method to get the destination address of a relay, an address shared with listener threads is copied under its lock
+struct sockaddr_storage *relay_dest(struct relay *relay, struct sockaddr_storage *copy)
+{
+    if (relay->peer_lock == NULL)
+    {
+        return relay->dest_addr;
+    }
+    pthread_mutex_lock(relay->peer_lock);
+    *copy = *relay->dest_addr;
+    pthread_mutex_unlock(relay->peer_lock);
+    return copy;
+}
+
+// method to remember the sender of the last datagram of a relay's source as the peer to answer.
+// only len bytes of the address are valid, the rest is cleared so that sockaddr_length works on the copy
+void relay_learn_peer(struct relay *relay, struct sockaddr_storage *peer, socklen_t len)
+{
+    if (relay->src_peer == NULL)
+    {
+        return;
+    }
+    if (len > sizeof(*peer))
+    {
+        len = sizeof(*peer);
+    }
+    if (relay->peer_lock != NULL)
+    {
+        pthread_mutex_lock(relay->peer_lock);
+    }
+    memcpy(relay->src_peer, peer, len);
+    memset((char *)relay->src_peer + len, 0, sizeof(*peer) - len);
+    if (relay->peer_lock != NULL)
+    {
+        pthread_mutex_unlock(relay->peer_lock);
+    }
+}
+
+// method to release the buffers of a relay
+void free_relay(struct relay *relay)
+{
+    udp_batch_free(relay->batch);
+    ring_release(&relay->ring);
+}
+
+// method to check whether a relay may read from its source: there must be room in its ring buffer, or memory to
+// grow it (taken by relay_read). a relay that cannot read applies backpressure to its source.
+// a datagram source reads once the destination took its last batch
+int relay_can_read(struct relay *relay)
+{
+    if (relay->done || relay->ending || relay_throttled(relay, NULL))
+    {
+        return 0;
+    }
+    if (relay->batch != NULL)
+    {
+        // the datagrams of the last batch that the destination did not take yet must be gone first
+        return relay->batch->pending == relay->batch->pending_count;
+    }
+    if (relay->dest_dgram && relay->ring.data == NULL)
+    {
+        // a datagram destination is flushed right away, its ring needs room for a whole read at once
+        return ring_can_grow(&relay->ring, stream_to_dgram_size());
+    }
+    return relay->ring.len < relay->ring.size || ring_can_grow(&relay->ring, 1);
+}
+
+// method to check whether a relay holds data for its destination: in its ring buffer or, for a datagram source with
+// a stream destination, in the slots of its last batch
+int relay_has_pending(struct relay *relay)
+{
+    return relay->ring.len > 0 || (relay->batch != NULL && relay->batch->pending < relay->batch->pending_count);
+}
+
+// method to pass the datagrams of a batch on to the destination. a datagram destination gets them with sendmmsg, a
+// stream destination without older buffered data with one writev, and the rest is moved into the ring as far as it
+// has room. what is not taken stays in the batch, and the relay reads no more until it is gone.
+// returns -1 when the destination failed
+int relay_take_batch(struct relay *relay)
+{
+    struct udp_batch *batch = relay->batch;
+    if (relay->dest_dgram)
+    {
+        struct sockaddr_storage dest_copy;
+        struct sockaddr_storage *dest_addr = relay_dest(relay, &dest_copy);
+        batch->pending = udp_batch_sendto(batch, batch->pending, batch->pending_count, relay->dest_fd, dest_addr, MSG_DONTWAIT);
+        return 0;
+    }
+    if (relay->ring.len == 0 && batch->pending < batch->pending_count)
+    {
+        ssize_t n = writev(relay->dest_fd, batch->iovs + batch->pending, batch->pending_count - batch->pending);
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            return -1;
+        }
+        while (n > 0)
+        {
+            struct iovec *iov = &batch->iovs[batch->pending];
+            size_t part = (size_t)n < iov->iov_len ? (size_t)n : iov->iov_len;
+            iov->iov_base = (char *)iov->iov_base + part;
+            iov->iov_len -= part;
+            n -= part;
+            if (iov->iov_len == 0)
+            {
+                batch->pending++;
+            }
+        }
+    }
+    while (batch->pending < batch->pending_count)
+    {
+        struct iovec *iov = &batch->iovs[batch->pending];
+        if (ring_append(&relay->ring, iov->iov_base, iov->iov_len) == -1)
+        {
+            // the ring cannot grow any more, it is filled up and the rest of the datagram waits
+            size_t part = relay->ring.size - relay->ring.len;
+            ring_append(&relay->ring, iov->iov_base, part);
+            iov->iov_base = (char *)iov->iov_base + part;
+            iov->iov_len -= part;
+            break;
+        }
+        batch->pending++;
+    }
+    return 0;
+}
+
+// method to write as much buffered data of a relay as the destination accepts without blocking.
+// returns 0 when everything was written, 1 when data is still pending and -1 when the destination failed
+int relay_flush(struct relay *relay)
+{
+    if (relay->batch != NULL && relay_take_batch(relay) == -1)
+    {
+        return -1;
+    }
+    while (relay->ring.len > 0)
+    {
+        struct iovec iov[2];
+        int count = ring_content(&relay->ring, iov);
+        ssize_t n;
+        if (relay->dest_dgram)
+        {
+            // datagrams are sent from contiguous data, a ring that is always flushed right away starts at offset 0
+            struct sockaddr_storage dest_copy;
+            struct sockaddr_storage *dest_addr = relay_dest(relay, &dest_copy);
+            size_t len = iov[0].iov_len;
+            if (!relay->src_dgram && len > stream_to_dgram_size())
+            {
+                len = stream_to_dgram_size();
+            }
+            n = relay->src_dgram ? sendto(relay->dest_fd, iov[0].iov_base, len, MSG_DONTWAIT, (struct sockaddr *)dest_addr, sockaddr_length(dest_addr))
+                                 : sendto_segmented(relay->dest_fd, iov[0].iov_base, len, dest_addr, MSG_DONTWAIT);
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && dest_addr->ss_family != AF_UNIX)
+            {
+                // a datagram that does not fit into the socket buffer is dropped, just like the network would.
+                // a unix datagram socket has flow control, the datagram waits until the peer's queue has room
+                n = len;
+            }
+        }
+        else
+        {
+            n = writev(relay->dest_fd, iov, count);
+        }
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 1;
+            }
+            return -1;
+        }
+        ring_consume(&relay->ring, n);
+        // the datagrams still waiting in the batch follow the data of the ring
+        if (relay->batch != NULL && !relay->dest_dgram && relay_take_batch(relay) == -1)
+        {
+            return -1;
+        }
+    }
+    return relay_has_pending(relay);
+}
+
+// method to hand data that was read before the event loop (the first datagram of a client) to a relay's destination.
+// whatever cannot be written right away is buffered. without memory for the buffer the data is written out waiting
+// for the destination, which holds up nothing else before the loop runs
+int relay_deliver(struct relay *relay, const char *data, size_t len)
+{
+    metrics_count(relay, len, 1, 0);
+    if (relay->ring.len > 0 || ring_append(&relay->ring, data, len) == 0)
+    {
+        return relay_flush(relay);
+    }
+    struct pollfd pfd = {.fd = relay->dest_fd, .events = POLLOUT};
+    while (len > 0)
+    {
+        struct sockaddr_storage dest_copy;
+        struct sockaddr_storage *dest_addr = relay->dest_dgram ? relay_dest(relay, &dest_copy) : NULL;
+        ssize_t n = relay->dest_dgram ? sendto(relay->dest_fd, data, len, 0, (struct sockaddr *)dest_addr, sockaddr_length(dest_addr))
+                                      : write(relay->dest_fd, data, len);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1)
+        {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// method to read once from a relay's source and deliver the data.
+// returns 0 on success or when nothing was available, -1 when the source reached end of file or failed
+int relay_read(struct relay *relay)
+{
+    ssize_t n;
+    if (relay->batch != NULL)
+    {
+        int count = udp_batch_recv(relay->batch, relay->src_fd, MSG_DONTWAIT);
+        int received = count;
+        unsigned long dropped = relay->batch->dropped;
+        size_t bytes = 0;
+        if (count == -1)
+        {
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+        }
+        for (int i = 0; i < count; ++i)
+        {
+            bytes += relay->batch->iovs[i].iov_len;
+        }
+        // replies go to the sender of the last datagram that was kept, a source over its drop limit does not get them
+        int last = count - 1;
+        if (rate_limited)
+        {
+            // datagrams over a drop limit are taken out of the batch, the others keep their order
+            int kept = 0;
+            for (int i = 0; i < count; ++i)
+            {
+                struct token_bucket *source = rate_limits[RATE_SOURCE].bytes_per_s || rate_limits[RATE_SOURCE].msgs_per_s ? rate_source_bucket(&relay->batch->addrs[i]) : NULL;
+                if (!rate_admit(relay, source, relay->batch->iovs[i].iov_len, relay->batch->segments[i]))
+                {
+                    relay->batch->dropped++;
+                    continue;
+                }
+                relay->batch->iovs[kept] = relay->batch->iovs[i];
+                relay->batch->msgs[kept].msg_len = relay->batch->msgs[i].msg_len;
+                relay->batch->segments[kept] = relay->batch->segments[i];
+                kept++;
+                last = i;
+            }
+            count = kept;
+            if (count == 0)
+            {
+                metrics_count(relay, bytes, received, relay->batch->dropped - dropped);
+                return 0;
+            }
+        }
+        relay_learn_peer(relay, &relay->batch->addrs[last], relay->batch->msgs[last].msg_hdr.msg_namelen);
+        // the destination takes the batch through relay_flush. datagrams a unix datagram peer has no room for and a
+        // GRO batch of several 64 KiB datagrams that the ring cannot hold stay in the batch slots until they were sent
+        relay->batch->pending = 0;
+        relay->batch->pending_count = count;
+        int result = relay_flush(relay);
+        metrics_count(relay, bytes, received, relay->batch->dropped - dropped);
+        return result == -1 ? -1 : 0;
+    }
+
+    // the ring takes its memory when there is data to read, relay_can_read only checked that it may
+    if (relay->dest_dgram && relay->ring.data == NULL && ring_grow(&relay->ring, stream_to_dgram_size()) == -1)
+    {
+        return 0;
+    }
+    if (relay->ring.len == relay->ring.size && ring_grow(&relay->ring, 1) == -1)
+    {
+        return 0;
+    }
+    struct iovec iov[2];
+    int count = ring_space(&relay->ring, iov);
+    if (count == 0)
+    {
+        return 0;
+    }
+    if (relay->dest_dgram)
+    {
+        // stream data for a datagram destination is read in datagram sized pieces
+        count = 1;
+        if (iov[0].iov_len > stream_to_dgram_size())
+        {
+            iov[0].iov_len = stream_to_dgram_size();
+        }
+    }
+    n = readv(relay->src_fd, iov, count);
+    if (n == 0)
+    {
+        return -1;
+    }
+    if (n == -1)
+    {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    if (rate_limited)
+    {
+        // main refuses drop limits when any relay reads a stream, so the data is always admitted and only delayed
+        rate_admit(relay, relay_stream_source(relay), n, 1);
+    }
+    relay->ring.len += n;
+    metrics_count(relay, n, 1, 0);
+    return relay_flush(relay) == -1 ? -1 : 0;
+}
+
+// method to find (or add) the watch entry of a file descriptor
+struct fd_watch *get_watch(struct fd_watch *watches, int *watch_count, int fd)
+{
+    for (int i = 0; i < *watch_count; ++i)
+    {
+        if (watches[i].fd == fd)
+        {
+            return &watches[i];
+        }
+    }
+    memset(&watches[*watch_count], 0, sizeof(watches[0]));
+    watches[*watch_count].fd = fd;
+    return &watches[(*watch_count)++];
+}
+
+// method to end a relay whose source ended. it reads no more, the data it still buffers is written as the
+// destination accepts it (the event loop calls this again after the last byte) and then the relay is done.
+// when the end of a stream socket is reached the peer went away and the whole chat ends,
+// when the standard input ends the write side of a stream destination is shut down so the peer sees end of file
+void finish_relay(struct relay *relay, int *stop)
+{
+    struct stat st;
+    relay->ending = 1;
+    if (relay_has_pending(relay))
+    {
+        return;
+    }
+    relay->done = 1;
+    if (fstat(relay->src_fd, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        *stop = 1;
+    }
+    else if (!relay->dest_dgram)
+    {
+        shutdown(relay->dest_fd, SHUT_WR);
+    }
+}
+
+// method called when a session went without data for --idle, or seemingly so: an event since the timer was armed
+// arms it again for the rest of the idle time
+void session_idle_expired(struct timer *timer)
+{
+    struct session_timers *timers = timer->arg;
+    uint64_t idle = monotonic_ms() - timers->last_activity;
+    if (idle < session_idle_ms)
+    {
+        timer_start(&timers->wheel, timer, session_idle_ms - idle);
+        return;
+    }
+    LOG_INFO("session idle for %llu ms, closing it", (unsigned long long)idle);
+    timers->expired = 1;
+}
+
+// method called when a session reached --session-timeout
+void session_total_expired(struct timer *timer)
+{
+    struct session_timers *timers = timer->arg;
+    LOG_INFO("session reached its timeout of %llu ms, closing it", (unsigned long long)session_total_ms);
+    timers->expired = 1;
+}
+
+// method to arm the timeouts of a session on a timer wheel of its own
+struct session_timers *session_timers_start()
+{
+    struct session_timers *timers = calloc(1, sizeof(struct session_timers));
+    if (timers == NULL)
+    {
+        printErrorAndExit("calloc");
+    }
+    wheel_init(&timers->wheel);
+    timers->last_activity = monotonic_ms();
+    timers->idle.callback = session_idle_expired;
+    timers->idle.arg = timers;
+    timers->total.callback = session_total_expired;
+    timers->total.arg = timers;
+    if (session_idle_ms > 0)
+    {
+        timer_start(&timers->wheel, &timers->idle, session_idle_ms);
+    }
+    if (session_total_ms > 0)
+    {
+        timer_start(&timers->wheel, &timers->total, session_total_ms);
+    }
+    wheel_arm(&timers->wheel);
+    return timers;
+}
+
+// method to wind down a chat whose program ended, called on every wakeup from then on: the relays reading from
+// sockets are dropped, the relays reading the program's output pipe go on while it holds data and end once it is
+// empty (a process the program left behind may keep the pipe open) and the data was written
+void drain_program_output(struct relay *relays, int relay_count, int *stop)
+{
+    struct stat st;
+    int pending;
+    for (int i = 0; i < relay_count; ++i)
+    {
+        struct relay *relay = &relays[i];
+        if (relay->done || relay->ending)
+        {
+            continue;
+        }
+        if (fstat(relay->src_fd, &st) == -1 || !S_ISFIFO(st.st_mode))
+        {
+            relay->done = 1;
+        }
+        else if (ioctl(relay->src_fd, FIONREAD, &pending) == -1 || pending == 0)
+        {
+            finish_relay(relay, stop);
+        }
+    }
+}
+
+// method to serve all relays of a chat from a single process with epoll until the chat ends.
+// a relay whose ring buffer is full and cannot grow stops reading its source until the destination took some data.
+// file descriptors that epoll cannot watch (regular files) are treated as always ready
+void run_relays(struct relay *relays, int relay_count)
+{
+    struct fd_watch watches[2 * MAX_RELAYS];
+    struct epoll_event events[2 * MAX_RELAYS + 2];
+    struct session_timers *timers = NULL;
+    struct token_bucket session_bucket = {0, 0};
+    int watch_count = 0;
+    int stop = 0;
+    int program_ended = 0;
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+    {
+        printErrorAndExit("epoll_create1");
+    }
+
+    for (int i = 0; i < relay_count; ++i)
+    {
+        metrics_attach(&relays[i], i);
+        relays[i].session_bucket = &session_bucket;
+        set_nonblocking(relays[i].src_fd);
+        set_nonblocking(relays[i].dest_fd);
+        get_watch(watches, &watch_count, relays[i].src_fd)->reader = &relays[i];
+        get_watch(watches, &watch_count, relays[i].dest_fd)->writer = &relays[i];
+    }
+    if (program_pidfd != -1)
+    {
+        struct epoll_event ev = {.events = EPOLLIN, .data.u32 = PROGRAM_EVENT};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, program_pidfd, &ev) == -1)
+        {
+            printErrorAndExit("epoll_ctl");
+        }
+    }
+    if (session_idle_ms > 0 || session_total_ms > 0)
+    {
+        timers = session_timers_start();
+        struct epoll_event ev = {.events = EPOLLIN, .data.u32 = TIMER_EVENT};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timers->wheel.timer_fd, &ev) == -1)
+        {
+            printErrorAndExit("epoll_ctl");
+        }
+    }
+
+    while (!stop)
+    {
+        int active = 0;
+        int poll_now = 0;
+        int memory_wait = 0;
+        int throttle_ms = -1;
+
+        if (program_ended)
+        {
+            drain_program_output(relays, relay_count, &stop);
+        }
+
+        // update the interest of every file descriptor: read when its relay has room in its ring buffer and does
+        // not wait for a delay rate limit, write when its relay has buffered data
+        for (int i = 0; i < watch_count; ++i)
+        {
+            struct fd_watch *watch = &watches[i];
+            uint32_t wanted = 0;
+            if (watch->reader && relay_throttled(watch->reader, &throttle_ms))
+            {
+                // the epoll timeout wakes the relay when its bucket earned the excess back
+            }
+            else if (watch->reader && relay_can_read(watch->reader))
+            {
+                wanted |= EPOLLIN;
+            }
+            else if (watch->reader && !watch->reader->done && !relay_has_pending(watch->reader))
+            {
+                // an empty ring that cannot get memory waits for other sessions to release some
+                memory_wait = 1;
+            }
+            if (watch->writer && !watch->writer->done && relay_has_pending(watch->writer) && watch->writer->dest_unwatched)
+            {
+                // the send is tried again after a short wait, epoll cannot tell when the peer has room
+                memory_wait = 1;
+            }
+            else if (watch->writer && !watch->writer->done && relay_has_pending(watch->writer))
+            {
+                wanted |= EPOLLOUT;
+            }
+            if (watch->always_ready)
+            {
+                poll_now |= wanted != 0;
+                continue;
+            }
+            if (wanted == watch->events && watch->registered)
+            {
+                continue;
+            }
+            struct epoll_event ev = {.events = wanted, .data.u32 = i};
+            int op = !watch->registered ? EPOLL_CTL_ADD : (wanted ? EPOLL_CTL_MOD : EPOLL_CTL_DEL);
+            if (op == EPOLL_CTL_ADD && wanted == 0)
+            {
+                continue;
+            }
+            if (epoll_ctl(epoll_fd, op, watch->fd, &ev) == -1)
+            {
+                if (errno != EPERM)
+                {
+                    printErrorAndExit("epoll_ctl");
+                }
+                watch->always_ready = 1;
+                poll_now = 1;
+                continue;
+            }
+            watch->registered = op != EPOLL_CTL_DEL;
+            watch->events = wanted;
+        }
+        for (int i = 0; i < relay_count; ++i)
+        {
+            active += !relays[i].done;
+        }
+        if (active == 0)
+        {
+            break;
+        }
+
+        // the log records of this wakeup are written out before the relays sleep again
+        mynclog_drain();
+        int timeout = poll_now ? 0 : (memory_wait ? MEMORY_RETRY_MS : -1);
+        if (throttle_ms != -1 && (timeout == -1 || throttle_ms < timeout))
+        {
+            timeout = throttle_ms;
+        }
+        int n = epoll_wait(epoll_fd, events, 2 * MAX_RELAYS + 2, timeout);
+        if (report_requested)
+        {
+            report_requested = 0;
+            for (int i = 0; i < relay_count; ++i)
+            {
+                udp_batch_report(relays[i].batch, "chat");
+            }
+            offload_report();
+        }
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printErrorAndExit("epoll_wait");
+        }
+
+        for (int e = 0; e < n; ++e)
+        {
+            if (events[e].data.u32 == PROGRAM_EVENT)
+            {
+                // the pidfd stays readable, it is watched no more
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, program_pidfd, NULL);
+                program_ended = 1;
+            }
+            else if (events[e].data.u32 == TIMER_EVENT)
+            {
+                wheel_advance(&timers->wheel);
+                stop |= timers->expired;
+            }
+            else if (timers != NULL && session_idle_ms > 0)
+            {
+                // the idle timer is not moved for every event, it checks the time of the last event when it expires
+                timers->last_activity = monotonic_ms();
+            }
+        }
+        for (int i = 0; i < watch_count && !stop; ++i)
+        {
+            struct fd_watch *watch = &watches[i];
+            uint32_t ready = watch->always_ready ? (EPOLLIN | EPOLLOUT) : 0;
+            for (int e = 0; e < n; ++e)
+            {
+                if (events[e].data.u32 == (uint32_t)i)
+                {
+                    ready |= events[e].events;
+                }
+            }
+            if ((ready & (EPOLLOUT | EPOLLERR) || (watch->writer && watch->writer->dest_unwatched)) && watch->writer && !watch->writer->done && relay_has_pending(watch->writer))
+            {
+                if (relay_flush(watch->writer) == -1)
+                {
+                    watch->writer->done = 1;
+                    stop = 1;
+                }
+                else if (watch->writer->ending && !relay_has_pending(watch->writer))
+                {
+                    finish_relay(watch->writer, &stop);
+                }
+            }
+            if ((ready & (EPOLLIN | EPOLLHUP | EPOLLERR)) && watch->reader && relay_can_read(watch->reader))
+            {
+                // relay latency: from the wakeup of a source until its data was handed to the destination
+                uint64_t start = metrics_address != NULL ? monotonic_us() : 0;
+                if (relay_read(watch->reader) == -1)
+                {
+                    finish_relay(watch->reader, &stop);
+                }
+                else if (metrics_address != NULL)
+                {
+                    histogram_add(&shared->metrics.relay_latency, monotonic_us() - start);
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < relay_count; ++i)
+    {
+        udp_batch_report(relays[i].batch, "chat");
+    }
+    offload_report();
+    close(epoll_fd);
+    if (timers != NULL)
+    {
+        wheel_close(&timers->wheel);
+        free(timers);
+    }
+}
+
+// io_uring state of one relay: the message headers used for datagram sockets and the operation in flight
+struct uring_relay
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_storage peer;
+    struct sockaddr_storage dest;
+    int src_index;
+    int dest_index;
+};
+
+// method to release an io_uring instance
+void uring_close(struct uring *ring)
+{
+    if (ring->sqes != MAP_FAILED && ring->sqes != NULL)
+    {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_ptr != MAP_FAILED && ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr)
+    {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+    if (ring->sq_ptr != MAP_FAILED && ring->sq_ptr != NULL)
+    {
+        munmap(ring->sq_ptr, ring->sq_len);
+    }
+    if (ring->fd >= 0)
+    {
+        close(ring->fd);
+    }
+}
+
+// method to create an io_uring instance and map its submission and completion rings.
+// returns 0 on success or -1 when the kernel does not support io_uring
+int uring_open(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+    {
+        return -1;
+    }
+
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_len > ring->sq_len)
+        {
+            ring->sq_len = ring->cq_len;
+        }
+        ring->cq_len = ring->sq_len;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+    {
+        uring_close(ring);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ptr = ring->sq_ptr;
+    }
+    else
+    {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+        {
+            uring_close(ring);
+            return -1;
+        }
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        uring_close(ring);
+        return -1;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + params.cq_off.cqes);
+    return 0;
+}
+
+// method to check with IORING_REGISTER_PROBE that the kernel supports the operations the relays need: reads and
+// writes of the registered buffers for streams, recvmsg and sendmsg for datagram sockets. a kernel without the probe
+// (before 5.6) counts as not supporting them, an unsupported operation would only fail when it completes
+int uring_supports_relays(struct uring *ring, struct relay *relays, int relay_count)
+{
+    size_t probe_len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_len);
+    int supported = probe != NULL && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (int i = 0; i < relay_count && supported; ++i)
+    {
+        int ops[2] = {relays[i].src_dgram ? IORING_OP_RECVMSG : IORING_OP_READ_FIXED, relays[i].dest_dgram ? IORING_OP_SENDMSG : IORING_OP_WRITE_FIXED};
+        for (int o = 0; o < 2; ++o)
+        {
+            if (ops[o] > probe->last_op || !(probe->ops[ops[o]].flags & IO_URING_OP_SUPPORTED))
+            {
+                LOG_INFO("io_uring does not support operation %d, using epoll", ops[o]);
+                supported = 0;
+            }
+        }
+    }
+    free(probe);
+    return supported;
+}
+
+// method to get a free submission queue entry, the entry is only handed to the kernel by uring_submit
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    unsigned tail = *ring->sq_tail + ring->queued;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->queued++;
+    return sqe;
+}
+
+// method to submit all queued entries in one system call and wait for at least one completion
+int uring_submit_and_wait(struct uring *ring)
+{
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->queued, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->queued;
+    ring->queued = 0;
+    while (syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+    {
+        if (errno != EINTR)
+        {
+            return -1;
+        }
+        to_submit = 0;
+    }
+    return 0;
+}
+
+// method to queue the next operation of a relay: a write of its pending data or a read of new data
+void uring_queue_relay(struct uring *ring, struct relay *relay, struct uring_relay *state, int index)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->flags = IOSQE_FIXED_FILE;
+    if (relay->ring.len > 0)
+    {
+        sqe->fd = state->dest_index;
+        sqe->user_data = (uint64_t)index << 1 | 1;
+        if (relay->dest_dgram)
+        {
+            state->iov.iov_base = relay->ring.data + relay->ring.head;
+            state->iov.iov_len = relay->ring.len;
+            memset(&state->msg, 0, sizeof(state->msg));
+            state->msg.msg_name = relay_dest(relay, &state->dest);
+            state->msg.msg_namelen = sockaddr_length(state->msg.msg_name);
+            state->msg.msg_iov = &state->iov;
+            state->msg.msg_iovlen = 1;
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->addr = (uint64_t)(uintptr_t)&state->msg;
+            sqe->len = 1;
+        }
+        else
+        {
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->addr = (uint64_t)(uintptr_t)(relay->ring.data + relay->ring.head);
+            sqe->len = relay->ring.len;
+            sqe->off = (uint64_t)-1;
+            sqe->buf_index = index;
+        }
+    }
+    else
+    {
+        sqe->fd = state->src_index;
+        sqe->user_data = (uint64_t)index << 1;
+        if (relay->src_dgram)
+        {
+            state->iov.iov_base = relay->ring.data;
+            state->iov.iov_len = relay->ring.size;
+            memset(&state->msg, 0, sizeof(state->msg));
+            memset(&state->peer, 0, sizeof(state->peer));
+            state->msg.msg_name = &state->peer;
+            state->msg.msg_namelen = sizeof(state->peer);
+            state->msg.msg_iov = &state->iov;
+            state->msg.msg_iovlen = 1;
+            sqe->opcode = IORING_OP_RECVMSG;
+            sqe->addr = (uint64_t)(uintptr_t)&state->msg;
+            sqe->len = 1;
+        }
+        else
+        {
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->addr = (uint64_t)(uintptr_t)relay->ring.data;
+            sqe->len = relay->dest_dgram ? stream_to_dgram_size() : relay->ring.size;
+            sqe->off = (uint64_t)-1;
+            sqe->buf_index = index;
+        }
+    }
+}
+
+// method to serve all relays of a chat with io_uring: every relay always has exactly one read or write in flight,
+// relay ring buffers get the largest size class up front and are registered with the kernel (a read is only
+// queued when the ring is empty, so data is always contiguous), the file descriptors are registered as fixed files, so that
+// each loop iteration submits all new operations and reaps all completions with a single system call.
+// returns -1 when io_uring or one of the operations is not available (nothing was done, the caller should use
+// another engine)
+int run_relays_uring(struct relay *relays, int relay_count)
+{
+    struct uring ring;
+    struct uring_relay states[MAX_RELAYS];
+    struct iovec buffers[MAX_RELAYS];
+    int files[2 * MAX_RELAYS];
+    int file_count = 0;
+    int stop = 0;
+
+    if (uring_open(&ring, 4 * MAX_RELAYS) == -1)
+    {
+        return -1;
+    }
+    if (!uring_supports_relays(&ring, relays, relay_count))
+    {
+        uring_close(&ring);
+        return -1;
+    }
+
+    for (int i = 0; i < relay_count; ++i)
+    {
+        int fds[2] = {relays[i].src_fd, relays[i].dest_fd};
+        int *indexes[2] = {&states[i].src_index, &states[i].dest_index};
+        for (int f = 0; f < 2; ++f)
+        {
+            int index = 0;
+            while (index < file_count && files[index] != fds[f])
+            {
+                index++;
+            }
+            if (index == file_count)
+            {
+                files[file_count++] = fds[f];
+            }
+            *indexes[f] = index;
+        }
+        while (relays[i].ring.size < (size_t)RING_MIN_SIZE << (2 * (RING_CLASSES - 1)))
+        {
+            if (ring_grow(&relays[i].ring, 1) == -1)
+            {
+                uring_close(&ring);
+                return -1;
+            }
+        }
+        relays[i].ring.fixed = 1;
+        buffers[i].iov_base = relays[i].ring.data;
+        buffers[i].iov_len = relays[i].ring.size;
+    }
+
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, buffers, relay_count) < 0 ||
+        syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, files, file_count) < 0)
+    {
+        uring_close(&ring);
+        return -1;
+    }
+
+    for (int i = 0; i < relay_count; ++i)
+    {
+        metrics_attach(&relays[i], i);
+        uring_queue_relay(&ring, &relays[i], &states[i], i);
+    }
+
+    while (!stop)
+    {
+        int active = 0;
+        for (int i = 0; i < relay_count; ++i)
+        {
+            active += !relays[i].done;
+        }
+        if (active == 0)
+        {
+            break;
+        }
+        if (uring_submit_and_wait(&ring) == -1)
+        {
+            printErrorAndExit("io_uring_enter");
+        }
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail && !stop; ++head)
+        {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            int index = cqe->user_data >> 1;
+            int is_write = cqe->user_data & 1;
+            int res = cqe->res;
+            struct relay *relay = &relays[index];
+
+            if (res == -EINTR || res == -EAGAIN)
+            {
+                // nothing happened, queue the same operation again
+            }
+            else if (is_write)
+            {
+                if (res < 0 && !relay->dest_dgram)
+                {
+                    relay->done = 1;
+                    stop = 1;
+                    continue;
+                }
+                // a datagram that could not be sent is dropped
+                res = (res < 0 || relay->dest_dgram) ? (int)relay->ring.len : res;
+                ring_consume(&relay->ring, res);
+            }
+            else
+            {
+                if (res < 0 || (res == 0 && !relay->src_dgram))
+                {
+                    finish_relay(relay, &stop);
+                    continue;
+                }
+                if (relay->src_dgram)
+                {
+                    relay_learn_peer(relay, &states[index].peer, states[index].msg.msg_namelen);
+                }
+                relay->ring.head = 0;
+                relay->ring.len = res;
+                metrics_count(relay, res, 1, 0);
+            }
+            uring_queue_relay(&ring, relay, &states[index], index);
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    uring_close(&ring);
+    return 0;
+}
+
+// eventfds of a prefork pool: the master posts a token to retire one idle worker (a semaphore), the workers tell the
+// master when they start or end a session
+int prefork_retire_fd = -1;
+int prefork_notify_fd = -1;
+
+// method run by a prefork worker: compete with the other workers for the clients of the shared (non-blocking)
+// listener and run the program for every accepted client. the worker exits after recycle_sessions sessions (if set),
+// or when it takes a retire token while it is idle at the top of the loop, so a session is never cut short
+void prefork_worker(int slot, int tcp_server_fd, const char *program, int mode, int tcp_client_sock)
+{
+    struct sockaddr_in address;
+    socklen_t addrlen = sizeof(address);
+    struct prefork_slot *state = &shared->prefork_slots[slot];
+    struct pollfd pfds[2] = {{.fd = tcp_server_fd, .events = POLLIN}, {.fd = prefork_retire_fd, .events = POLLIN}};
+    eventfd_t token;
+
+    while (recycle_sessions == 0 || state->sessions < (unsigned long)recycle_sessions)
+    {
+        mynclog_drain();
+        if (poll(pfds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printErrorAndExit("poll");
+        }
+        // another idle worker may take the token first, the read of the semaphore then fails
+        if ((pfds[1].revents & POLLIN) && eventfd_read(prefork_retire_fd, &token) == 0)
+        {
+            LOG_DEBUG("prefork worker %d retired", slot);
+            break;
+        }
+        if (!(pfds[0].revents & POLLIN))
+        {
+            continue;
+        }
+        int tcp_server_sock = accept4(tcp_server_fd, (struct sockaddr *)&address, &addrlen, SOCK_CLOEXEC);
+        if (tcp_server_sock < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            printErrorAndExit("accept");
+        }
+        metrics_accepted();
+        __atomic_store_n(&state->busy, 1, __ATOMIC_RELAXED);
+        eventfd_write(prefork_notify_fd, 1);
+        run_program(program, 0, 0, NULL, tcp_server_sock, mode == 3 ? tcp_server_sock : tcp_client_sock);
+        close(tcp_server_sock);
+        __atomic_store_n(&state->busy, 0, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&state->sessions, 1, __ATOMIC_RELAXED);
+        eventfd_write(prefork_notify_fd, 1);
+    }
+    exit(0);
+}
+
+// method to start a prefork worker in a free slot, returns the slot or -1 when all slots are taken
+int prefork_spawn(int tcp_server_fd, const char *program, int mode, int tcp_client_sock)
+{
+    for (int slot = 0; slot < PREFORK_MAX; ++slot)
+    {
+        struct prefork_slot *state = &shared->prefork_slots[slot];
+        if (state->pid != 0)
+        {
+            continue;
+        }
+        state->busy = 0;
+        state->sessions = 0;
+        pid_t pid = fork();
+        if (pid == -1)
+        {
+            perror("fork");
+            return -1;
+        }
+        if (pid == 0)
+        {
+            // the master takes SIGCHLD through a signalfd, the worker and its programs get it as usual
+            sigset_t mask;
+            sigemptyset(&mask);
+            sigaddset(&mask, SIGCHLD);
+            sigprocmask(SIG_UNBLOCK, &mask, NULL);
+            prefork_worker(slot, tcp_server_fd, program, mode, tcp_client_sock);
+        }
+        state->pid = pid;
+        return slot;
+    }
+    return -1;
+}
+
+// method to get the number of connections waiting in the accept queue of a listening socket
+int accept_queue_depth(int listen_fd)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(listen_fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1)
+    {
+        return 0;
+    }
+    // for a listening socket tcpi_unacked holds the current length of the accept queue
+    return info.tcpi_unacked;
+}
+
+// method to make room for need more bytes at the end of the output buffer of a mux connection: the content is moved
+// to the front and the buffer grows when control frames need more than the room kept for data frames
+int mux_reserve(struct mux_conn *conn, size_t need)
+{
+    if (conn->out_start + conn->out_len + need <= conn->out_size)
+    {
+        return 0;
+    }
+    memmove(conn->out, conn->out + conn->out_start, conn->out_len);
+    conn->out_start = 0;
+    while (conn->out_len + need > conn->out_size)
+    {
+        char *out = realloc(conn->out, conn->out_size * 2);
+        if (out == NULL)
+        {
+            return -1;
+        }
+        conn->out = out;
+        conn->out_size *= 2;
+    }
+    return 0;
+}
+
+// method to write a frame header: type, a reserved byte, the payload length and the stream id (network byte order)
+void mux_header(char *header, int type, uint32_t id, size_t len)
+{
+    header[0] = type;
+    header[1] = 0;
+    header[2] = len >> 8;
+    header[3] = len;
+    id = htonl(id);
+    memcpy(header + 4, &id, 4);
+}
+
+// method to queue a control frame (or a data frame from a buffer) on a mux connection, returns 0 or -1 without memory
+int mux_frame(struct mux_conn *conn, int type, uint32_t id, const void *payload, size_t len)
+{
+    if (mux_reserve(conn, MUX_HEADER + len) == -1)
+    {
+        return -1;
+    }
+    char *frame = conn->out + conn->out_start + conn->out_len;
+    mux_header(frame, type, id, len);
+    memcpy(frame + MUX_HEADER, payload, len);
+    conn->out_len += MUX_HEADER + len;
+    mux_stats.frames_sent++;
+    return 0;
+}
+
+// method to set the epoll interest of a file descriptor of the multiplexer, a descriptor without interest is taken
+// out of the epoll set so that a peer that hung up does not wake the loop
+void mux_watch(struct mux_state *mux, int fd, uint64_t tag, uint32_t *events, int *registered, uint32_t wanted)
+{
+    if (wanted == *events && (*registered || wanted == 0))
+    {
+        return;
+    }
+    struct epoll_event ev = {.events = wanted, .data.u64 = tag};
+    int op = !*registered ? EPOLL_CTL_ADD : (wanted ? EPOLL_CTL_MOD : EPOLL_CTL_DEL);
+    if (wanted == 0 && !*registered)
+    {
+        *events = 0;
+        return;
+    }
+    if (epoll_ctl(mux->epoll_fd, op, fd, &ev) == -1)
+    {
+        printErrorAndExit("epoll_ctl");
+    }
+    *registered = op != EPOLL_CTL_DEL;
+    *events = wanted;
+}
+
+// method to set the interest of a stream: a connect in progress waits for writability, an open stream is read when
+// it has credit and is not queued for sending already, and written while it buffers data from the connection
+void mux_stream_interest(struct mux_state *mux, struct mux_stream *stream)
+{
+    uint32_t wanted = 0;
+    if (stream->connecting)
+    {
+        wanted = EPOLLOUT;
+    }
+    else
+    {
+        if (!stream->queued && !stream->local_eof && stream->credit > 0)
+        {
+            wanted |= EPOLLIN;
+        }
+        if (stream->ring.len > 0)
+        {
+            wanted |= EPOLLOUT;
+        }
+    }
+    // the id in the tag tells an event of a released stream from one of a new stream in the same slot
+    mux_watch(mux, stream->fd, (uint64_t)stream->id << 32 | (stream - mux->streams), &stream->events, &stream->registered, wanted);
+}
+
+// method to set the interest of a mux connection: a connect in progress waits for writability, an open connection is
+// always read (the windows of its streams bound what arrives) and written while frames are pending
+void mux_conn_interest(struct mux_state *mux, struct mux_conn *conn)
+{
+    uint32_t wanted = conn->connecting ? EPOLLOUT : EPOLLIN | (conn->out_len > 0 ? EPOLLOUT : 0);
+    mux_watch(mux, conn->fd, MUX_STREAMS + (conn - mux->conns), &conn->events, &conn->registered, wanted);
+}
+
+// method to get the bucket of a stream id, the ids of different connections may be equal on a demux side
+int *mux_bucket(struct mux_state *mux, struct mux_conn *conn, uint32_t id)
+{
+    return &mux->buckets[(id * 2654435761u + (conn - mux->conns)) & (MUX_STREAMS - 1)];
+}
+
+// method to find the stream of a connection by its id: the chain of the id's bucket is searched
+struct mux_stream *mux_find(struct mux_state *mux, struct mux_conn *conn, uint32_t id)
+{
+    for (int slot = *mux_bucket(mux, conn, id); slot != -1; slot = mux->streams[slot].chain)
+    {
+        if (mux->streams[slot].id == id && mux->streams[slot].conn == conn)
+        {
+            return &mux->streams[slot];
+        }
+    }
+    return NULL;
+}
+
+// method to take a slot from the free list for a new stream of a connection and add it to the chain of its id,
+// returns NULL when all MUX_STREAMS slots are in use
+struct mux_stream *mux_add(struct mux_state *mux, struct mux_conn *conn, uint32_t id, int fd)
+{
+    int slot = mux->free_slots;
+    if (slot == -1)
+    {
+        return NULL;
+    }
+    struct mux_stream *stream = &mux->streams[slot];
+    int *bucket = mux_bucket(mux, conn, id);
+    mux->free_slots = stream->chain;
+    memset(stream, 0, sizeof(*stream));
+    stream->id = id;
+    stream->fd = fd;
+    stream->conn = conn;
+    stream->credit = MUX_WINDOW;
+    stream->chain = *bucket;
+    *bucket = slot;
+    conn->streams++;
+    mux_stats.streams_opened++;
+    return stream;
+}
+
+// method to take a released stream out of the chain of its id and put its slot on the free list
+void mux_remove(struct mux_state *mux, struct mux_stream *stream)
+{
+    int slot = stream - mux->streams;
+    int *link = mux_bucket(mux, stream->conn, stream->id);
+    while (*link != slot)
+    {
+        link = &mux->streams[*link].chain;
+    }
+    *link = stream->chain;
+    stream->chain = mux->free_slots;
+    mux->free_slots = slot;
+}
+
+// method to add a stream to the end of the send queue of its connection
+void mux_enqueue(struct mux_stream *stream)
+{
+    struct mux_conn *conn = stream->conn;
+    stream->queued = 1;
+    stream->next = NULL;
+    stream->prev = conn->queue_tail;
+    if (conn->queue_tail != NULL)
+    {
+        conn->queue_tail->next = stream;
+    }
+    else
+    {
+        conn->queue_head = stream;
+    }
+    conn->queue_tail = stream;
+}
+
+// method to take a stream out of the send queue of its connection
+void mux_dequeue(struct mux_stream *stream)
+{
+    struct mux_conn *conn = stream->conn;
+    if (!stream->queued)
+    {
+        return;
+    }
+    if (stream->prev != NULL)
+    {
+        stream->prev->next = stream->next;
+    }
+    else
+    {
+        conn->queue_head = stream->next;
+    }
+    if (stream->next != NULL)
+    {
+        stream->next->prev = stream->prev;
+    }
+    else
+    {
+        conn->queue_tail = stream->prev;
+    }
+    stream->queued = 0;
+}
+
+// method to release a stream: its socket is closed and the slot is free for a new id. with reset the peer is told to
+// drop its side of the stream
+void mux_stream_free(struct mux_state *mux, struct mux_stream *stream, int reset)
+{
+    if (reset)
+    {
+        mux_stats.streams_reset++;
+        if (stream->conn->fd != -1)
+        {
+            mux_frame(stream->conn, MUX_RESET, stream->id, NULL, 0);
+        }
+    }
+    mux_dequeue(stream);
+    if (stream->registered)
+    {
+        epoll_ctl(mux->epoll_fd, EPOLL_CTL_DEL, stream->fd, NULL);
+    }
+    close(stream->fd);
+    ring_release(&stream->ring);
+    mux_remove(mux, stream);
+    stream->conn->streams--;
+    stream->id = 0;
+    stream->conn = NULL;
+}
+
+// method to release a stream when both directions ended: its own side sent CLOSE and the CLOSE of the peer was
+// passed on to the socket after the buffered data
+void mux_stream_check(struct mux_state *mux, struct mux_stream *stream)
+{
+    if (stream->local_eof && stream->write_shut)
+    {
+        mux_stream_free(mux, stream, 0);
+    }
+    else
+    {
+        mux_stream_interest(mux, stream);
+    }
+}
+
+// method to write the data a stream received from its connection to its socket. written data is granted back to
+// the peer with a WINDOW frame once half a window was consumed, the CLOSE of the peer shuts the socket for writing
+// after the last byte. a socket that failed resets the stream
+void mux_stream_flush(struct mux_state *mux, struct mux_stream *stream)
+{
+    struct iovec iov[2];
+    int count = ring_content(&stream->ring, iov);
+    if (count > 0)
+    {
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = count};
+        ssize_t n = sendmsg(stream->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            mux_stream_free(mux, stream, 1);
+            return;
+        }
+        if (n > 0)
+        {
+            ring_consume(&stream->ring, n);
+            stream->consumed += n;
+        }
+    }
+    if (stream->consumed >= MUX_WINDOW / 2)
+    {
+        uint32_t credit = htonl(stream->consumed);
+        mux_frame(stream->conn, MUX_WINDOW_UPDATE, stream->id, &credit, sizeof(credit));
+        stream->consumed = 0;
+    }
+    if (stream->ring.len == 0 && stream->remote_eof && !stream->write_shut)
+    {
+        shutdown(stream->fd, SHUT_WR);
+        stream->write_shut = 1;
+    }
+    mux_stream_check(mux, stream);
+}
+
+// method to end a mux connection that failed: its streams are closed, a mux side connects again for the next client
+void mux_conn_fail(struct mux_state *mux, struct mux_conn *conn)
+{
+    LOG_WARN("mux connection %d failed, closing %d streams", (int)(conn - mux->conns), conn->streams);
+    int fd = conn->fd;
+    conn->fd = -1;
+    for (int i = 0; i < MUX_STREAMS && conn->streams > 0; ++i)
+    {
+        if (mux->streams[i].id != 0 && mux->streams[i].conn == conn)
+        {
+            mux_stream_free(mux, &mux->streams[i], 1);
+        }
+    }
+    if (conn->registered)
+    {
+        epoll_ctl(mux->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    }
+    close(fd);
+    conn->connecting = 0;
+    conn->registered = 0;
+    conn->events = 0;
+    conn->out_start = 0;
+    conn->out_len = 0;
+    conn->in_len = 0;
+    conn->queue_head = conn->queue_tail = NULL;
+}
+
+// method to write the pending frames of a mux connection without blocking, returns -1 when the connection failed.
+// the frames of a connection that is still connecting wait for the connect to complete
+int mux_conn_flush(struct mux_state *mux, struct mux_conn *conn)
+{
+    while (conn->out_len > 0 && !conn->connecting)
+    {
+        ssize_t n = send(conn->fd, conn->out + conn->out_start, conn->out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        if (n == -1)
+        {
+            mux_conn_fail(mux, conn);
+            return -1;
+        }
+        conn->out_start += n;
+        conn->out_len -= n;
+        mux_stats.bytes_sent += n;
+    }
+    if (conn->out_len == 0)
+    {
+        conn->out_start = 0;
+    }
+    mux_conn_interest(mux, conn);
+    return 0;
+}
+
+// method to fill the output buffer of a mux connection with data frames: the queued streams take turns, each reads
+// at most one frame (limited by its credit) straight into the buffer and goes to the end of the queue when it may
+// send more, so a busy stream cannot hold back the others. a stream that has nothing to read waits for epoll again
+void mux_pump(struct mux_state *mux, struct mux_conn *conn)
+{
+    while (conn->fd != -1 && conn->queue_head != NULL && conn->out_len < MUX_OUT_DATA)
+    {
+        struct mux_stream *stream = conn->queue_head;
+        mux_dequeue(stream);
+        size_t room = stream->credit < MUX_FRAME_MAX ? stream->credit : MUX_FRAME_MAX;
+        if (mux_reserve(conn, MUX_HEADER + room) == -1)
+        {
+            mux_stream_free(mux, stream, 1);
+            continue;
+        }
+        char *frame = conn->out + conn->out_start + conn->out_len;
+        ssize_t n = recv(stream->fd, frame + MUX_HEADER, room, MSG_DONTWAIT);
+        if (n > 0)
+        {
+            mux_header(frame, MUX_DATA, stream->id, n);
+            conn->out_len += MUX_HEADER + n;
+            stream->credit -= n;
+            mux_stats.frames_sent++;
+            if ((size_t)n == room && stream->credit > 0)
+            {
+                mux_enqueue(stream);
+            }
+            mux_stream_interest(mux, stream);
+        }
+        else if (n == 0)
+        {
+            mux_frame(conn, MUX_CLOSE, stream->id, NULL, 0);
+            stream->local_eof = 1;
+            mux_stream_check(mux, stream);
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            mux_stream_interest(mux, stream);
+        }
+        else
+        {
+            mux_stream_free(mux, stream, 1);
+        }
+    }
+}
+
+// method to open the socket of a stream the peer opened (demux side): a non-blocking connect to the -o target
+void mux_open_target(struct mux_state *mux, struct mux_conn *conn, uint32_t id)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct mux_stream *stream = fd == -1 ? NULL : mux_add(mux, conn, id, fd);
+    if (stream == NULL)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        mux_stats.streams_reset++;
+        mux_frame(conn, MUX_RESET, id, NULL, 0);
+        return;
+    }
+    if (connect(fd, (struct sockaddr *)&mux->target, sizeof(mux->target)) == -1 && errno != EINPROGRESS)
+    {
+        mux_stream_free(mux, stream, 1);
+        return;
+    }
+    stream->connecting = 1;
+    mux_stream_interest(mux, stream);
+}
+
+// method to handle one frame received on a mux connection, returns -1 for a frame that breaks the protocol
+int mux_handle_frame(struct mux_state *mux, struct mux_conn *conn, int type, uint32_t id, const char *payload, size_t len)
+{
+    mux_stats.frames_received++;
+    if (type == MUX_OPEN)
+    {
+        if (!mux->demux || mux_find(mux, conn, id) != NULL)
+        {
+            return -1;
+        }
+        mux_open_target(mux, conn, id);
+        return 0;
+    }
+    struct mux_stream *stream = mux_find(mux, conn, id);
+    if (stream == NULL)
+    {
+        // a late frame of a stream that was released, data is refused so the peer releases its side too
+        if (type == MUX_DATA)
+        {
+            mux_frame(conn, MUX_RESET, id, NULL, 0);
+        }
+        return 0;
+    }
+    switch (type)
+    {
+    case MUX_DATA:
+        // the peer may not send more than the window it was granted, so the ring never holds more than MUX_WINDOW
+        if (stream->remote_eof || stream->ring.len + len > MUX_WINDOW || ring_append(&stream->ring, payload, len) == -1)
+        {
+            mux_stream_free(mux, stream, 1);
+            return 0;
+        }
+        if (!stream->connecting)
+        {
+            mux_stream_flush(mux, stream);
+        }
+        else
+        {
+            mux_stream_interest(mux, stream);
+        }
+        return 0;
+    case MUX_WINDOW_UPDATE:
+        if (len != sizeof(uint32_t))
+        {
+            return -1;
+        }
+        uint32_t credit;
+        memcpy(&credit, payload, sizeof(credit));
+        stream->credit += ntohl(credit);
+        mux_stream_interest(mux, stream);
+        return 0;
+    case MUX_CLOSE:
+        stream->remote_eof = 1;
+        if (!stream->connecting)
+        {
+            mux_stream_flush(mux, stream);
+        }
+        return 0;
+    case MUX_RESET:
+        mux_stream_free(mux, stream, 0);
+        return 0;
+    }
+    return -1;
+}
+
+// method to read from a mux connection and handle every complete frame, a partial frame stays in the input buffer
+void mux_conn_read(struct mux_state *mux, struct mux_conn *conn)
+{
+    ssize_t n = recv(conn->fd, conn->in + conn->in_len, MUX_IN_SIZE - conn->in_len, MSG_DONTWAIT);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return;
+    }
+    if (n <= 0)
+    {
+        mux_conn_fail(mux, conn);
+        return;
+    }
+    mux_stats.bytes_received += n;
+    conn->in_len += n;
+    size_t pos = 0;
+    while (conn->fd != -1 && conn->in_len - pos >= MUX_HEADER)
+    {
+        unsigned char *header = (unsigned char *)conn->in + pos;
+        size_t len = (header[2] << 8) | header[3];
+        uint32_t id;
+        memcpy(&id, header + 4, 4);
+        if (len > MUX_FRAME_MAX)
+        {
+            mux_conn_fail(mux, conn);
+            return;
+        }
+        if (conn->in_len - pos < MUX_HEADER + len)
+        {
+            break;
+        }
+        if (mux_handle_frame(mux, conn, header[0], ntohl(id), conn->in + pos + MUX_HEADER, len) == -1)
+        {
+            LOG_WARN("mux connection %d sent an invalid frame of type %d", (int)(conn - mux->conns), header[0]);
+            mux_conn_fail(mux, conn);
+            return;
+        }
+        pos += MUX_HEADER + len;
+    }
+    memmove(conn->in, conn->in + pos, conn->in_len - pos);
+    conn->in_len -= pos;
+}
+
+// method to handle an event of a stream socket
+void mux_stream_event(struct mux_state *mux, struct mux_stream *stream, uint32_t events)
+{
+    if (stream->connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+    {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(stream->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0)
+        {
+            LOG_DEBUG("mux stream %u: connecting to the target failed", stream->id);
+            mux_stream_free(mux, stream, 1);
+            return;
+        }
+        stream->connecting = 0;
+        mux_stream_flush(mux, stream);
+        return;
+    }
+    if (stream->connecting)
+    {
+        return;
+    }
+    if ((events & EPOLLIN) && !stream->queued && !stream->local_eof && stream->credit > 0)
+    {
+        mux_enqueue(stream);
+        mux_stream_interest(mux, stream);
+    }
+    if ((events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) && stream->ring.len > 0)
+    {
+        mux_stream_flush(mux, stream);
+    }
+}
+
+// method to open the mux connection to the -o target that was lost or not opened yet: a non-blocking connect to the
+// address resolved at startup, streams may be added and queue their frames until it completes. returns -1 when it
+// fails at once
+int mux_connect(struct mux_state *mux, struct mux_conn *conn)
+{
+    int opt = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    if (connect(fd, (struct sockaddr *)&mux->target, sizeof(mux->target)) == -1 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+    conn->fd = fd;
+    conn->connecting = 1;
+    mux_conn_interest(mux, conn);
+    return 0;
+}
+
+// method to finish the connect of a mux connection once it is writable, a connect that failed closes its streams
+void mux_conn_connected(struct mux_state *mux, struct mux_conn *conn)
+{
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0)
+    {
+        mux_conn_fail(mux, conn);
+        return;
+    }
+    conn->connecting = 0;
+    LOG_DEBUG("mux connection %d connected", (int)(conn - mux->conns));
+    mux_conn_interest(mux, conn);
+}
+
+// method to accept the clients waiting on the listener. a mux side opens a stream for every client on the connection
+// that carries the fewest streams, a demux side takes every client as a mux connection
+void mux_accept(struct mux_state *mux)
+{
+    int opt = 1;
+    int fd;
+    while ((fd = accept4(mux->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+    {
+        metrics_accepted();
+        struct mux_conn *conn = NULL;
+        for (int i = 0; i < mux->conn_count; ++i)
+        {
+            struct mux_conn *candidate = &mux->conns[i];
+            if (mux->demux && candidate->fd == -1)
+            {
+                conn = candidate;
+                break;
+            }
+            if (!mux->demux && (candidate->fd != -1 || mux_connect(mux, candidate) == 0) && (conn == NULL || candidate->streams < conn->streams))
+            {
+                conn = candidate;
+            }
+        }
+        if (mux->demux && conn == NULL && mux->conn_count < MUX_CONNECTIONS_MAX)
+        {
+            conn = &mux->conns[mux->conn_count++];
+        }
+        if (conn == NULL)
+        {
+            LOG_WARN("no mux connection for a client, closing it");
+            close(fd);
+            continue;
+        }
+        if (mux->demux)
+        {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+            conn->fd = fd;
+            mux_conn_interest(mux, conn);
+            LOG_INFO("accepted mux connection %d", (int)(conn - mux->conns));
+            continue;
+        }
+        // ids are not reused before the counter wraps, a late frame of an old stream does not reach a new one
+        if (++mux->next_id == 0)
+        {
+            mux->next_id = 1;
+        }
+        struct mux_stream *stream = mux_add(mux, conn, mux->next_id, fd);
+        if (stream == NULL)
+        {
+            LOG_WARN("no free mux stream, closing a client");
+            close(fd);
+            continue;
+        }
+        mux_frame(conn, MUX_OPEN, stream->id, NULL, 0);
+        mux_stream_interest(mux, stream);
+    }
+}
+
+// method to print the counters of the multiplexer and the streams of every connection
+void mux_report(struct mux_state *mux)
+{
+    fprintf(stderr, "mux: streams opened:%lu reset:%lu frames sent:%lu received:%lu bytes sent:%lu received:%lu\n",
+            mux_stats.streams_opened, mux_stats.streams_reset, mux_stats.frames_sent, mux_stats.frames_received,
+            mux_stats.bytes_sent, mux_stats.bytes_received);
+    for (int i = 0; i < mux->conn_count; ++i)
+    {
+        fprintf(stderr, "mux connection %d: %s streams:%d pending:%zu\n", i, mux->conns[i].fd == -1 ? "closed" : "open",
+                mux->conns[i].streams, mux->conns[i].out_len);
+    }
+}
+
+// method to run the multiplexer (--mux=N): the clients of the listener become streams of N persistent connections to
+// the -o target. with --demux the listener accepts mux connections instead and every stream they open gets its own
+// connection to the -o target. both sides serve all connections and streams with one epoll loop and never return
+void run_mux(int listen_port, const char *host, int port)
+{
+    struct epoll_event events[MUX_EVENTS];
+    struct mux_state *mux = calloc(1, sizeof(struct mux_state));
+    if (mux == NULL)
+    {
+        printErrorAndExit("calloc");
+    }
+    mux->demux = demux;
+    mux->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    mux->listen_fd = bind_tcp_server(listen_port);
+    if (mux->epoll_fd == -1)
+    {
+        printErrorAndExit("epoll_create1");
+    }
+    set_nonblocking(mux->listen_fd);
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = MUX_LISTEN_EVENT};
+    if (epoll_ctl(mux->epoll_fd, EPOLL_CTL_ADD, mux->listen_fd, &ev) == -1)
+    {
+        printErrorAndExit("epoll_ctl");
+    }
+    // one process serves every stream, they share the pool limit instead of the limit of a session
+    session_mem_limit = pool_mem_limit;
+    for (int i = 0; i < MUX_CONNECTIONS_MAX; ++i)
+    {
+        mux->conns[i].fd = -1;
+        mux->conns[i].out_size = MUX_OUT_DATA + MUX_HEADER + MUX_FRAME_MAX;
+        mux->conns[i].out = malloc(mux->conns[i].out_size);
+        mux->conns[i].in = malloc(MUX_IN_SIZE);
+        if (mux->conns[i].out == NULL || mux->conns[i].in == NULL)
+        {
+            printErrorAndExit("malloc");
+        }
+    }
+    mux->free_slots = -1;
+    for (int i = MUX_STREAMS - 1; i >= 0; --i)
+    {
+        mux->buckets[i] = -1;
+        mux->streams[i].chain = mux->free_slots;
+        mux->free_slots = i;
+    }
+    // the target is resolved once, the connections and streams opened later connect to this address
+    mux->target.sin_family = AF_INET;
+    mux->target.sin_port = htons(port);
+    if (resolve_host(host, &mux->target.sin_addr) == -1)
+    {
+        fprintf(stderr, "Error: cannot resolve %s\n", host);
+        exit(EXIT_FAILURE);
+    }
+    if (!demux)
+    {
+        mux->conn_count = mux_connections;
+        for (int i = 0; i < mux->conn_count; ++i)
+        {
+            if (mux_connect(mux, &mux->conns[i]) == -1)
+            {
+                fprintf(stderr, "Error: cannot open mux connection %d to %s:%d\n", i, host, port);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    LOG_INFO("%s on port %d for %s:%d", demux ? "demultiplexing" : "multiplexing", listen_port, host, port);
+    metrics_session_begin();
+
+    while (1)
+    {
+        // frames queued by the last wakeup are sent before the loop sleeps
+        for (int i = 0; i < mux->conn_count; ++i)
+        {
+            if (mux->conns[i].fd != -1)
+            {
+                mux_pump(mux, &mux->conns[i]);
+            }
+            if (mux->conns[i].fd != -1)
+            {
+                mux_conn_flush(mux, &mux->conns[i]);
+            }
         }
-        else if (strcmp(argv[i], "-i") == 0)
+        mynclog_drain();
+        int n = epoll_wait(mux->epoll_fd, events, MUX_EVENTS, -1);
+        if (report_requested)
         {
-            mode = 1;
+            report_requested = 0;
+            mux_report(mux);
         }
-        else if (strcmp(argv[i], "-o") == 0)
+        if (n == -1)
         {
-            if (mode == 1)
+            if (errno == EINTR)
             {
-                mode = 4;
+                continue;
             }
-            else
+            printErrorAndExit("epoll_wait");
+        }
+        for (int e = 0; e < n; ++e)
+        {
+            uint32_t index = (uint32_t)events[e].data.u64;
+            if (index == MUX_LISTEN_EVENT)
             {
-                mode = 2;
+                mux_accept(mux);
+            }
+            else if (index >= MUX_STREAMS)
+            {
+                struct mux_conn *conn = &mux->conns[index - MUX_STREAMS];
+                if (conn->fd != -1 && conn->connecting)
+                {
+                    mux_conn_connected(mux, conn);
+                }
+                else if (conn->fd != -1 && (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                {
+                    mux_conn_read(mux, conn);
+                }
+            }
+            else if (mux->streams[index].id != 0 && mux->streams[index].id == events[e].data.u64 >> 32)
+            {
+                mux_stream_event(mux, &mux->streams[index], events[e].events);
             }
         }
-        else if (strcmp(argv[i], "-b") == 0)
+    }
+}
+
+// method to run the prefork master of a TCPMUXS server: keep prefork_workers workers accepting on the listener,
+// replace workers that exited (recycled or crashed), add workers while clients wait in the accept queue and
+// all workers are busy (up to prefork_max), and retire idle workers above prefork_workers when the queue is empty.
+// the master sleeps until a worker exits (SIGCHLD through a signalfd), a worker starts or ends a session (eventfd),
+// a client waits while every worker is busy (the listener) or the pool was over-provisioned for PREFORK_SHRINK_MS
+void run_prefork(int tcp_server_fd, const char *program, int mode, int tcp_client_sock)
+{
+    uint64_t shrink_at = 0;
+    eventfd_t value;
+    struct signalfd_siginfo info;
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    prefork_retire_fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+    prefork_notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (signal_fd == -1 || prefork_retire_fd == -1 || prefork_notify_fd == -1)
+    {
+        printErrorAndExit("prefork");
+    }
+    // a worker that lost the race for a client goes back to poll instead of blocking in accept
+    set_nonblocking(tcp_server_fd);
+
+    for (int i = 0; i < prefork_workers; ++i)
+    {
+        prefork_spawn(tcp_server_fd, program, mode, tcp_client_sock);
+    }
+
+    while (1)
+    {
+        int count = 0;
+        int idle = 0;
+        pid_t pid;
+
+        // free the slots of workers that exited
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
         {
-            mode = 3;
+            for (int slot = 0; slot < PREFORK_MAX; ++slot)
+            {
+                if (shared->prefork_slots[slot].pid == pid)
+                {
+                    shared->prefork_slots[slot].pid = 0;
+                }
+            }
         }
-        else if (strcmp(argv[i], "-e") == 0)
+        for (int slot = 0; slot < PREFORK_MAX; ++slot)
         {
-            if (i + 1 < argc)
+            if (shared->prefork_slots[slot].pid != 0)
             {
-                program = argv[++i];
+                count++;
+                idle += !__atomic_load_n(&shared->prefork_slots[slot].busy, __ATOMIC_RELAXED);
             }
-            else
+        }
+
+        int queued = accept_queue_depth(tcp_server_fd);
+        int wanted = count < prefork_workers ? prefork_workers - count : 0;
+        if (queued > idle)
+        {
+            wanted = queued - idle;
+        }
+        for (int i = 0; i < wanted && count < prefork_max; ++i, ++count)
+        {
+            prefork_spawn(tcp_server_fd, program, mode, tcp_client_sock);
+        }
+
+        // shrink slowly: one idle worker after the pool was over-provisioned for PREFORK_SHRINK_MS, the next one
+        // after another PREFORK_SHRINK_MS. a token that no idle worker took while the pool was needed is withdrawn
+        uint64_t now = monotonic_ms();
+        if (queued > 0 || count <= prefork_workers || idle == 0)
+        {
+            shrink_at = 0;
+            while (eventfd_read(prefork_retire_fd, &value) == 0)
             {
-                fprintf(stderr, "Error: missing argument for -e\n");
-                exit(EXIT_FAILURE);
             }
         }
-        else if (strncmp(argv[i], "TCPMUXS", 7) == 0)
+        else if (shrink_at == 0)
         {
-            tcp_port = argv[i] + 7;
-            tcpmuxs = 1;
+            shrink_at = now + PREFORK_SHRINK_MS;
         }
-        else if (strncmp(argv[i], "TCPS", 4) == 0)
+        else if (now >= shrink_at)
         {
-            tcp_port = argv[i] + 4;
+            eventfd_write(prefork_retire_fd, 1);
+            shrink_at = now + PREFORK_SHRINK_MS;
         }
-        else if (strncmp(argv[i], "TCPC", 4) == 0)
+
+        // the listener is only watched while every worker is busy, otherwise an idle worker takes the client
+        struct pollfd pfds[3] = {{.fd = signal_fd, .events = POLLIN}, {.fd = prefork_notify_fd, .events = POLLIN}, {.fd = tcp_server_fd, .events = idle == 0 && count < prefork_max ? POLLIN : 0}};
+        mynclog_drain();
+        if (poll(pfds, 3, shrink_at == 0 ? -1 : (int)(shrink_at - now)) == -1 && errno != EINTR)
         {
-            char *sep = strchr(argv[i] + 4, ',');
-            if (sep)
+            printErrorAndExit("poll");
+        }
+        while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+        {
+        }
+        eventfd_read(prefork_notify_fd, &value);
+    }
+}
+
+// method to read the listen queue counters of the TCP stack from /proc/net/netstat: connections dropped
+// because an accept queue was full (ListenOverflows) and all dropped connection requests (ListenDrops).
+// returns 0 on success or -1 when the counters are not available
+int read_listen_drops(unsigned long *overflows, unsigned long *drops)
+{
+    char names[4096], values[4096];
+    FILE *netstat = fopen("/proc/net/netstat", "r");
+    if (netstat == NULL)
+    {
+        return -1;
+    }
+    int found = -1;
+    // the file holds pairs of lines, the counter names followed by their values
+    while (fgets(names, sizeof(names), netstat) != NULL && fgets(values, sizeof(values), netstat) != NULL)
+    {
+        if (strncmp(names, "TcpExt:", 7) != 0)
+        {
+            continue;
+        }
+        char *name_save, *value_save;
+        char *name = strtok_r(names, " \n", &name_save);
+        char *value = strtok_r(values, " \n", &value_save);
+        while (name != NULL && value != NULL)
+        {
+            if (strcmp(name, "ListenOverflows") == 0)
             {
-                tcp_client_host = argv[i] + 4;
-                *sep = '\0';
-                tcp_client_port = sep + 1;
+                *overflows = strtoul(value, NULL, 10);
             }
-            else
+            else if (strcmp(name, "ListenDrops") == 0)
             {
-                fprintf(stderr, "Error: invalid TCPC format\n");
-                exit(EXIT_FAILURE);
+                *drops = strtoul(value, NULL, 10);
             }
+            name = strtok_r(NULL, " \n", &name_save);
+            value = strtok_r(NULL, " \n", &value_save);
         }
+        found = 0;
+        break;
+    }
+    fclose(netstat);
+    return found;
+}
 
-        else if (strncmp(argv[i], "UDPS", 4) == 0)
+// method to print the accept statistics of the TCPMUXS loop with the state of its listen queue
+void report_accept_stats(int tcp_server_fd)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    unsigned long overflows = 0, drops = 0;
+
+    fprintf(stderr, "accept: %lu clients in %lu wakeups, largest burst %d\n",
+            accept_stats.accepted, accept_stats.wakeups, accept_stats.largest_burst);
+    if (getsockopt(tcp_server_fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+    {
+        // for a listening socket tcpi_unacked is the accept queue length and tcpi_sacked its limit
+        fprintf(stderr, "accept queue: %u waiting, backlog %u\n", info.tcpi_unacked, info.tcpi_sacked);
+    }
+    if (read_listen_drops(&overflows, &drops) == 0)
+    {
+        fprintf(stderr, "listen overflows: %lu, listen drops: %lu\n", overflows, drops);
+    }
+}
+
+// method to wait for clients on the non-blocking listener and take every waiting client from the accept queue
+// with accept4, so a burst of connections is served by one wakeup. the clients are kept in pending_clients.
+// the prewarm pool is refilled here, one program at a time and only while no client waits
+void accept_clients(int tcp_server_fd)
+{
+    struct pollfd pfd = {.fd = tcp_server_fd, .events = POLLIN};
+    int ready;
+
+    while ((ready = poll(&pfd, 1, prewarm_program != NULL && warm_ready < prewarm_count ? 0 : -1)) == 0)
+    {
+        prewarm_start();
+    }
+    if (ready == -1)
+    {
+        if (errno != EINTR)
         {
-            udp_port = argv[i] + 4;
+            printErrorAndExit("poll");
         }
-        else if (strncmp(argv[i], "UDPC", 4) == 0)
+        if (report_requested)
         {
-            printf("UDPC\n");
-            char *sep = strchr(argv[i] + 4, ',');
-            if (sep)
+            report_requested = 0;
+            report_accept_stats(tcp_server_fd);
+        }
+        return;
+    }
+    pending_count = 0;
+    pending_next = 0;
+    while (pending_count < ACCEPT_BATCH)
+    {
+        // the sessions use blocking I/O on the socket, so only close-on-exec is set
+        int tcp_server_sock = accept4(tcp_server_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (tcp_server_sock < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
             {
-                udp_client_host = argv[i] + 4;
-                *sep = '\0';
-                udp_client_port = sep + 1;
-                printf("UDPC: %s:%s\n", udp_client_host, udp_client_port);
+                continue;
             }
-            else
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
             {
-                fprintf(stderr, "Error: invalid UDPC format\n");
-                exit(EXIT_FAILURE);
+                // out of descriptors or memory: serve what was accepted and retry on the next wakeup
+                perror("accept4");
+                if (pending_count == 0)
+                {
+                    usleep(10000);
+                }
             }
+            break;
         }
-
-        else
-        {
-            fprintf(stderr, "Error: invalid argument %s\n", argv[i]);
-            exit(EXIT_FAILURE);
-        }
+        metrics_accepted();
+        pending_clients[pending_count++] = tcp_server_sock;
     }
-
-    if (timeout > 0)
+    accept_stats.wakeups++;
+    accept_stats.accepted += pending_count;
+    if (pending_count > accept_stats.largest_burst)
     {
-        signal(SIGALRM, handle_alarm);
-        alarm(timeout);
+        accept_stats.largest_burst = pending_count;
     }
+}
 
-    process(
-        tcp_port ? atoi(tcp_port) : 0,
-        tcp_client_host,
-        tcp_client_port ? atoi(tcp_client_port) : 0,
-        udp_port ? atoi(udp_port) : 0,
-        udp_client_host,
-        udp_client_port ? atoi(udp_client_port) : 0,
-        program,
-        mode,
-        tcpmuxs);
-
-    return 0;
+// method to get the next client of the TCPMUXS loop, the accept queue is drained when no accepted client is pending
+int next_client(int tcp_server_fd)
+{
+    while (pending_next == pending_count)
+    {
+        mynclog_drain();
+        accept_clients(tcp_server_fd);
+    }
+    return pending_clients[pending_next++];
 }
 
-// method to
-// 1. setup network connectivity (input/output tcp/udp)
-// 2. for UDP input opttion, wait for a client to send some data so that the clients address can be captured
-// 3. if program was given (-e option), call the run_program method. if TCPMUXS option was given, keep on calling
-//    run_program in a child process for every new client that connects
-// 4. if no program was given, call the run_chat method
-void process(
-    int tcp_port,
-    char *tcp_client_host,
-    int tcp_client_port,
-    int udp_port,
-    char *udp_client_host,
-    int udp_client_port,
-    char *program,
-    int mode,
-    int tcpmuxs)
+// method to close the accepted clients that wait for the following sessions, used by a session's child process
+void close_pending_clients()
 {
-    // processing will commence with a child process, the parent process will wait for the child process or a timeout (if -t option was given)
-    pid_t pid_process = fork();
-    if (pid_process == -1)
+    while (pending_next < pending_count)
     {
-        printErrorAndExit("fork");
+        close(pending_clients[pending_next++]);
     }
-    else if (pid_process == 0)
+}
+
+// method to reap the session processes and programs that ended. the fork-per-client loops do not wait for
+// their sessions, without this every ended session stays a zombie until mync exits
+void reap_sessions()
+{
+    while (waitpid(-1, NULL, WNOHANG) > 0)
     {
+    }
+}
 
-        struct sockaddr_in server_addr, client_addr, address;
-        socklen_t addr_len;
-        int addrlen = sizeof(address);
-        char buffer[1024];
-        int n = 0;
+// method to attach a classic BPF program to a SO_REUSEPORT group that selects the socket by the CPU that
+// received the packet, so that with one listener thread pinned to every CPU a flow stays on one CPU
+int attach_cpu_steering(int fd, int count)
+{
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, count},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog prog = {.len = sizeof(code) / sizeof(code[0]), .filter = code};
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
 
-        int tcp_server_fd = 0;
-        int tcp_server_sock = 0;
-        int tcp_client_sock = 0;
-        int udp_server_sock = 0;
-        int udp_client_sock = 0;
-        // -i option with TCPS
-        if (tcp_port > 0)
+// method to open count sockets of the given type bound to the same port with SO_REUSEPORT,
+// the kernel spreads new connections (or datagram flows) over the sockets of the group
+void open_reuseport_listeners(int type, int port, int count, int *fds)
+{
+    struct sockaddr_in address;
+    int opt = 1;
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    for (int i = 0; i < count; ++i)
+    {
+        if ((fds[i] = socket(AF_INET, type, 0)) < 0)
         {
-            printf("going to call bind_tcp_server\n");
-            tcp_server_fd = bind_tcp_server(tcp_port);
-            if ((tcp_server_sock = accept(tcp_server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen)) < 0)
-            {
-                perror("accept");
-                close(tcp_server_fd);
-                exit(EXIT_FAILURE);
-            }
+            printErrorAndExit("socket failed");
         }
-        // -o option with TCPC
-        if (tcp_client_host != NULL && tcp_client_port > 0)
+        if (setsockopt(fds[i], SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1 ||
+            setsockopt(fds[i], SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1)
         {
-            tcp_client_sock = connet_tcp_client(tcp_client_host, tcp_client_port);
+            printErrorAndExit("setsockopt");
         }
-        // -i option with UDPS
-        if (udp_port > 0)
+        if (bind(fds[i], (struct sockaddr *)&address, sizeof(address)) < 0)
         {
-            udp_server_sock = start_udp_server(udp_port);
-            printf("started server on %d, server_sock: %d\n", udp_port, udp_server_sock);
+            printErrorAndExit("bind failed");
         }
-        // -o option with UDPC
-        if (udp_client_host != NULL && udp_client_port > 0)
+        if (type == SOCK_STREAM && listen(fds[i], listen_backlog) < 0)
         {
-            printf("UDPC going to start\n");
-            udp_client_sock = start_udp_client(udp_client_host, udp_client_port, &server_addr);
+            printErrorAndExit("listen");
         }
+    }
+    if (steer_flows && attach_cpu_steering(fds[0], count) == -1)
+    {
+        perror("SO_ATTACH_REUSEPORT_CBPF");
+    }
+}
 
-        // in case of -i UDPS, we wait for a UDP client to send something so that we can obtain the client address and subsequently
-        // transmit data to that client
-        if (udp_server_sock > 0)
+// method to pin the calling thread to one CPU, listener threads are spread over the CPUs in order
+void pin_to_cpu(int index)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % (cpus > 0 ? cpus : 1), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// method run by a TCPMUXS listener thread: accept clients on the thread's own socket and pass every client with the
+// index of the listener to the session forker, a threaded process does not fork itself
+void *tcp_listener_thread(void *arg)
+{
+    struct listener *listener = arg;
+    char control[CMSG_SPACE(sizeof(int))];
+
+    current_listener = listener->index;
+    pin_to_cpu(listener->index);
+    while (1)
+    {
+        mynclog_drain();
+        int tcp_server_sock = accept4(listener->fd, NULL, NULL, SOCK_CLOEXEC);
+        if (tcp_server_sock < 0)
         {
-            addr_len = sizeof(client_addr);
-            printf("waiting for a client to connect and transmit some data\n");
-            n = recvfrom(udp_server_sock, buffer, sizeof(buffer), 0, (struct sockaddr *)&client_addr, &addr_len);
-            if (n == -1)
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN || errno == EWOULDBLOCK)
             {
-                printErrorAndExit("recvfrom");
+                continue;
             }
+            // out of descriptors or memory during a burst: wait a little and retry, like accept_clients
+            perror("accept4");
+            usleep(10000);
+            continue;
         }
-        if (program)
+        metrics_accepted();
+        struct iovec iov = {.iov_base = &listener->index, .iov_len = sizeof(listener->index)};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &tcp_server_sock, sizeof(int));
+        if (sendmsg(listener->forker_fd, &msg, MSG_NOSIGNAL) == -1)
         {
-            do
-            {
-                pid_t pidmux = fork();
-                if (pidmux == -1)
-                {
-                    printErrorAndExit("fork");
-                }
-                else if (pidmux == 0)
-                {
-                    printf("going to execute program\n");
-                    run_program(
-                        program,
-                        udp_server_sock,
-                        mode == 3 ? udp_server_sock : udp_client_sock,
-                        mode == 3 ? &client_addr : &server_addr,
-                        tcp_server_sock,
-                        mode == 3 ? tcp_server_sock : tcp_client_sock);
-                    close(tcp_server_sock);
-                    printf("done run_program, going to exit\n");
-                    return;
-                }
-                else
-                {
-                    printf("created child process to run_program %d\n", pidmux);
-                    if (tcpmuxs)
-                    {
-                        close(tcp_server_sock);
-                        tcp_server_sock = 0;
-                        printf("waiting for another client\n");
-                        if ((tcp_server_sock = accept(tcp_server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen)) < 0)
-                        {
-                            perror("accept");
-                            close(tcp_server_fd);
-                            exit(EXIT_FAILURE);
-                        }
-                        printf("another client connected\n");
-                    }
-                    else
-                    {
-                        waitpid(pidmux, NULL, 0);
-                        printf("child process to run_program: return from waitpid\n");
-                    }
-                }
+            printErrorAndExit("sendmsg");
+        }
+        close(tcp_server_sock);
+    }
+    return NULL;
+}
 
-            } while (tcpmuxs);
+// method run by the session forker of the TCPMUXS listener threads, a single threaded process started before the
+// threads: it receives the clients the threads accepted and runs the program for every client in a child process
+void run_session_forker(int fd, const char *program, int mode, int tcp_client_sock)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    while (1)
+    {
+        int index;
+        struct iovec iov = {.iov_base = &index, .iov_len = sizeof(index)};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+        mynclog_drain();
+        ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (n <= 0 || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            exit(0);
+        }
+        int tcp_server_sock;
+        memcpy(&tcp_server_sock, CMSG_DATA(cmsg), sizeof(int));
+        pid_t pid = fork();
+        if (pid == -1)
+        {
+            printErrorAndExit("fork");
         }
-        else
+        else if (pid == 0)
         {
-            // run_chat_mixed(udp_server_sock, udp_client_sock, &server_addr, tcp_server_sock, tcp_client_sock);
-            run_chat(
-                udp_server_sock,
-                mode == 3 ? udp_server_sock : udp_client_sock,
-                mode == 3 ? &client_addr : &server_addr,
-                &client_addr,
-                tcp_server_sock,
-                mode == 3 ? tcp_server_sock : tcp_client_sock,
-                buffer,
-                sizeof(buffer),
-                n);
+            close(fd);
+            current_listener = index;
+            run_program(program, 0, 0, NULL, tcp_server_sock, mode == 3 ? tcp_server_sock : tcp_client_sock);
+            exit(0);
         }
+        close(tcp_server_sock);
+        reap_sessions();
     }
-    else
+}
+
+// method run by a UDPS listener thread: forward the datagrams of the thread's own socket
+void *udp_listener_thread(void *arg)
+{
+    struct listener *listener = arg;
+    current_listener = listener->index;
+    pin_to_cpu(listener->index);
+    run_relays(&listener->relay, 1);
+    return NULL;
+}
+
+// method to serve the clients of a TCPMUXS server with one listener thread per socket of the SO_REUSEPORT group
+void run_tcp_listeners(int *fds, int count, const char *program, int mode, int tcp_client_sock)
+{
+    int pair[2];
+    struct listener *listeners = calloc(count, sizeof(struct listener));
+    if (listeners == NULL)
+    {
+        printErrorAndExit("calloc");
+    }
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == -1)
+    {
+        printErrorAndExit("socketpair");
+    }
+    pid_t forker = fork();
+    if (forker == -1)
     {
-        printf("created child process to process %d\n", pid_process);
-        while ((waitpid(pid_process, NULL, WNOHANG)) == 0)
+        printErrorAndExit("fork");
+    }
+    else if (forker == 0)
+    {
+        close(pair[0]);
+        for (int i = 0; i < count; ++i)
         {
-            if (timeout_expired)
-            {
-                printf("Timeout expired\n");
-                break;
-            }
-            sleep(1);
+            close(fds[i]);
+        }
+        run_session_forker(pair[1], program, mode, tcp_client_sock);
+    }
+    close(pair[1]);
+    for (int i = 0; i < count; ++i)
+    {
+        listeners[i].index = i;
+        listeners[i].fd = fds[i];
+        listeners[i].forker_fd = pair[0];
+        listeners[i].program = program;
+        listeners[i].mode = mode;
+        listeners[i].tcp_client_sock = tcp_client_sock;
+        if (pthread_create(&listeners[i].thread, NULL, tcp_listener_thread, &listeners[i]) != 0)
+        {
+            printErrorAndExit("pthread_create");
         }
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        pthread_join(listeners[i].thread, NULL);
+    }
+    free(listeners);
+}
 
-        printf("in parent process, return from wait\n");
-        kill(0, SIGTERM);
+// method to start one listener thread per socket of a UDPS SO_REUSEPORT group, every thread forwards the datagrams
+// of its socket like the given relay does. returns the listeners (the threads run until the process ends)
+struct listener *start_udp_listeners(int *fds, int count, struct relay *relay)
+{
+    struct listener *listeners = calloc(count, sizeof(struct listener));
+    if (listeners == NULL)
+    {
+        printErrorAndExit("calloc");
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        listeners[i].index = i;
+        listeners[i].fd = fds[i];
+        init_relay(&listeners[i].relay, fds[i], 1, relay->src_peer, relay->dest_fd, relay->dest_dgram, relay->dest_addr);
+        listeners[i].relay.peer_lock = &peer_lock;
+        if (pthread_create(&listeners[i].thread, NULL, udp_listener_thread, &listeners[i]) != 0)
+        {
+            printErrorAndExit("pthread_create");
+        }
     }
+    return listeners;
 }
 
+// method to run a chat between the two parties given by the sockets (and the standard input/output when a side is missing).
+// both directions of the chat are served by one process with an epoll event loop or with io_uring (--engine=uring)
 void run_chat(
     int udp_server_sock,
     int udp_client_sock,
-    struct sockaddr_in *udp_server_addr,
-    struct sockaddr_in *udp_client_addr,
+    struct sockaddr_storage *udp_server_addr,
+    struct sockaddr_storage *udp_client_addr,
     int tcp_server_sock,
     int tcp_client_sock,
     char *buffer,
     ssize_t buffer_size,
     ssize_t buffer_content)
 {
-    pid_t pid = fork();
-    if (pid == -1)
+    struct relay *relays = calloc(MAX_RELAYS, sizeof(struct relay));
+    int relay_count = 0;
+    if (relays == NULL)
     {
-        printErrorAndExit("fork");
+        printErrorAndExit("calloc");
+    }
+
+    // first direction of the chat
+
+    // ./mync -i UDPS6060
+    if (udp_server_sock > 0 && udp_client_sock == 0 && tcp_client_sock == 0)
+    {
+        init_relay(&relays[relay_count++], STDIN_FILENO, 0, NULL, udp_server_sock, 1, udp_client_addr);
+    }
+    // ./mync -o UDPClocalhost,5050
+    else if (udp_server_sock == 0 && udp_client_sock > 0 && tcp_server_sock == 0)
+    {
+        init_relay(&relays[relay_count++], STDIN_FILENO, 0, NULL, udp_client_sock, 1, udp_server_addr);
+    }
+    // ./mync -i UDPS6060 -o UDPClocalhost,5050
+    else if (udp_server_sock > 0 && udp_client_sock > 0 && udp_server_sock != udp_client_sock)
+    {
+        init_relay(&relays[relay_count++], udp_client_sock, 1, NULL, udp_server_sock, 1, udp_client_addr);
+    }
+    // ./mync -i TCPS6060
+    else if (tcp_server_sock > 0 && udp_client_sock == 0 && tcp_client_sock == 0)
+    {
+        init_relay(&relays[relay_count++], tcp_server_sock, 0, NULL, STDOUT_FILENO, 0, NULL);
     }
-    else if (pid == 0)
+    // ./mync -o TCPClocalhost,5050
+    else if (tcp_server_sock == 0 && udp_server_sock == 0 && tcp_client_sock > 0)
     {
-        // child process to read from and write to one party of the chat
+        init_relay(&relays[relay_count++], STDIN_FILENO, 0, NULL, tcp_client_sock, 0, NULL);
+    }
+    // ./mync -i TCPS6060 -o TCPClocalhost,5050
+    else if (tcp_server_sock > 0 && tcp_client_sock > 0)
+    {
+        init_relay(&relays[relay_count++], tcp_server_sock, 0, NULL, tcp_client_sock, 0, NULL);
+    }
+    // ./mync -i TCPS6060 -o UDPClocalhost,5050
+    else if (tcp_server_sock > 0 && udp_client_sock > 0)
+    {
+        init_relay(&relays[relay_count++], tcp_server_sock, 0, NULL, udp_client_sock, 1, udp_server_addr);
+    }
+    // ./mync -i UDPS6060 -o TCPClocalhost,5050
+    else if (udp_server_sock > 0 && tcp_client_sock > 0)
+    {
+        init_relay(&relays[relay_count++], udp_server_sock, 1, udp_client_addr, tcp_client_sock, 0, NULL);
+    }
 
-        // ./mync -i UDPS6060
-        if (udp_server_sock > 0 && udp_client_sock == 0 && tcp_client_sock == 0)
-        {
-            read_and_sendto(STDIN_FILENO, udp_server_sock, udp_client_addr);
-        }
-        // ./mync -o UDPClocalhost,5050
-        else if (udp_server_sock == 0 && udp_client_sock > 0 && tcp_server_sock == 0)
-        {
-            read_and_sendto(STDIN_FILENO, udp_client_sock, udp_server_addr);
-        }
-        // ./mync -i UDPS6060 -o UDPClocalhost,5050
-        else if (udp_server_sock > 0 && udp_client_sock > 0 && udp_server_sock != udp_client_sock)
-        {
-            recvfrom_and_sendto(udp_client_sock, buffer, buffer_size, 0, udp_server_sock, udp_client_addr);
-        }
-        // ./mync -i TCPS6060
-        else if (tcp_server_sock > 0 && udp_client_sock == 0 && tcp_client_sock == 0)
+    // second direction of the chat
+
+    // ./mync -i UDPS6060
+    if (udp_server_sock > 0 && udp_client_sock == 0 && tcp_client_sock == 0)
+    {
+        init_relay(&relays[relay_count++], udp_server_sock, 1, udp_client_addr, STDOUT_FILENO, 0, NULL);
+    }
+    // ./mync -o UDPClocalhost,5050
+    else if (udp_server_sock == 0 && udp_client_sock > 0 && tcp_server_sock == 0)
+    {
+        init_relay(&relays[relay_count++], udp_client_sock, 1, NULL, STDOUT_FILENO, 0, NULL);
+    }
+    // ./mync -i UDPS6060 -o UDPClocalhost,5050 or ./mync -b UDPS6060
+    else if (udp_server_sock > 0 && udp_client_sock > 0)
+    {
+        init_relay(&relays[relay_count++], udp_server_sock, 1, udp_client_addr, udp_client_sock, 1, udp_server_addr);
+    }
+    // ./mync -i TCPS6060
+    else if (tcp_server_sock > 0 && udp_client_sock == 0 && tcp_client_sock == 0)
+    {
+        init_relay(&relays[relay_count++], STDIN_FILENO, 0, NULL, tcp_server_sock, 0, NULL);
+    }
+    // ./mync -o TCPClocalhost,5050
+    else if (tcp_server_sock == 0 && udp_server_sock == 0 && tcp_client_sock > 0)
+    {
+        init_relay(&relays[relay_count++], tcp_client_sock, 0, NULL, STDOUT_FILENO, 0, NULL);
+    }
+    // ./mync -i TCPS6060 -o TCPClocalhost,5050 (with -b TCPS6060 both directions are the same echo)
+    else if (tcp_server_sock > 0 && tcp_client_sock > 0 && tcp_server_sock != tcp_client_sock)
+    {
+        init_relay(&relays[relay_count++], tcp_client_sock, 0, NULL, tcp_server_sock, 0, NULL);
+    }
+    // ./mync -i TCPS6060 -o UDPClocalhost,5050
+    else if (tcp_server_sock > 0 && udp_client_sock > 0)
+    {
+        init_relay(&relays[relay_count++], udp_client_sock, 1, NULL, tcp_server_sock, 0, NULL);
+    }
+    // ./mync -i UDPS6060 -o TCPClocalhost,5050
+    else if (udp_server_sock > 0 && tcp_client_sock > 0)
+    {
+        init_relay(&relays[relay_count++], tcp_client_sock, 0, NULL, udp_server_sock, 1, udp_client_addr);
+    }
+
+    // the first datagram of a UDP server was already received while waiting for the client, forward it
+    for (int i = 0; i < relay_count && buffer_content > 0; ++i)
+    {
+        if (relays[i].src_fd == udp_server_sock)
         {
-            read_and_write(tcp_server_sock, STDOUT_FILENO);
+            relay_deliver(&relays[i], buffer, buffer_content);
+            break;
         }
-        // ./mync -o TCPClocalhost,5050
-        else if (tcp_server_sock == 0 && udp_server_sock == 0 && tcp_client_sock > 0)
+    }
+
+    // with a UDPS SO_REUSEPORT group the datagrams of the clients are forwarded by the listener threads, the
+    // main loop keeps serving the other direction. a stream destination cannot be shared by several threads,
+    // then the extra sockets are closed so that the kernel hands all datagrams to the first one
+    struct listener *udp_listeners = NULL;
+    for (int i = 0; i < relay_count && udp_listener_count > 1; ++i)
+    {
+        if (relays[i].src_fd != udp_server_sock)
         {
-            read_and_write(STDIN_FILENO, tcp_client_sock);
+            continue;
         }
-        // ./mync -i TCPS6060 -o TCPClocalhost,5050
-        else if (tcp_server_sock > 0 && tcp_client_sock > 0)
+        if (!relays[i].dest_dgram)
         {
-            read_and_write(tcp_server_sock, tcp_client_sock);
+            fprintf(stderr, "listener threads need a datagram output, using a single UDP listener\n");
+            for (int l = 1; l < udp_listener_count; ++l)
+            {
+                close(udp_listener_fds[l]);
+            }
+            break;
         }
-        // ./mync -i TCPS6060 -o UDPClocalhost,5050
-        else if (tcp_server_sock > 0 && udp_client_sock > 0)
+        udp_listeners = start_udp_listeners(udp_listener_fds, udp_listener_count, &relays[i]);
+        free_relay(&relays[i]);
+        relays[i] = relays[--relay_count];
+        for (int r = 0; r < relay_count; ++r)
         {
-            read_and_sendto(tcp_server_sock, udp_client_sock, udp_server_addr);
+            if (relays[r].dest_addr == udp_client_addr)
+            {
+                relays[r].peer_lock = &peer_lock;
+            }
         }
-        // ./mync -i UDPS6060 -o TCPClocalhost,5050
-        else if (udp_server_sock > 0 && tcp_client_sock > 0)
+        break;
+    }
+
+    // the io_uring engine falls back to epoll when the kernel does not support it, session timeouts, rate limits
+    // and UDP_SEGMENT sends (--gso) are served by the epoll engine
+    metrics_session_begin();
+    if (relay_count == 0 && udp_listeners != NULL)
+    {
+        // the listener threads serve the only direction of the chat, the session lasts as long as they do
+        for (int l = 0; l < udp_listener_count; ++l)
         {
-            recvfrom_and_write(udp_server_sock, buffer, buffer_size, 0, tcp_client_sock);
+            pthread_join(udp_listeners[l].thread, NULL);
         }
     }
-    else
+    else if (engine != ENGINE_URING || session_idle_ms > 0 || session_total_ms > 0 || rate_limited || gso_size > 0 || run_relays_uring(relays, relay_count) == -1)
+    {
+        run_relays(relays, relay_count);
+    }
+    metrics_session_end();
+    for (int i = 0; i < relay_count; ++i)
     {
-        // parent process to read from and write to the other party of the chat
+        free_relay(&relays[i]);
+    }
+    free(relays);
+}
 
-        // ./mync -i UDPS6060
-        if (udp_server_sock > 0 && udp_client_sock == 0 && tcp_client_sock == 0)
-        {
-            recvfrom_and_write(udp_server_sock, buffer, buffer_size, buffer_content, STDOUT_FILENO);
-        }
-        // ./mync -o UDPClocalhost,5050
-        else if (udp_server_sock == 0 && udp_client_sock > 0 && tcp_server_sock == 0)
-        {
-            recvfrom_and_write(udp_client_sock, buffer, buffer_size, 0, STDOUT_FILENO);
-        }
-        // ./mync -i UDPS6060 -o UDPClocalhost,5050 or ./mync -b UDPS6060
-        else if (udp_server_sock > 0 && udp_client_sock > 0)
+// method to split the -e command into words once, the words are cached for all sessions. words are separated by
+// spaces and tabs, single quotes keep their content as is, double quotes and backslashes work like in the shell
+// (without any expansion)
+char **program_arguments(const char *program, int *argc)
+{
+    if (program_args == NULL)
+    {
+        size_t len = strlen(program);
+        char *words = malloc(len + 1);
+        program_args = malloc((len / 2 + 2) * sizeof(char *));
+        if (words == NULL || program_args == NULL)
         {
-            recvfrom_and_sendto(udp_server_sock, buffer, buffer_size, buffer_content, udp_client_sock, udp_server_addr);
+            printErrorAndExit("malloc");
         }
-        // ./mync -i TCPS6060
-        else if (tcp_server_sock > 0 && udp_client_sock == 0 && tcp_client_sock == 0)
+        const char *c = program;
+        while (*c != '\0')
         {
-            read_and_write(STDIN_FILENO, tcp_server_sock);
+            while (*c == ' ' || *c == '\t')
+            {
+                ++c;
+            }
+            if (*c == '\0')
+            {
+                break;
+            }
+            program_args[program_argc++] = words;
+            char quote = 0;
+            while (*c != '\0' && (quote || (*c != ' ' && *c != '\t')))
+            {
+                if (quote != '\'' && *c == '\\' && c[1] != '\0' && (!quote || strchr("\"\\$`", c[1]) != NULL))
+                {
+                    *words++ = c[1];
+                    c += 2;
+                }
+                else if ((*c == '\'' || *c == '"') && (!quote || quote == *c))
+                {
+                    quote = quote ? 0 : *c;
+                    ++c;
+                }
+                else
+                {
+                    *words++ = *c++;
+                }
+            }
+            if (quote)
+            {
+                fprintf(stderr, "Error: unterminated %c in -e \"%s\"\n", quote, program);
+                exit(EXIT_FAILURE);
+            }
+            *words++ = '\0';
         }
-        // ./mync -o TCPClocalhost,5050
-        else if (tcp_server_sock == 0 && udp_server_sock == 0 && tcp_client_sock > 0)
+        program_args[program_argc] = NULL;
+        if (program_argc == 0)
         {
-            read_and_write(tcp_client_sock, STDOUT_FILENO);
+            fprintf(stderr, "Error: empty -e program\n");
+            exit(EXIT_FAILURE);
         }
-        // ./mync -i TCPS6060 -o TCPClocalhost,5050
-        else if (tcp_server_sock > 0 && tcp_client_sock > 0)
+    }
+    if (argc != NULL)
+    {
+        *argc = program_argc;
+    }
+    return program_args;
+}
+
+// method to start the program of a session with posix_spawn (a vfork, the parent's memory is not copied) in a
+// process group of its own, with stdin_fd and stdout_fd as its standard input and output
+pid_t spawn_program(char *args[], int stdin_fd, int stdout_fd)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    pid_t pid;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+    if (stdin_fd != STDIN_FILENO)
+    {
+        posix_spawn_file_actions_adddup2(&actions, stdin_fd, STDIN_FILENO);
+    }
+    if (stdout_fd != STDOUT_FILENO)
+    {
+        posix_spawn_file_actions_adddup2(&actions, stdout_fd, STDOUT_FILENO);
+    }
+    uint64_t start = metrics_address != NULL ? monotonic_us() : 0;
+    int result = posix_spawnp(&pid, args[0], &actions, &attr, args, environ);
+    if (metrics_address != NULL && result == 0)
+    {
+        histogram_add(&shared->metrics.spawn_latency, monotonic_us() - start);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (result != 0)
+    {
+        errno = result;
+        printErrorAndExit(args[0]);
+    }
+    return pid;
+}
+
+// method to load the plugin when the first word of the -e program ends with ".so", the plugin is loaded once before
+// the first fork so that every session process inherits it
+void plugin_load(const char *path)
+{
+    size_t len = strlen(path);
+    if (len < 3 || strcmp(path + len - 3, ".so") != 0)
+    {
+        return;
+    }
+
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL)
+    {
+        fprintf(stderr, "Error: %s\n", dlerror());
+        exit(EXIT_FAILURE);
+    }
+    plugin = dlsym(handle, MYNC_PLUGIN_SYMBOL);
+    if (plugin == NULL || plugin->api_version != MYNC_PLUGIN_API_VERSION)
+    {
+        fprintf(stderr, "Error: %s is not a mync plugin (version %d)\n", path, MYNC_PLUGIN_API_VERSION);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// method used by plugins to send data to the output of their session
+int plugin_write(struct mync_session *session, const char *data, size_t len)
+{
+    struct plugin_output *output = session->output;
+    if (output->dgram)
+    {
+        return sendto(output->fd, data, len, 0, (struct sockaddr *)output->addr, sockaddr_length(output->addr)) == -1 ? -1 : 0;
+    }
+    return write_all(output->fd, data, len);
+}
+
+// method to serve a session with the loaded plugin inside this process: data of the input (-i, or stdin) is
+// passed to on_data and the plugin writes to the output (-o, or stdout), like the program's stdin and stdout
+void run_plugin(int argc, char *argv[], int udp_server_sock, int udp_client_sock, struct sockaddr_storage *udp_server_addr, int tcp_server_sock, int tcp_client_sock)
+{
+    struct plugin_output output = {STDOUT_FILENO, 0, NULL};
+    struct mync_session session = {NULL, plugin_write, &output};
+    int input = udp_server_sock > 0 ? udp_server_sock : tcp_server_sock > 0 ? tcp_server_sock : STDIN_FILENO;
+    char buffer[RELAY_BUFFER_SIZE];
+
+    if (udp_client_sock > 0)
+    {
+        output.fd = udp_client_sock;
+        output.dgram = 1;
+        output.addr = udp_server_addr;
+    }
+    else if (tcp_client_sock > 0)
+    {
+        output.fd = tcp_client_sock;
+    }
+
+    if (plugin->init(&session, argc, argv) == 0)
+    {
+        while (1)
         {
-            read_and_write(tcp_client_sock, tcp_server_sock);
+            ssize_t n = udp_server_sock > 0 ? recvfrom(input, buffer, sizeof(buffer), 0, NULL, NULL) : read(input, buffer, sizeof(buffer));
+            if (n == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0 || plugin->on_data(&session, buffer, n) != 0)
+            {
+                break;
+            }
         }
-        // ./mync -i TCPS6060 -o UDPClocalhost,5050
-        else if (tcp_server_sock > 0 && udp_client_sock > 0)
+    }
+    plugin->on_close(&session);
+}
+
+// method to wait for the program of a session. the program is terminated when it outlives --session-timeout,
+// the data of a program that has the socket itself does not pass mync so --idle cannot be applied to it
+void wait_program(pid_t pid)
+{
+    int pidfd = session_total_ms > 0 ? syscall(SYS_pidfd_open, pid, 0) : -1;
+    if (pidfd != -1)
+    {
+        struct pollfd pfd = {.fd = pidfd, .events = POLLIN};
+        uint64_t deadline = monotonic_ms() + session_total_ms;
+        uint64_t now;
+        while ((now = monotonic_ms()) < deadline && poll(&pfd, 1, deadline - now) != 1)
         {
-            recvfrom_and_write(udp_client_sock, buffer, buffer_size, 0, tcp_server_sock);
         }
-        // ./mync -i UDPS6060 -o TCPClocalhost,5050
-        else if (udp_server_sock > 0 && tcp_client_sock > 0)
+        if (now >= deadline)
         {
-            read_and_sendto(tcp_client_sock, udp_server_sock, udp_client_addr);
+            LOG_INFO("session reached its timeout of %llu ms, terminating program %d", (unsigned long long)session_total_ms, pid);
+            kill(-pid, SIGTERM);
         }
+        close(pidfd);
+    }
+    while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+    {
     }
 }
 
-void run_program(const char *program, int udp_server_sock, int udp_client_sock, struct sockaddr_in *udp_server_addr, int tcp_server_sock, int tcp_client_sock)
+void run_program(const char *program, int udp_server_sock, int udp_client_sock, struct sockaddr_storage *udp_server_addr, int tcp_server_sock, int tcp_client_sock)
 {
-    char *args[10];
-    int i = 0;
-    char *token = strtok(strdup(program), " ");
-    while (token != NULL && i < 9)
+    int argc;
+    char **args = program_arguments(program, &argc);
+    metrics_session_begin();
+    if (plugin != NULL)
     {
-        args[i++] = token;
-        token = strtok(NULL, " ");
+        run_plugin(argc, args, udp_server_sock, udp_client_sock, udp_server_addr, tcp_server_sock, tcp_client_sock);
+        metrics_session_end();
+        return;
     }
-    args[i] = NULL;
+    // a stream socket (TCP or unix) is handed to the program as its stdin or stdout, like exe5 does. only datagram
+    // sockets need a pipe, this process then serves the pipes and the sockets with run_relays until the program
+    // ends, so a session is this process and the program
+    int translate_input = udp_server_sock > 0;
+    int translate_output = udp_client_sock > 0;
     int out_pipe[2];
     int in_pipe[2];
-    pid_t pid_output = -1;
     // create a pipe to capture STDOUT
-    if ((udp_client_sock > 0 || tcp_client_sock > 0) && pipe(out_pipe) != 0)
+    if (translate_output && pipe2(out_pipe, O_CLOEXEC) != 0)
     {
         exit(1);
     }
     // create a pipe to capture STDIN
-    if ((udp_server_sock > 0 || tcp_server_sock > 0) && pipe(in_pipe) != 0)
+    if (translate_input && pipe2(in_pipe, O_CLOEXEC) != 0)
     {
         exit(1);
     }
-
-    pid_t pid = fork();
-    if (pid == -1)
+    // larger pipes let a burst of datagrams wait for the program instead of for the relay (the kernel caps the
+    // size at fs.pipe-max-size, the default size is kept when that fails)
+    if (translate_output)
     {
-        printErrorAndExit("fork");
+        fcntl(out_pipe[1], F_SETPIPE_SZ, PROGRAM_PIPE_SIZE);
     }
-    else if (pid == 0)
+    if (translate_input)
     {
-        // child process to execute the program
-        setpgid(0, 0);
-        if (udp_client_sock > 0 || tcp_client_sock > 0)
-        {
-            // we redirect the output of program to the writing side of the pipe
-            close(out_pipe[0]);
-            if (dup2(out_pipe[1], STDOUT_FILENO) == -1)
-            {
-                perror("dup2");
-                exit(EXIT_FAILURE);
-            }
-            close(out_pipe[1]);
-        }
-        if (udp_server_sock > 0 || tcp_server_sock > 0)
-        {
-            // input will come from a connected client, redirect input to come from the reading side of the pipe
-            if (dup2(in_pipe[0], STDIN_FILENO) == -1)
-            {
-                perror("dup2");
-                exit(EXIT_FAILURE);
-            }
-            pid_t pid_input = fork();
-            if (pid_input == -1)
-            {
-                printErrorAndExit("fork");
-            }
-            else if (pid_input == 0)
-            {
-                // child process to read from the connected client and write to STDIN in a loop
-                close(in_pipe[0]);
+        fcntl(in_pipe[1], F_SETPIPE_SZ, PROGRAM_PIPE_SIZE);
+    }
 
-                char buffer[1024];
+    // the dup2 of the spawn clears close-on-exec on the descriptors it creates
+    pid_t pid = spawn_program(args,
+                              translate_input ? in_pipe[0] : tcp_server_sock > 0 ? tcp_server_sock : STDIN_FILENO,
+                              translate_output ? out_pipe[1] : tcp_client_sock > 0 ? tcp_client_sock : STDOUT_FILENO);
 
-                printf("waiting for a client to connect and transmit some data\n");
-                if (udp_server_sock > 0)
-                {
-                    recvfrom_and_write(udp_server_sock, buffer, sizeof(buffer), 0, in_pipe[1]);
-                }
-                else if (tcp_server_sock > 0)
-                {
-                    read_and_write(tcp_server_sock, in_pipe[1]);
-                }
-            }
-            else
-            {
-                printf("created child process to monitor input %d\n", pid_input);
-            }
-        }
-        if (execvp(args[0], args) == -1)
+    if (translate_input || translate_output)
+    {
+        struct relay relays[MAX_RELAYS];
+        int relay_count = 0;
+        if (translate_input)
         {
-            printErrorAndExit("execvp");
+            close(in_pipe[0]);
+            LOG_INFO("waiting for a client to connect and transmit some data");
+            init_relay(&relays[relay_count++], udp_server_sock, 1, NULL, in_pipe[1], 0, NULL);
         }
-    }
-    else
-    {
-        if (udp_client_sock > 0 || tcp_client_sock > 0)
+        if (translate_output)
         {
-            pid_output = fork();
-            if (pid_output == -1)
-            {
-                printErrorAndExit("fork");
-            }
-            else if (pid_output == 0)
-            {
-                // child process to read from the standard output and transmit to the output (-o option)
-                close(out_pipe[1]);
-                if (udp_client_sock > 0)
-                {
-                    read_and_sendto(out_pipe[0], udp_client_sock, udp_server_addr);
-                }
-                else if (tcp_client_sock > 0)
-                {
-                    read_and_write(out_pipe[0], tcp_client_sock);
-                }
-            }
-            else
-            {
-                printf("output process %d\n", pid_output);
-            }
+            close(out_pipe[1]);
+            init_relay(&relays[relay_count++], out_pipe[0], 0, NULL, udp_client_sock, 1, udp_server_addr);
         }
-        else
+        // the chat ends when the program does, on kernels without pidfd_open when its output ends
+        program_pidfd = syscall(SYS_pidfd_open, pid, 0);
+        run_relays(relays, relay_count);
+        for (int i = 0; i < relay_count; ++i)
         {
-            printf("not udp_client_sock > 0 || tcp_client_sock > 0\n");
+            free_relay(&relays[i]);
         }
-        // wait for the program child process to exit
-        waitpid(pid, NULL, 0);
-        printf("executing process completed\n");
-        if ((udp_client_sock > 0 || tcp_client_sock > 0))
+        if (program_pidfd != -1)
         {
-            close(out_pipe[0]);
-            close(out_pipe[1]);
+            close(program_pidfd);
+            program_pidfd = -1;
         }
-        if ((udp_server_sock > 0 || tcp_server_sock > 0))
+        if (translate_input)
         {
-            close(in_pipe[0]);
             close(in_pipe[1]);
         }
-
-        // signal all child processes of pid to terminate
-        kill(-pid, SIGTERM);
-        if (pid_output != -1)
+        if (translate_output)
         {
-            // signal pid_output to terminate
-            kill(pid_output, SIGTERM);
+            close(out_pipe[0]);
         }
+        // the relays end with the program, or earlier when the session failed or timed out
+        kill(-pid, SIGTERM);
+    }
+
+    // wait for the program child process to exit
+    wait_program(pid);
+    LOG_DEBUG("executing process completed");
+    metrics_session_end();
+
+    // signal all child processes of pid to terminate
+    kill(-pid, SIGTERM);
+}
+
+// method to add one program to the prewarm pool, it prints its greeting and blocks reading stdin
+void prewarm_start()
+{
+    int pair[2];
+    reap_sessions();
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1)
+    {
+        printErrorAndExit("socketpair");
+    }
+    warm_programs[warm_ready].pid = spawn_program(program_arguments(prewarm_program, NULL), pair[1], pair[1]);
+    warm_programs[warm_ready++].fd = pair[0];
+    close(pair[1]);
+}
+
+// method to take the oldest program of the pool, when the pool is disabled the pid is -1. a client that finds
+// the pool empty gets a program started for it now, as without --prewarm
+struct warm_program prewarm_take()
+{
+    struct warm_program warm = {-1, -1};
+    if (prewarm_program == NULL)
+    {
+        return warm;
+    }
+    if (warm_ready == 0)
+    {
+        prewarm_start();
     }
+    warm = warm_programs[0];
+    memmove(&warm_programs[0], &warm_programs[1], --warm_ready * sizeof(struct warm_program));
+    return warm;
+}
+
+// method for a session process to close the sockets of the programs that wait for other clients
+void prewarm_close_others()
+{
+    for (int i = 0; i < warm_ready; ++i)
+    {
+        close(warm_programs[i].fd);
+    }
+    warm_ready = 0;
+}
+
+// method to serve a client with a program of the prewarm pool: the client's input goes to the program and the
+// program's output to the output (the client itself with -b) until either side ends
+void run_warm_program(struct warm_program *warm, int input_sock, int output_fd)
+{
+    struct relay relays[MAX_RELAYS];
+    init_relay(&relays[0], input_sock, 0, NULL, warm->fd, 0, NULL);
+    init_relay(&relays[1], warm->fd, 0, NULL, output_fd, 0, NULL);
+    metrics_session_begin();
+    run_relays(relays, MAX_RELAYS);
+    metrics_session_end();
+    free_relay(&relays[0]);
+    free_relay(&relays[1]);
+    close(warm->fd);
+    kill(-warm->pid, SIGTERM);
 }
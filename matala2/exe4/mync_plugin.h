@@ -0,0 +1,34 @@
+#ifndef MYNC_PLUGIN_H
+#define MYNC_PLUGIN_H
+
+#include <stddef.h>
+
+// version of the plugin interface, mync refuses a plugin built for another version
+#define MYNC_PLUGIN_API_VERSION 1
+// name of the struct mync_plugin a plugin exports
+#define MYNC_PLUGIN_SYMBOL "mync_plugin"
+
+// a session of a plugin: the plugin keeps its own data in state and sends data to the peer with write
+struct mync_session
+{
+    void *state;
+    // method to send data to the peer of the session, returns 0 on success or -1 when the output failed
+    int (*write)(struct mync_session *session, const char *data, size_t len);
+    void *output;
+};
+
+// a handler loaded by mync -e "./handler.so args" instead of a program, it runs inside the mync process that
+// serves the session and exchanges data with the peer through memory instead of pipes
+struct mync_plugin
+{
+    int api_version;
+    // method called when a session starts with the arguments of -e (argv[0] is the plugin path).
+    // returns 0 to start the session or -1 to refuse it
+    int (*init)(struct mync_session *session, int argc, char *argv[]);
+    // method called with data received from the peer, returns 0 to continue the session or 1 to end it
+    int (*on_data)(struct mync_session *session, const char *data, size_t len);
+    // method called once when the session ends (also after init refused it)
+    void (*on_close)(struct mync_session *session);
+};
+
+#endif
@@ -0,0 +1,362 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include "mynclog.h"
+
+// types of the arguments of a site, 4 bits per argument
+enum mynclog_type
+{
+    ARG_INT = 1,
+    ARG_UINT,
+    ARG_LONG,
+    ARG_ULONG,
+    ARG_LLONG,
+    ARG_ULLONG,
+    ARG_SIZE,
+    ARG_DOUBLE,
+    ARG_STRING,
+    ARG_POINTER
+};
+
+// a record fills two cache lines. the sequence of a slot tells producers and the drain whose turn it is: a slot
+// with index i is free for the record at position pos when sequence + i == pos and holds it when it is pos + 1
+struct mynclog_record
+{
+    _Atomic uint64_t sequence;
+    uint64_t time_ns;
+    struct mynclog_site *site;
+    uint64_t args[MYNC_LOG_ARGS];
+    char text[MYNC_LOG_TEXT];
+} __attribute__((aligned(64)));
+
+static struct mynclog_record ring[MYNC_LOG_RECORDS];
+static _Atomic uint64_t head;
+static _Atomic uint64_t tail;
+static _Atomic unsigned long dropped;
+static _Atomic int draining;
+static int log_fd = STDERR_FILENO;
+static pthread_once_t setup_once = PTHREAD_ONCE_INIT;
+
+static const char *level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+// the ring is drained before a fork so the child does not print the parent's records again, and at exit
+static void mynclog_drain_at_exit()
+{
+    mynclog_drain();
+}
+
+static void mynclog_setup()
+{
+    pthread_atfork(mynclog_drain_at_exit, NULL, NULL);
+    atexit(mynclog_drain_at_exit);
+}
+
+// method to find the conversions of a format, returns the number of arguments or -1 for a format the records
+// cannot carry (then the format is written without arguments)
+static int mynclog_parse(const char *format, uint32_t *types)
+{
+    int argc = 0;
+    *types = 0;
+    for (const char *c = format; *c != '\0'; ++c)
+    {
+        if (*c != '%')
+        {
+            continue;
+        }
+        if (*++c == '%')
+        {
+            continue;
+        }
+        c += strspn(c, "-+ #0123456789.");
+        int longs = 0, size = 0;
+        while (*c == 'l' || *c == 'h' || *c == 'z' || *c == 'j' || *c == 't')
+        {
+            longs += *c == 'l';
+            size |= *c == 'z' || *c == 'j' || *c == 't';
+            ++c;
+        }
+        enum mynclog_type type;
+        switch (*c)
+        {
+        case 'c':
+        case 'd':
+        case 'i':
+            type = size ? ARG_SIZE : longs == 0 ? ARG_INT : longs == 1 ? ARG_LONG : ARG_LLONG;
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+            type = size ? ARG_SIZE : longs == 0 ? ARG_UINT : longs == 1 ? ARG_ULONG : ARG_ULLONG;
+            break;
+        case 'f':
+        case 'g':
+        case 'e':
+            type = ARG_DOUBLE;
+            break;
+        case 's':
+            type = ARG_STRING;
+            break;
+        case 'p':
+            type = ARG_POINTER;
+            break;
+        default:
+            return -1;
+        }
+        if (argc == MYNC_LOG_ARGS)
+        {
+            return -1;
+        }
+        *types |= (uint32_t)type << (4 * argc++);
+    }
+    return argc;
+}
+
+void mynclog_write(struct mynclog_site *site, ...)
+{
+    if (!atomic_load_explicit((_Atomic int *)&site->parsed, memory_order_acquire))
+    {
+        pthread_once(&setup_once, mynclog_setup);
+        // several threads may parse the same site at once, they all store the same result
+        uint32_t types;
+        site->argc = mynclog_parse(site->format, &types);
+        site->types = types;
+        atomic_store_explicit((_Atomic int *)&site->parsed, 1, memory_order_release);
+    }
+
+    // claim the next slot, a full ring drops the record instead of waiting for the drain
+    uint64_t pos = atomic_load_explicit(&head, memory_order_relaxed);
+    struct mynclog_record *record;
+    while (1)
+    {
+        record = &ring[pos & (MYNC_LOG_RECORDS - 1)];
+        uint64_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire) + (pos & (MYNC_LOG_RECORDS - 1));
+        if (sequence == pos)
+        {
+            if (atomic_compare_exchange_weak_explicit(&head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (sequence < pos)
+        {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&head, memory_order_relaxed);
+        }
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record->time_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    record->site = site;
+    va_list args;
+    va_start(args, site);
+    size_t text = 0;
+    for (int i = 0; i < site->argc; ++i)
+    {
+        switch ((site->types >> (4 * i)) & 0xf)
+        {
+        case ARG_INT:
+            record->args[i] = (uint64_t)(long long)va_arg(args, int);
+            break;
+        case ARG_UINT:
+            record->args[i] = va_arg(args, unsigned int);
+            break;
+        case ARG_LONG:
+            record->args[i] = (uint64_t)(long long)va_arg(args, long);
+            break;
+        case ARG_ULONG:
+            record->args[i] = va_arg(args, unsigned long);
+            break;
+        case ARG_LLONG:
+        case ARG_ULLONG:
+            record->args[i] = va_arg(args, unsigned long long);
+            break;
+        case ARG_SIZE:
+            record->args[i] = va_arg(args, size_t);
+            break;
+        case ARG_DOUBLE:
+        {
+            double value = va_arg(args, double);
+            memcpy(&record->args[i], &value, sizeof(value));
+            break;
+        }
+        case ARG_STRING:
+        {
+            // strings are copied, the caller's buffer may be gone when the record is drained
+            const char *value = va_arg(args, const char *);
+            size_t len = value == NULL ? 0 : strnlen(value, MYNC_LOG_TEXT - 1 - text);
+            record->args[i] = text;
+            memcpy(record->text + text, value, len);
+            record->text[text + len] = '\0';
+            text += len + (text + len < MYNC_LOG_TEXT - 1);
+            break;
+        }
+        case ARG_POINTER:
+            record->args[i] = (uintptr_t)va_arg(args, void *);
+            break;
+        }
+    }
+    va_end(args);
+    atomic_store_explicit(&record->sequence, pos + 1 - (pos & (MYNC_LOG_RECORDS - 1)), memory_order_release);
+}
+
+// method to format one conversion of a record: the conversion is written with its flags and width and a length
+// modifier that matches the stored argument
+static int mynclog_convert(char *out, size_t room, const char *spec, size_t spec_len, struct mynclog_record *record, int i)
+{
+    char conversion[32];
+    char letter = spec[spec_len - 1];
+    size_t prefix = strspn(spec, "%-+ #0123456789.");
+    if (prefix > sizeof(conversion) - 4)
+    {
+        prefix = sizeof(conversion) - 4;
+    }
+    memcpy(conversion, spec, prefix);
+    int type = (record->site->types >> (4 * i)) & 0xf;
+    uint64_t value = record->args[i];
+    switch (type)
+    {
+    case ARG_DOUBLE:
+    {
+        double number;
+        memcpy(&number, &value, sizeof(number));
+        snprintf(conversion + prefix, 4, "%c", letter);
+        return snprintf(out, room, conversion, number);
+    }
+    case ARG_STRING:
+        snprintf(conversion + prefix, 4, "s");
+        return snprintf(out, room, conversion, record->text + value);
+    case ARG_POINTER:
+        snprintf(conversion + prefix, 4, "p");
+        return snprintf(out, room, conversion, (void *)(uintptr_t)value);
+    default:
+        snprintf(conversion + prefix, 4, "ll%c", letter);
+        if (letter == 'c')
+        {
+            conversion[prefix] = 'c';
+            conversion[prefix + 1] = '\0';
+            return snprintf(out, room, conversion, (int)value);
+        }
+        return snprintf(out, room, conversion, (long long)value);
+    }
+}
+
+// method to format a record as a line: "mync[pid] seconds.micros LEVEL message"
+static size_t mynclog_format(char *out, size_t room, struct mynclog_record *record)
+{
+    struct mynclog_site *site = record->site;
+    size_t len = snprintf(out, room, "mync[%d] %llu.%06llu %s ", getpid(), (unsigned long long)(record->time_ns / 1000000000),
+                          (unsigned long long)(record->time_ns % 1000000000 / 1000), level_names[site->level & 3]);
+    int arg = 0;
+    for (const char *c = site->format; *c != '\0' && len < room - 1; ++c)
+    {
+        if (*c != '%' || site->argc < 0)
+        {
+            out[len++] = *c;
+            continue;
+        }
+        if (c[1] == '%')
+        {
+            out[len++] = '%';
+            ++c;
+            continue;
+        }
+        size_t spec_len = 1 + strspn(c + 1, "-+ #0123456789.hlzjt") + 1;
+        int n = mynclog_convert(out + len, room - len, c, spec_len, record, arg++);
+        len += n < 0 ? 0 : (size_t)n < room - len ? (size_t)n : room - len - 1;
+        c += spec_len - 1;
+    }
+    // one record is one line
+    while (len > 0 && out[len - 1] == '\n')
+    {
+        --len;
+    }
+    out[len++] = '\n';
+    return len;
+}
+
+static void mynclog_flush(const char *buffer, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(log_fd, buffer, len);
+        if (n <= 0)
+        {
+            return;
+        }
+        buffer += n;
+        len -= n;
+    }
+}
+
+int mynclog_drain()
+{
+    char buffer[8192];
+    size_t len = 0;
+    int count = 0;
+    // an empty ring costs two loads, one drain runs at a time and a thread that finds another one draining goes on
+    if (atomic_load_explicit(&tail, memory_order_relaxed) == atomic_load_explicit(&head, memory_order_relaxed) &&
+        atomic_load_explicit(&dropped, memory_order_relaxed) == 0)
+    {
+        return 0;
+    }
+    if (atomic_exchange(&draining, 1))
+    {
+        return 0;
+    }
+    uint64_t pos = atomic_load_explicit(&tail, memory_order_relaxed);
+    while (1)
+    {
+        struct mynclog_record *record = &ring[pos & (MYNC_LOG_RECORDS - 1)];
+        uint64_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire) + (pos & (MYNC_LOG_RECORDS - 1));
+        if (sequence != pos + 1)
+        {
+            break;
+        }
+        if (sizeof(buffer) - len < 512)
+        {
+            mynclog_flush(buffer, len);
+            len = 0;
+        }
+        len += mynclog_format(buffer + len, 512, record);
+        atomic_store_explicit(&record->sequence, pos + MYNC_LOG_RECORDS - (pos & (MYNC_LOG_RECORDS - 1)), memory_order_release);
+        atomic_store_explicit(&tail, ++pos, memory_order_relaxed);
+        ++count;
+    }
+    unsigned long lost = atomic_exchange(&dropped, 0);
+    if (lost > 0)
+    {
+        if (sizeof(buffer) - len < 128)
+        {
+            mynclog_flush(buffer, len);
+            len = 0;
+        }
+        len += snprintf(buffer + len, sizeof(buffer) - len, "mync[%d] %lu log records dropped, the ring was full\n", getpid(), lost);
+    }
+    mynclog_flush(buffer, len);
+    atomic_store(&draining, 0);
+    return count;
+}
+
+int mynclog_open(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    log_fd = fd;
+    return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef MYNCLOG_H
+#define MYNCLOG_H
+
+#include <stdint.h>
+
+// log levels, records below MYNC_LOG_LEVEL are removed by the compiler (make CFLAGS+=-DMYNC_LOG_LEVEL=0 keeps the
+// debug records of every session, accept and fork)
+#define MYNC_LOG_DEBUG 0
+#define MYNC_LOG_INFO 1
+#define MYNC_LOG_WARN 2
+#define MYNC_LOG_ERROR 3
+#ifndef MYNC_LOG_LEVEL
+#define MYNC_LOG_LEVEL MYNC_LOG_INFO
+#endif
+
+// records kept by the ring of a process, a record that finds the ring full is dropped and counted
+#define MYNC_LOG_RECORDS 4096
+// arguments of a record and bytes kept of its %s arguments
+#define MYNC_LOG_ARGS 4
+#define MYNC_LOG_TEXT 64
+
+// a log statement: its format is parsed once, on the first record, into the types of its arguments
+struct mynclog_site
+{
+    const char *format;
+    int level;
+    int argc;
+    uint32_t types;
+    int parsed;
+};
+
+// method to write a record to the ring of this process: the time, the site and the raw arguments (strings are
+// copied). the conversions of the format are limited to %c %d %i %u %x %X %o %s %p %f %g %e with any flags, width,
+// precision and length modifier, and at most MYNC_LOG_ARGS of them
+void mynclog_write(struct mynclog_site *site, ...);
+// method to format the records in the ring and write them out, called where a process waits anyway (the event
+// loops, the accept loops, before a fork and at exit). returns the number of records written
+int mynclog_drain();
+// method to send the drained records to a file instead of stderr, returns 0 or -1 with errno set
+int mynclog_open(const char *path);
+
+#define MYNC_LOG(level, format, ...)                                                   \
+    do                                                                                 \
+    {                                                                                  \
+        if ((level) >= MYNC_LOG_LEVEL)                                                 \
+        {                                                                              \
+            static struct mynclog_site mynclog_site_ = {format, level, 0, 0, 0};       \
+            mynclog_write(&mynclog_site_, ##__VA_ARGS__);                              \
+        }                                                                              \
+    } while (0)
+#define LOG_DEBUG(format, ...) MYNC_LOG(MYNC_LOG_DEBUG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) MYNC_LOG(MYNC_LOG_INFO, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...) MYNC_LOG(MYNC_LOG_WARN, format, ##__VA_ARGS__)
+#define LOG_ERROR(format, ...) MYNC_LOG(MYNC_LOG_ERROR, format, ##__VA_ARGS__)
+
+#endif
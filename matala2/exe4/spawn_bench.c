@@ -0,0 +1,119 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/wait.h>
+
+// number of spawns measured per method when not given on the command line
+#define DEFAULT_SPAWNS 200
+// memory touched by the parent when not given on the command line, like the buffers of a busy mync process
+#define DEFAULT_HEAP_MB 64
+
+void printErrorAndExit(const char *message)
+{
+    perror(message);
+    exit(EXIT_FAILURE);
+}
+
+// method returning the time in microseconds
+double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// method to start the program the way run_program did before: fork a copy of this process, then execvp
+pid_t spawn_fork(char *args[])
+{
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        printErrorAndExit("fork");
+    }
+    else if (pid == 0)
+    {
+        setpgid(0, 0);
+        execvp(args[0], args);
+        _exit(127);
+    }
+    return pid;
+}
+
+// method to start the program the way run_program does now: posix_spawn without copying this process
+pid_t spawn_posix(char *args[])
+{
+    posix_spawnattr_t attr;
+    pid_t pid;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+    if (posix_spawnp(&pid, args[0], NULL, &attr, args, environ) != 0)
+    {
+        printErrorAndExit("posix_spawnp");
+    }
+    posix_spawnattr_destroy(&attr);
+    return pid;
+}
+
+// method to measure the time from the start of a spawn until the parent can go on, and until the program ended
+void measure(const char *name, pid_t (*spawn)(char *[]), char *args[], int count)
+{
+    double *spawned = malloc(count * sizeof(double));
+    double *total = malloc(count * sizeof(double));
+    if (spawned == NULL || total == NULL)
+    {
+        printErrorAndExit("malloc");
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        double start = now_us();
+        pid_t pid = spawn(args);
+        spawned[i] = now_us() - start;
+        waitpid(pid, NULL, 0);
+        total[i] = now_us() - start;
+    }
+    qsort(spawned, count, sizeof(double), compare_double);
+    qsort(total, count, sizeof(double), compare_double);
+    printf("%-12s spawn p50 %8.1f us  p99 %8.1f us   until exit p50 %8.1f us  p99 %8.1f us\n", name,
+           spawned[count / 2], spawned[count * 99 / 100], total[count / 2], total[count * 99 / 100]);
+    free(spawned);
+    free(total);
+}
+
+// usage: ./spawn_bench [spawns] [heap MB] [program args...], the default program is /bin/true
+int main(int argc, char *argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : DEFAULT_SPAWNS;
+    size_t heap = (size_t)(argc > 2 ? atoi(argv[2]) : DEFAULT_HEAP_MB) << 20;
+    char *default_args[] = {"/bin/true", NULL};
+    char **args = argc > 3 ? argv + 3 : default_args;
+    if (count < 1)
+    {
+        fprintf(stderr, "usage: %s [spawns] [heap MB] [program args...]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // fork has to copy the page tables of all touched memory, posix_spawn does not
+    char *memory = malloc(heap);
+    if (heap > 0 && memory == NULL)
+    {
+        printErrorAndExit("malloc");
+    }
+    memset(memory, 1, heap);
+
+    printf("%d spawns of %s with %zu MB of touched memory\n", count, args[0], heap >> 20);
+    measure("fork+execvp", spawn_fork, args, count);
+    measure("posix_spawn", spawn_posix, args, count);
+    free(memory);
+    return 0;
+}
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+
+#include "mync_plugin.h"
+
+#define BOARD_SIZE 9
+
+// state of one game, the player's moves are parsed from the received data like scanf("%d") would
+struct game
+{
+    char strategy[10];
+    char board[BOARD_SIZE];
+    int movesMade;
+    char number[16];
+    int number_len;
+};
+
+// method to send a formatted message to the player
+void sendf(struct mync_session *session, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void sendf(struct mync_session *session, const char *format, ...)
+{
+    char message[128];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    session->write(session, message, len);
+}
+
+// method to send the board to the player
+void sendBoard(struct mync_session *session, char *board)
+{
+    sendf(session, "%c | %c | %c\n%c | %c | %c\n%c | %c | %c\n",
+          board[0], board[1], board[2], board[3], board[4], board[5], board[6], board[7], board[8]);
+}
+
+int checkWin(char board[BOARD_SIZE])
+{
+    // Check rows
+    for (int i = 0; i < 9; i += 3)
+    {
+        if (board[i] == board[i + 1] && board[i + 1] == board[i + 2] && board[i] != ' ')
+        {
+            return board[i] == 'X' ? 1 : 2;
+        }
+    }
+
+    // Check columns
+    for (int i = 0; i < 3; ++i)
+    {
+        if (board[i] == board[i + 3] && board[i + 3] == board[i + 6] && board[i] != ' ')
+        {
+            return board[i] == 'X' ? 1 : 2;
+        }
+    }
+
+    // Check diagonals
+    if (board[0] == board[4] && board[4] == board[8] && board[0] != ' ')
+    {
+        return board[0] == 'X' ? 1 : 2;
+    }
+    if (board[2] == board[4] && board[4] == board[6] && board[2] != ' ')
+    {
+        return board[2] == 'X' ? 1 : 2;
+    }
+
+    return 0;
+}
+
+// method to make the computer move, returns 1 when the game is over
+int computerMove(struct mync_session *session, struct game *game)
+{
+    int move = 0;
+    if (game->movesMade == 0)
+    {
+        // First move
+        move = game->strategy[0] - '1';
+    }
+    else
+    {
+        // Find the highest priority move
+        for (int i = 0; i < 9; ++i)
+        {
+            move = game->strategy[i] - '1';
+            if (game->board[move] == ' ')
+            {
+                break;
+            }
+        }
+    }
+
+    game->board[move] = 'X';
+    game->movesMade++;
+    sendf(session, "computer move: %d\n", move + 1);
+    sendBoard(session, game->board);
+
+    if (checkWin(game->board) == 1)
+    {
+        sendf(session, "I win\n");
+        return 1;
+    }
+    if (game->movesMade == 9)
+    {
+        sendf(session, "DRAW\n");
+        return 1;
+    }
+    return 0;
+}
+
+// method to make the player's move and answer it, returns 1 when the game is over
+int playerMove(struct mync_session *session, struct game *game, int move)
+{
+    if (move < 1 || move > 9 || game->board[move - 1] != ' ')
+    {
+        sendf(session, "Error\n");
+        return 1;
+    }
+
+    game->board[move - 1] = 'O';
+    game->movesMade++;
+    sendf(session, "Player move: %d\n", move);
+    sendBoard(session, game->board);
+
+    if (checkWin(game->board) == 2)
+    {
+        sendf(session, "I lost\n");
+        return 1;
+    }
+    if (game->movesMade == 9)
+    {
+        sendf(session, "DRAW\n");
+        return 1;
+    }
+    return computerMove(session, game);
+}
+
+// method to start a game with the strategy given as the only argument, the computer moves first
+int ttt_init(struct mync_session *session, int argc, char *argv[])
+{
+    if (argc != 2 || strlen(argv[1]) != 9)
+    {
+        sendf(session, "Error\n");
+        return -1;
+    }
+
+    // Validate strategy
+    int count[10] = {0};
+    for (int i = 0; i < 9; ++i)
+    {
+        if (argv[1][i] < '1' || argv[1][i] > '9' || ++count[argv[1][i] - '0'] > 1)
+        {
+            sendf(session, "Error\n");
+            return -1;
+        }
+    }
+
+    struct game *game = calloc(1, sizeof(struct game));
+    if (game == NULL)
+    {
+        return -1;
+    }
+    strcpy(game->strategy, argv[1]);
+    memset(game->board, ' ', BOARD_SIZE);
+    session->state = game;
+    return computerMove(session, game) ? -1 : 0;
+}
+
+// method to parse the player's moves from the received data, a move may be split over several reads
+int ttt_on_data(struct mync_session *session, const char *data, size_t len)
+{
+    struct game *game = session->state;
+    for (size_t i = 0; i < len; ++i)
+    {
+        if (isdigit((unsigned char)data[i]) || (data[i] == '-' && game->number_len == 0))
+        {
+            if (game->number_len < (int)sizeof(game->number) - 1)
+            {
+                game->number[game->number_len++] = data[i];
+            }
+            continue;
+        }
+        if (!isspace((unsigned char)data[i]))
+        {
+            sendf(session, "Error\n");
+            return 1;
+        }
+        if (game->number_len > 0)
+        {
+            game->number[game->number_len] = '\0';
+            game->number_len = 0;
+            if (playerMove(session, game, atoi(game->number)))
+            {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// method to free the game of a session
+void ttt_on_close(struct mync_session *session)
+{
+    free(session->state);
+    session->state = NULL;
+}
+
+struct mync_plugin mync_plugin = {
+    .api_version = MYNC_PLUGIN_API_VERSION,
+    .init = ttt_init,
+    .on_data = ttt_on_data,
+    .on_close = ttt_on_close,
+};
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,16 +8,87 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/uio.h>
+
+// largest number of clients taken from the accept queue on one wakeup
+#define ACCEPT_BATCH 64
+
+// statistics of the accept loop, printed with the listen queue counters on SIGUSR1
+struct accept_stats
+{
+    unsigned long wakeups;
+    unsigned long accepted;
+    int largest_burst;
+};
+
+// largest number of idle upstream connections kept by the pool
+#define POOL_MAX 256
+
+// an idle upstream connection of the pool
+struct pooled_conn
+{
+    int fd;
+    time_t idle_since;
+};
+
+// pool of warm connections to the upstream of mode 4, owned by the accept loop. sessions lease a connection when
+// they are forked and return it over the channel when they end
+struct upstream_pool
+{
+    struct sockaddr_in addr;
+    struct pooled_conn idle[POOL_MAX];
+    int idle_count;
+    int channel[2];
+    unsigned long leased;
+    unsigned long missed;
+    unsigned long connected;
+    unsigned long returned;
+    unsigned long discarded;
+    unsigned long expired;
+};
 
 void process_mode4(int port, const char *program, int mode, const char *client_host, int client_port);
 void process_mode123(int port, const char *program, int mode);
 void run_program(const char *program);
+int accept_clients(int server_fd, int *sockets, int max);
+void pool_init(struct sockaddr_in *addr);
+int pool_lease();
+void pool_return(int fd);
+void pool_receive();
+void pool_maintain();
+void pool_close_idle();
+
+// backlog of the listening socket (--backlog=N), the kernel caps it at net.core.somaxconn
+int listen_backlog = SOMAXCONN;
+struct accept_stats accept_stats;
+// upstream connection pool of mode 4: maximal number of idle connections (0 disables the pool), number of
+// connections kept warm and seconds after which an idle connection above the warm ones is closed
+// (--pool=N --pool-warm=N --pool-idle=SECONDS)
+int pool_max = 0;
+int pool_warm = 0;
+int pool_idle_timeout = 30;
+struct upstream_pool upstream_pool;
+// variable indicating a report of the accept statistics was requested (SIGUSR1)
+volatile sig_atomic_t report_requested = 0;
+
 void printErrorAndExit(const char *message)
 {
     perror(message);
     exit(EXIT_FAILURE);
 }
 
+// method called when a report of the accept statistics is requested (SIGUSR1)
+void handle_report(int sig)
+{
+    report_requested = 1;
+}
+
 int main(int argc, char *argv[])
 {
     char *port = NULL;
@@ -58,6 +130,32 @@ int main(int argc, char *argv[])
                 exit(EXIT_FAILURE);
             }
         }
+        else if (strncmp(argv[i], "--backlog=", 10) == 0)
+        {
+            listen_backlog = atoi(argv[i] + 10);
+            if (listen_backlog < 1)
+            {
+                fprintf(stderr, "Error: invalid backlog %s\n", argv[i] + 10);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(argv[i], "--pool=", 7) == 0)
+        {
+            pool_max = atoi(argv[i] + 7);
+            if (pool_max < 0 || pool_max > POOL_MAX)
+            {
+                fprintf(stderr, "Error: --pool must be between 0 and %d\n", POOL_MAX);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(argv[i], "--pool-warm=", 12) == 0)
+        {
+            pool_warm = atoi(argv[i] + 12);
+        }
+        else if (strncmp(argv[i], "--pool-idle=", 12) == 0)
+        {
+            pool_idle_timeout = atoi(argv[i] + 12);
+        }
         else if (strncmp(argv[i], "TCPMUX", 6) == 0)
         {
             port = argv[i] + 6;
@@ -90,6 +188,18 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    if (pool_warm < 0 || pool_warm > pool_max)
+    {
+        fprintf(stderr, "Error: --pool-warm must be between 0 and the --pool size\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // the report signal must interrupt poll(), so it is installed without SA_RESTART
+    struct sigaction report_action;
+    memset(&report_action, 0, sizeof(report_action));
+    report_action.sa_handler = handle_report;
+    sigaction(SIGUSR1, &report_action, NULL);
+
     if (client_host && client_port && port)
     {
         process_mode4(atoi(port), program, mode, client_host, atoi(client_port));
@@ -112,7 +222,6 @@ void process_mode123(int port, const char *program, int mode)
     int server_fd, new_socket;
     struct sockaddr_in address;
     int opt = 1;
-    int addrlen = sizeof(address);
 
     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
     {
@@ -138,66 +247,73 @@ void process_mode123(int port, const char *program, int mode)
         exit(EXIT_FAILURE);
     }
 
-    if (listen(server_fd, 3) < 0)
+    if (listen(server_fd, listen_backlog) < 0)
     {
         perror("listen");
         close(server_fd);
         exit(EXIT_FAILURE);
     }
+    // the accept loop drains the queue until it is empty, so the listener must not block
+    if (fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK) == -1)
+    {
+        printErrorAndExit("fcntl");
+    }
 
     printf("Server listening on port %d\n", port);
     while (1)
     {
-
-        if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen)) < 0)
-        {
-            perror("accept");
-            close(server_fd);
-            exit(EXIT_FAILURE);
-        }
-
-        printf("Client connected\n");
-        pid_t pid = fork();
-        if (pid < 0)
+        int sockets[ACCEPT_BATCH];
+        int count = accept_clients(server_fd, sockets, ACCEPT_BATCH);
+        for (int c = 0; c < count; ++c)
         {
-            perror("fork");
-            close(new_socket);
-            exit(EXIT_FAILURE);
-        }
-        if (pid == 0)
-        {
-
-            // Use a switch statement to handle the mode and set up dup2 accordingly
-            switch (mode) // 1 for input, 2 for output, 3 for both, 4 for input from client and output to server
+            new_socket = sockets[c];
+            printf("Client connected\n");
+            pid_t pid = fork();
+            if (pid < 0)
             {
-            case 1:
-                dup2(new_socket, STDIN_FILENO);
-                break;
-            case 2:
-                dup2(new_socket, STDOUT_FILENO);
-                break;
-            case 3:
-                dup2(new_socket, STDIN_FILENO);
-                dup2(new_socket, STDOUT_FILENO);
-                break;
-            default:
-                fprintf(stderr, "Error: invalid mode\n");
+                perror("fork");
                 close(new_socket);
-                close(server_fd);
                 exit(EXIT_FAILURE);
             }
+            if (pid == 0)
+            {
+                // the rest of the batch belongs to the following sessions
+                for (int other = c + 1; other < count; ++other)
+                {
+                    close(sockets[other]);
+                }
+                // Use a switch statement to handle the mode and set up dup2 accordingly
+                switch (mode) // 1 for input, 2 for output, 3 for both, 4 for input from client and output to server
+                {
+                case 1:
+                    dup2(new_socket, STDIN_FILENO);
+                    break;
+                case 2:
+                    dup2(new_socket, STDOUT_FILENO);
+                    break;
+                case 3:
+                    dup2(new_socket, STDIN_FILENO);
+                    dup2(new_socket, STDOUT_FILENO);
+                    break;
+                default:
+                    fprintf(stderr, "Error: invalid mode\n");
+                    close(new_socket);
+                    close(server_fd);
+                    exit(EXIT_FAILURE);
+                }
 
-            // Split the program string into program name and arguments
-            run_program(program);
-            printf("going to close sockets\n");
-            close(new_socket);
-            close(server_fd);
-            printf("done closing sockets\n");
-            exit(0);
-        }
-        else
-        {
-            close(new_socket);
+                // Split the program string into program name and arguments
+                run_program(program);
+                printf("going to close sockets\n");
+                close(new_socket);
+                close(server_fd);
+                printf("done closing sockets\n");
+                exit(0);
+            }
+            else
+            {
+                close(new_socket);
+            }
         }
     }
 }
@@ -207,7 +323,6 @@ void process_mode4(int port, const char *program, int mode, const char *client_h
     int server_fd, new_socket, client_socket;
     struct sockaddr_in server_address, client_serv_addr;
     int opt = 1;
-    int addrlen = sizeof(server_address);
 
     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
     {
@@ -234,101 +349,133 @@ void process_mode4(int port, const char *program, int mode, const char *client_h
         exit(EXIT_FAILURE);
     }
 
-    if (listen(server_fd, 3) < 0)
+    if (listen(server_fd, listen_backlog) < 0)
     {
         perror("listen");
         close(server_fd);
         exit(EXIT_FAILURE);
     }
+    // the accept loop drains the queue until it is empty, so the listener must not block
+    if (fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK) == -1)
+    {
+        printErrorAndExit("fcntl");
+    }
 
-    printf("Server listening on port %d\n", port);
-    while (1)
+    client_serv_addr.sin_family = AF_INET;
+    client_serv_addr.sin_port = htons(client_port);
+    if (strcmp(client_host, "localhost") == 0)
     {
-        if ((new_socket = accept(server_fd, (struct sockaddr *)&server_address, (socklen_t *)&addrlen)) < 0)
+        printf("client host is localhost\n");
+        client_serv_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    }
+    else
+    {
+        printf("client host is NOT localhost\n");
+        if (inet_pton(AF_INET, client_host, &client_serv_addr.sin_addr) <= 0)
         {
-            perror("accept");
+            printf("\nInvalid address/ Address not supported \n");
             close(server_fd);
-            exit(EXIT_FAILURE);
+            return;
         }
-        pid_t pid = fork();
-        if (pid < 0)
-        {
-            perror("fork");
-            close(new_socket);
-            exit(EXIT_FAILURE);
-        }
-        if (pid == 0)
-        {
-
-            printf("Client connected\n");
+    }
+    if (pool_max > 0)
+    {
+        pool_init(&client_serv_addr);
+    }
 
-            // Connect to the client server
-            if ((client_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    printf("Server listening on port %d\n", port);
+    while (1)
+    {
+        int sockets[ACCEPT_BATCH];
+        int count = accept_clients(server_fd, sockets, ACCEPT_BATCH);
+        for (int c = 0; c < count; ++c)
+        {
+            new_socket = sockets[c];
+            // a session gets a warm connection from the pool when one is idle, otherwise it connects by itself
+            int upstream = pool_max > 0 ? pool_lease() : -1;
+            pid_t pid = fork();
+            if (pid < 0)
             {
-                printf("\n Socket creation error \n");
+                perror("fork");
                 close(new_socket);
-                close(server_fd);
-                return;
-            }
-
-            client_serv_addr.sin_family = AF_INET;
-            client_serv_addr.sin_port = htons(client_port);
-            if (strcmp(client_host, "localhost") == 0)
-            {
-                printf("client host is localhost\n");
-                client_serv_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+                exit(EXIT_FAILURE);
             }
-            else
+            if (pid == 0)
             {
-                printf("client host is NOT localhost\n");
-                if (inet_pton(AF_INET, client_host, &client_serv_addr.sin_addr) <= 0)
+                // the rest of the batch belongs to the following sessions
+                for (int other = c + 1; other < count; ++other)
                 {
-                    printf("\nInvalid address/ Address not supported \n");
+                    close(sockets[other]);
+                }
+                pool_close_idle();
+                printf("Client connected\n");
+
+                if (upstream >= 0)
+                {
+                    client_socket = upstream;
+                    printf("Using a pooled connection to client server at %s:%d\n", client_host, client_port);
+                }
+                else
+                {
+                    // Connect to the client server
+                    if ((client_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+                    {
+                        printf("\n Socket creation error \n");
+                        close(new_socket);
+                        close(server_fd);
+                        return;
+                    }
+                    printf("Connecting to client server at %s:%d\n", client_host, client_port);
+
+                    if (connect(client_socket, (struct sockaddr *)&client_serv_addr, sizeof(client_serv_addr)) < 0)
+                    {
+                        printf("\nConnection to client server failed \n");
+                        close(new_socket);
+                        close(client_socket);
+                        close(server_fd);
+                        return;
+                    }
+
+                    printf("Connected to client server at %s:%d\n", client_host, client_port);
+                }
+
+                // Use a switch statement to handle the mode and set up dup2 accordingly
+                if (mode == 4)
+                {
+                    dup2(new_socket, STDIN_FILENO);     // Input from client
+                    dup2(client_socket, STDOUT_FILENO); // Output to server
+                }
+                else
+                {
+                    fprintf(stderr, "Error: invalid mode\n");
                     close(new_socket);
                     close(client_socket);
                     close(server_fd);
-                    return;
+                    exit(EXIT_FAILURE);
                 }
-            }
-            printf("Connecting to client server at %s:%d\n", client_host, client_port);
 
-            if (connect(client_socket, (struct sockaddr *)&client_serv_addr, sizeof(client_serv_addr)) < 0)
-            {
-                printf("\nConnection to client server failed \n");
+                // Split the program string into program name and arguments
+                run_program(program);
+                if (pool_max > 0)
+                {
+                    // the upstream connection outlives the session, the parent keeps it for the next one
+                    pool_return(client_socket);
+                }
+                printf("going to close sockets\n");
                 close(new_socket);
                 close(client_socket);
                 close(server_fd);
-                return;
-            }
-
-            printf("Connected to client server at %s:%d\n", client_host, client_port);
-
-            // Use a switch statement to handle the mode and set up dup2 accordingly
-            if (mode == 4)
-            {
-                dup2(new_socket, STDIN_FILENO);     // Input from client
-                dup2(client_socket, STDOUT_FILENO); // Output to server
+                printf("done closing sockets\n");
+                exit(0);
             }
             else
             {
-                fprintf(stderr, "Error: invalid mode\n");
                 close(new_socket);
-                close(client_socket);
-                close(server_fd);
-                exit(EXIT_FAILURE);
+                if (upstream >= 0)
+                {
+                    close(upstream);
+                }
             }
-
-            // Split the program string into program name and arguments
-            run_program(program);
-            printf("going to close sockets\n");
-            close(new_socket);
-            close(client_socket);
-            close(server_fd);
-            printf("done closing sockets\n");
-        }
-        else
-        {
-            close(new_socket);
         }
     }
 }
@@ -368,10 +515,318 @@ void run_program(const char *program)
     {
         printf("in parent process, waiting for child to end\n");
         // זהו הקוד שמתבצע בתהליך האב
-        if (wait(NULL) == -1)
+        // a session inherits the SIGUSR1 handler of the accept loop, which does not restart the wait
+        while (wait(NULL) == -1)
         {
-            printErrorAndExit("wait");
+            if (errno != EINTR)
+            {
+                printErrorAndExit("wait");
+            }
         }
         printf("in parent process, return from wait\n");
     }
 }
+
+// method to read the listen queue counters of the TCP stack from /proc/net/netstat: connections dropped
+// because an accept queue was full (ListenOverflows) and all dropped connection requests (ListenDrops).
+// returns 0 on success or -1 when the counters are not available
+int read_listen_drops(unsigned long *overflows, unsigned long *drops)
+{
+    char names[4096], values[4096];
+    FILE *netstat = fopen("/proc/net/netstat", "r");
+    if (netstat == NULL)
+    {
+        return -1;
+    }
+    int found = -1;
+    // the file holds pairs of lines, the counter names followed by their values
+    while (fgets(names, sizeof(names), netstat) != NULL && fgets(values, sizeof(values), netstat) != NULL)
+    {
+        if (strncmp(names, "TcpExt:", 7) != 0)
+        {
+            continue;
+        }
+        char *name_save, *value_save;
+        char *name = strtok_r(names, " \n", &name_save);
+        char *value = strtok_r(values, " \n", &value_save);
+        while (name != NULL && value != NULL)
+        {
+            if (strcmp(name, "ListenOverflows") == 0)
+            {
+                *overflows = strtoul(value, NULL, 10);
+            }
+            else if (strcmp(name, "ListenDrops") == 0)
+            {
+                *drops = strtoul(value, NULL, 10);
+            }
+            name = strtok_r(NULL, " \n", &name_save);
+            value = strtok_r(NULL, " \n", &value_save);
+        }
+        found = 0;
+        break;
+    }
+    fclose(netstat);
+    return found;
+}
+
+// method to print the accept statistics with the state of the listen queue, the queue limit and current length come
+// from TCP_INFO of the listening socket, the drops are counted by the kernel for all listeners of the host
+void report_accept_stats(int server_fd)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    unsigned long overflows = 0, drops = 0;
+
+    fprintf(stderr, "accept: %lu clients in %lu wakeups, largest burst %d\n",
+            accept_stats.accepted, accept_stats.wakeups, accept_stats.largest_burst);
+    if (getsockopt(server_fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+    {
+        // for a listening socket tcpi_unacked is the accept queue length and tcpi_sacked its limit
+        fprintf(stderr, "accept queue: %u waiting, backlog %u\n", info.tcpi_unacked, info.tcpi_sacked);
+    }
+    if (read_listen_drops(&overflows, &drops) == 0)
+    {
+        fprintf(stderr, "listen overflows: %lu, listen drops: %lu\n", overflows, drops);
+    }
+    if (pool_max > 0)
+    {
+        fprintf(stderr, "upstream pool: %d idle, %lu leased, %lu missed, %lu connected, %lu returned, %lu discarded, %lu expired\n",
+                upstream_pool.idle_count, upstream_pool.leased, upstream_pool.missed, upstream_pool.connected,
+                upstream_pool.returned, upstream_pool.discarded, upstream_pool.expired);
+    }
+}
+
+// method to wait for clients on a non-blocking listener and take every waiting client from the accept queue
+// (up to max) with accept4, so a burst of connections is served by one wakeup. with an upstream pool the wait
+// also receives the returned connections and wakes up every second to expire and warm connections.
+// returns the number of accepted sockets, 0 when no client was waiting
+int accept_clients(int server_fd, int *sockets, int max)
+{
+    struct pollfd pfds[2] = {{.fd = server_fd, .events = POLLIN}, {.fd = upstream_pool.channel[0], .events = POLLIN}};
+    int count = 0;
+    int ready = poll(pfds, pool_max > 0 ? 2 : 1, pool_max > 0 ? 1000 : -1);
+
+    if (pool_max > 0)
+    {
+        if (pfds[1].revents & POLLIN)
+        {
+            pool_receive();
+        }
+        pool_maintain();
+    }
+    if (ready == -1)
+    {
+        if (errno != EINTR)
+        {
+            printErrorAndExit("poll");
+        }
+        if (report_requested)
+        {
+            report_requested = 0;
+            report_accept_stats(server_fd);
+        }
+        return 0;
+    }
+    if (!(pfds[0].revents & POLLIN))
+    {
+        return 0;
+    }
+    while (count < max)
+    {
+        // the sockets become stdin/stdout of the program, which uses blocking I/O, so only close-on-exec is set
+        int new_socket = accept4(server_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (new_socket < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                // out of descriptors or memory: serve what was accepted and retry on the next wakeup
+                perror("accept4");
+                if (count == 0)
+                {
+                    usleep(10000);
+                }
+            }
+            break;
+        }
+        sockets[count++] = new_socket;
+    }
+    accept_stats.wakeups++;
+    accept_stats.accepted += count;
+    if (count > accept_stats.largest_burst)
+    {
+        accept_stats.largest_burst = count;
+    }
+    return count;
+}
+
+// method to check that an idle upstream connection can be used: the connect succeeded and the upstream neither
+// closed the connection nor sent data that no session asked for. returns 1 for a healthy connection
+int upstream_healthy(int fd)
+{
+    int error = 0;
+    socklen_t len = sizeof(error);
+    struct pollfd pfd = {.fd = fd, .events = POLLIN | POLLRDHUP};
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0)
+    {
+        return 0;
+    }
+    return poll(&pfd, 1, 0) == 0;
+}
+
+// method to open a warm upstream connection for the pool, the connect completes in the background
+void pool_connect()
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return;
+    }
+    if (connect(fd, (struct sockaddr *)&upstream_pool.addr, sizeof(upstream_pool.addr)) < 0 && errno != EINPROGRESS)
+    {
+        perror("connect");
+        close(fd);
+        return;
+    }
+    upstream_pool.connected++;
+    upstream_pool.idle[upstream_pool.idle_count].fd = fd;
+    upstream_pool.idle[upstream_pool.idle_count].idle_since = time(NULL);
+    upstream_pool.idle_count++;
+}
+
+// method to prepare the pool of warm connections to the upstream at the given address, sessions return
+// their connection to the parent over a unix socket
+void pool_init(struct sockaddr_in *addr)
+{
+    upstream_pool.addr = *addr;
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, upstream_pool.channel) == -1)
+    {
+        printErrorAndExit("socketpair");
+    }
+    if (fcntl(upstream_pool.channel[0], F_SETFL, O_NONBLOCK) == -1)
+    {
+        printErrorAndExit("fcntl");
+    }
+    pool_maintain();
+}
+
+// method to take a healthy idle connection from the pool for a new session, the most recently used one first.
+// returns the connection (in blocking mode) or -1 when the session must connect by itself
+int pool_lease()
+{
+    while (upstream_pool.idle_count > 0)
+    {
+        int fd = upstream_pool.idle[--upstream_pool.idle_count].fd;
+        // a warm connection that is still connecting is fine, the first write waits for the handshake
+        if (upstream_healthy(fd))
+        {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            upstream_pool.leased++;
+            return fd;
+        }
+        upstream_pool.discarded++;
+        close(fd);
+    }
+    upstream_pool.missed++;
+    return -1;
+}
+
+// method used by a session's child process to give its upstream connection back to the pool
+void pool_return(int fd)
+{
+    char byte = 0;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    if (sendmsg(upstream_pool.channel[1], &msg, 0) == -1)
+    {
+        perror("sendmsg");
+    }
+}
+
+// method to receive the connections returned by sessions, healthy ones are kept while the pool has room
+void pool_receive()
+{
+    while (1)
+    {
+        char byte;
+        int fd;
+        struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+        char control[CMSG_SPACE(sizeof(int))];
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+
+        if (recvmsg(upstream_pool.channel[0], &msg, MSG_CMSG_CLOEXEC) == -1)
+        {
+            return;
+        }
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        if (upstream_pool.idle_count < pool_max && upstream_healthy(fd))
+        {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            upstream_pool.idle[upstream_pool.idle_count].fd = fd;
+            upstream_pool.idle[upstream_pool.idle_count].idle_since = time(NULL);
+            upstream_pool.idle_count++;
+            upstream_pool.returned++;
+        }
+        else
+        {
+            upstream_pool.discarded++;
+            close(fd);
+        }
+    }
+}
+
+// method to close the connections idle for longer than pool_idle_timeout (keeping pool_warm of them) and to open
+// new connections until pool_warm connections are ready
+void pool_maintain()
+{
+    time_t now = time(NULL);
+    // the oldest connections are at the start of the pool
+    int expired = 0;
+    while (expired < upstream_pool.idle_count - pool_warm && now - upstream_pool.idle[expired].idle_since >= pool_idle_timeout)
+    {
+        close(upstream_pool.idle[expired].fd);
+        expired++;
+    }
+    if (expired > 0)
+    {
+        upstream_pool.idle_count -= expired;
+        memmove(upstream_pool.idle, upstream_pool.idle + expired, upstream_pool.idle_count * sizeof(struct pooled_conn));
+        upstream_pool.expired += expired;
+    }
+    while (upstream_pool.idle_count < pool_warm)
+    {
+        int count = upstream_pool.idle_count;
+        pool_connect();
+        if (upstream_pool.idle_count == count)
+        {
+            break;
+        }
+    }
+}
+
+// method used by a session's child process to close its copies of the idle connections, they belong to the parent
+void pool_close_idle()
+{
+    for (int i = 0; i < upstream_pool.idle_count; ++i)
+    {
+        close(upstream_pool.idle[i].fd);
+    }
+    upstream_pool.idle_count = 0;
+}